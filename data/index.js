@@ -42,6 +42,10 @@ function onClose(event) {
 
 function onMessage(event) {
     let data = JSON.parse(event.data);
+    if (data.error) {
+        console.log('Command refused: ' + data.error);
+        return;
+    }
     document.getElementById('source').innerHTML = data.source;
     document.getElementById('volume').innerHTML = data.volume;
     if (data.mute == "off")
@@ -54,6 +58,16 @@ function onMessage(event) {
         document.getElementById('volume').className = "on";
         document.getElementById('muted').className = "off";
     }
+    if (data.learn == "off")
+    {
+        document.getElementById('learn').innerHTML = "Learn";
+        document.getElementById('learnstatus').innerHTML = data.learned ? "Learned " + data.learned : "";
+    }
+    else if (data.learn)
+    {
+        document.getElementById('learn').innerHTML = "Cancel";
+        document.getElementById('learnstatus').innerHTML = "Press the remote key for " + data.learn;
+    }
 }
 // ----------------------------------------------------------------------------
 // Button handling
@@ -67,6 +81,7 @@ function initButton() {
     document.getElementById('voldown').addEventListener('click', onVoldown);
     document.getElementById('volup').addEventListener('click', onVolup);
     document.getElementById('mute').addEventListener('click', onMute);
+    document.getElementById('learn').addEventListener('click', onLearn);
 }
 
 function onPhono(event) {
@@ -94,4 +109,10 @@ function onVolup(event) {
 
 function onMute(event) {
     websocket.send(JSON.stringify({'Mute':'toggle'}));
+}
+
+function onLearn(event) {
+    let waiting = document.getElementById('learn').innerHTML == "Cancel";
+    let action = document.getElementById('action').value;
+    websocket.send(JSON.stringify({'Learn':waiting ? 'cancel' : action}));
 }
\ No newline at end of file
@@ -0,0 +1,38 @@
+/* Velocity based volume acceleration
+*********************
+
+Shared by the rotary encoder and held remote volume keys. Each input keeps an
+Accel with a smoothed event rate; the rate selects a multiplier from
+ACCEL_CURVE so fast spins (or a held key) cover the volume taper in a
+fraction of the detents, while slow turns still move one position at a time.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef ACCEL_CURVE
+// {events per second, volume steps per event}, in ascending rate order
+#define ACCEL_CURVE {{0, 1}, {10, 2}, {20, 4}, {35, 8}}
+#endif
+
+#ifndef ACCEL_RESET_MS
+#define ACCEL_RESET_MS 200 // a pause this long drops back to single steps
+#endif
+
+#define ACCEL_SMOOTHING 4  // rate moves 1/ACCEL_SMOOTHING of the way to each new sample
+#define ACCEL_RATE_MAX 1000 // upper limit of a rate sample
+
+struct Accel
+{
+  uint8_t weight;          // rate counted per event (remote repeats arrive slower than detents)
+  uint16_t rate;           // smoothed rate, weighted events per second
+  int8_t direction;        // sign of the previous event
+  unsigned long milOnLast; // time of the previous event, 0 after a reset
+};
+
+// Number of volume steps for `events` (signed) arriving at time `now`
+int32_t accelSteps(Accel &accel, int32_t events, unsigned long now);
+// Start again from single steps (e.g. a new RC5 key press)
+void accelReset(Accel &accel);
@@ -0,0 +1,57 @@
+/* Static web assets
+*********************
+
+The web UI's script, style sheet and icon go into the file system image
+minified and gzipped, as <name>.gz next to the original (scripts/assets.py
+runs before each build). The first request for an asset reads it into
+RAM, if it is no bigger than ASSET_CACHE_MAX, and every request after that
+is sent from there with Content-Encoding: gzip, a strong ETag (a hash of
+the bytes) and a max-age of a year. A request that already has that ETag
+gets 304 Not Modified. The page template is kept the same way,
+uncompressed, and filled in for each request.
+
+The page links the assets as <name>?v=<assetVersion()>, so a new file
+system image changes the links and browsers fetch them again, however
+long they were told to keep the old ones. Clients that do not take gzip,
+and assets that are missing or too big, get the plain file from flash.
+
+Only the AsyncTCP task serves the assets, so the cache needs no lock.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ASSET_CACHE_MAX
+#define ASSET_CACHE_MAX 8192 // largest file kept in RAM
+#endif
+#define ASSET_CACHE_CONTROL "public, max-age=31536000, immutable" // the links change with the contents
+#define ASSET_PAGE "/index.html"
+#define ASSETS 4
+
+struct Asset
+{
+  const char *path; // URL, and the file name of the plain version
+  const char *type;
+  bool gzip;        // sent from <path>.gz
+  bool read;        // tried to read it, whether or not it was there
+  uint8_t *data;    // NULL if it could not be cached
+  size_t len;
+  char etag[19];    // quoted 64-bit hash
+};
+
+struct AssetStats
+{
+  uint32_t requests;    // assetFind() calls
+  uint32_t flashReads;  // files read into the cache
+  uint32_t notModified; // requests answered 304
+};
+
+extern Asset assets[ASSETS];
+
+Asset *assetFind(const char *path);                          // the cached asset, NULL to send the plain file
+bool assetFresh(const Asset &asset, const char *ifNoneMatch); // the client's copy is current
+const char *assetVersion(void);                              // hash of the gzipped assets, for the page's links
+const AssetStats &assetStats(void);
@@ -0,0 +1,87 @@
+/* Binary WebSocket protocol
+*********************
+
+A fixed 12 byte frame for automation clients, offered next to the JSON
+messages used by index.js on the same /ws endpoint. A client asks for it in
+the WebSocket handshake, with BINARY_SUBPROTOCOL as its only
+Sec-WebSocket-Protocol (ESPAsyncWebServer echoes the header as sent, so a
+list would fail the handshake):
+
+  new WebSocket("ws://esp32hifi.local/ws", "preamp.binary")
+
+and is sent BINARY_STATE frames instead of JSON for as long as it stays
+connected. Clients that ask for no subprotocol get JSON. Either kind may
+send binary commands. Nothing is allocated or parsed.
+
+All fields are little-endian.
+
+  offset  size  field
+  0       1     magic     'P' (0x50)
+  1       1     version   BINARY_PROTOCOL_VERSION
+  2       1     type      BINARY_STATE / BINARY_COMMAND / BINARY_REFUSED
+  3       1     flags     BINARY_FLAG_MUTED, BINARY_FLAG_STANDBY in state frames
+  4       4     sequence  state sequence number (state frames)
+  8       2     volume    volume steps, -447 (-111.75dB) to 0
+  10      1     source    input 1-4
+  11      1     command   BINARY_CMD_* (command and refused frames)
+
+The sequence number goes up by one for every distinct state the controller
+broadcasts. Changes merged by the broadcast coalescer never get a number, so
+a gap means states this client was not sent: held back by its rate cap, or
+lost with a dropped connection. The frame that ends a gap is always the
+latest state.
+
+A command the controller could not take, because its input queue was full,
+is answered with a BINARY_REFUSED frame naming it in `command`; nothing
+else in that frame is set. The command had no effect and may be sent
+again.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "controller.h"
+
+#define BINARY_MAGIC 0x50 // 'P'
+#define BINARY_PROTOCOL_VERSION 1
+#define BINARY_SUBPROTOCOL "preamp.binary" // Sec-WebSocket-Protocol of binary clients
+
+// Frame types
+#define BINARY_STATE 2   // controller -> client
+#define BINARY_COMMAND 3 // client -> controller
+#define BINARY_REFUSED 4 // controller -> client, a command was not queued
+
+// State flags
+#define BINARY_FLAG_MUTED 0x01
+#define BINARY_FLAG_STANDBY 0x02
+
+// Commands
+#define BINARY_CMD_SOURCE 1      // select `source`
+#define BINARY_CMD_VOLUME_UP 2   // one taper position up
+#define BINARY_CMD_VOLUME_DOWN 3 // one taper position down
+#define BINARY_CMD_MUTE_TOGGLE 4
+#define BINARY_CMD_VOLUME 5 // set `volume`, unmuting
+#define BINARY_CMD_STATE 6  // set `source`, `volume`, BINARY_FLAG_MUTED and BINARY_FLAG_STANDBY together; other commands leave standby
+
+struct BinaryFrame
+{
+  uint8_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t sequence;
+  int16_t volume;
+  uint8_t source;
+  uint8_t command;
+};
+
+static_assert(sizeof(BinaryFrame) == 12, "BinaryFrame must stay 12 bytes");
+
+// Fill in a state frame from the current controller state
+void binaryStateFrame(BinaryFrame &frame, const ControlSnapshot &snapshot, uint32_t sequence);
+// Fill in the answer to a binary message that was not queued
+void binaryRefusedFrame(BinaryFrame &frame, const uint8_t *data, size_t len);
+// Handle a binary WebSocket message, false if it is not a valid frame
+bool handleBinaryMessage(const uint8_t *data, size_t len);
@@ -0,0 +1,49 @@
+/* Coalesced WebSocket state broadcasts
+*********************
+
+notifyClients() only asks for a broadcast. State changes that arrive within
+BROADCAST_WINDOW_MS of the first one go out as a single frame, a frame that
+matches the last one sent is dropped, and no client is sent more than one
+frame per BROADCAST_MIN_INTERVAL_MS; a client held back by the cap gets the
+latest state when its interval is up.
+
+Each client is sent either the JSON message or a BinaryFrame
+(binary_protocol.h), both carrying the same state sequence number.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#ifndef BROADCAST_WINDOW_MS
+#define BROADCAST_WINDOW_MS 30 // changes within this window are merged into one frame
+#endif
+
+#ifndef BROADCAST_MIN_INTERVAL_MS
+#define BROADCAST_MIN_INTERVAL_MS 100 // at most 10 frames a second per client
+#endif
+
+#define BROADCAST_MAX_CLIENTS 8   // matches the WebSocket server's client limit
+#define BROADCAST_FRAME_SIZE 160  // largest state frame
+#define BROADCAST_RETRY_MS 10     // retry interval when a client's send queue is full
+#define BROADCAST_IDLE_NONE 0xFFFFFFFFUL // nothing waiting to be sent
+
+struct BroadcastStats
+{
+  std::atomic<uint32_t> requested;   // notifyClients() calls
+  std::atomic<uint32_t> composed;    // distinct states built (one sequence number each)
+  std::atomic<uint32_t> unchanged;   // frames dropped because the state matched the last frame
+  std::atomic<uint32_t> sent;        // frames sent, summed over clients
+  std::atomic<uint32_t> rateLimited; // frames put off by the per-client cap, once each
+  std::atomic<uint32_t> queueFull;   // sends put off because the client could not take more
+};
+
+void broadcastRequest(void);                     // state changed, send it soon
+void broadcastClientConnected(uint32_t client, bool binary); // WebSocket client opened, binary if it asked for BINARY_SUBPROTOCOL
+void broadcastClientDisconnected(uint32_t client);
+uint32_t broadcastSequence(void);                // sequence number of the last state built
+unsigned long broadcastUpdate(void);             // send what is due, returns ms until more is due
+const BroadcastStats &broadcastStats(void);
@@ -0,0 +1,86 @@
+/* Input command queue
+*********************
+
+Inputs reach the controller as timestamped commands in one bounded,
+lock-free queue: encoder detents and button presses from their interrupts,
+WebSocket messages from the AsyncTCP task. Only the control task (loop())
+takes commands out and applies them, through commandUpdate() in
+controller.cpp, so volume, source, mute and the hardware have a single
+owner. Remote frames already come through a lock-free ring of IR edges
+(ir.h) and are decoded and applied by the same commandUpdate() pass.
+
+Producers never block: each claims a slot with one compare-and-swap and
+publishes it with a per-slot sequence number, so an interrupt can queue a
+detent while a WebSocket message is half copied into the slot before it.
+A full queue refuses the command and counts it.
+
+A slot holds COMMAND_DATA_MAX bytes, enough for any single command. A
+longer WebSocket message, such as a batch of commands, is copied into one
+of COMMAND_LONG_BUFFERS shared buffers instead, claimed with one
+compare-and-swap and freed by commandRelease() once it has been applied.
+Up to COMMAND_LONG_MAX bytes are taken: a whole TCP segment, the most a
+WebSocket message brings to the server in one piece.
+
+The time from an input arriving to its command being applied is kept per
+source; for a remote key, from the last edge of its frame.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Command sources, in commandSourceName order
+#define COMMAND_KNOB 0      // data: int32_t detents
+#define COMMAND_BUTTON 1    // encoder push button, no data
+#define COMMAND_IR 2        // timing only, frames come from the IR edge ring
+#define COMMAND_WS_TEXT 3   // data: JSON message
+#define COMMAND_WS_BINARY 4 // data: BinaryFrame, client set
+#define COMMAND_SOURCES 5
+
+#ifndef COMMAND_QUEUE_SIZE
+#define COMMAND_QUEUE_SIZE 16 // slots, a power of two
+#endif
+#ifndef COMMAND_LONG_BUFFERS
+#define COMMAND_LONG_BUFFERS 4 // longer messages waiting at once, at most 32
+#endif
+#define COMMAND_DATA_MAX 128   // longest message kept in the slot
+#define COMMAND_LONG_MAX 1436  // longest message queued, one TCP segment
+#define COMMAND_NO_BUFFER 0xFF
+
+struct Command
+{
+  uint8_t source;   // COMMAND_KNOB...
+  uint8_t buffer;   // long buffer holding the data, COMMAND_NO_BUFFER if it is in `data`
+  uint16_t len;     // bytes of data
+  uint32_t client;  // WebSocket client the message came from
+  uint32_t us;      // micros() when the input arrived
+  uint8_t data[COMMAND_DATA_MAX];
+};
+
+struct CommandStats
+{
+  std::atomic<uint32_t> queued[COMMAND_SOURCES];
+  std::atomic<uint32_t> refused; // queue or long buffers full, or message too long
+  uint32_t applied[COMMAND_SOURCES];
+  uint32_t lastUs[COMMAND_SOURCES];  // input to applied
+  uint32_t worstUs[COMMAND_SOURCES];
+  uint64_t totalUs[COMMAND_SOURCES];
+  uint32_t depthMax;                 // most commands waiting at once
+};
+
+extern const char *commandSourceName[COMMAND_SOURCES];
+
+// Any task or interrupt: queue a command that arrived at time `us`, false if refused
+bool commandQueue(uint8_t source, uint32_t client, const void *data, size_t len, uint32_t us);
+// Control task only: the oldest command, false if there is none
+bool commandTake(Command &command);
+// The command's data, in the slot or its long buffer
+const uint8_t *commandData(const Command &command);
+// Control task only: done with the command's data, frees its long buffer
+void commandRelease(Command &command);
+// Control task only: `count` commands from `source`, the oldest queued at `us`, have been applied
+void commandApplied(uint8_t source, uint32_t us, uint32_t count = 1);
+const CommandStats &commandStats(void);
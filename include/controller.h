@@ -0,0 +1,147 @@
+/* Pre-amp controller logic
+*********************
+
+Volume, source, mute and remote control handling shared by the ESP32
+firmware (main.cpp) and the native host build. All hardware access goes
+through hal.h.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/******* MACHINE STATES *******/
+#define STATE_BALANCE 1 // when user adjusts balance
+#define STATE_RUN 0     // normal run state
+#define STATE_IO 1      // when user selects input/output
+#define STATE_OFF 4     // when power down
+#define ON LOW
+#define OFF HIGH
+#define STANDBY 0 // Standby
+#define ACTIVE 1  // Active
+
+#define TIME_EXITSELECT 5 //** Time in seconds to exit I/O select mode when no activity
+
+#define VOLUME_MIN -447 // lowest volume step (-111.75dB)
+#define VOLUME_MAX 0    // highest volume step (0dB)
+
+#ifndef STANDBY_RESUME_BOUND_MS
+#define STANDBY_RESUME_BOUND_MS 100 // leaving standby must restore the level within this
+#endif
+
+#ifndef SWITCH_FADE_MS
+#define SWITCH_FADE_MS 60 // source switch: soft mute before the relays move
+#endif
+#ifndef SWITCH_SETTLE_MS
+#define SWITCH_SETTLE_MS 20 // source switch: relay bounce and DC settling, output still muted
+#endif
+#ifndef SWITCH_RESTORE_MS
+#define SWITCH_RESTORE_MS 120 // source switch: level back up on the new input
+#endif
+
+#ifndef IR_REPEAT_WEIGHTS
+// Detents each repeat of a held remote volume key counts as, by protocol
+// (IR_RC5...). A held key repeats every 114ms on RC5, 107ms on RC6, 108ms
+// on NEC and 45ms on SIRC; SIRC repeats count for less, so a held key
+// moves the volume at about the same speed on every remote.
+#define IR_REPEAT_WEIGHTS {4, 4, 4, 1}
+#endif
+
+// State change flags, consumed by the render task and the settings cache
+#define CHANGED_VOLUME 0x01    // volume level
+#define CHANGED_SOURCE 0x02    // selected input
+#define CHANGED_MUTE 0x04      // mute status
+#define CHANGED_BACKLIGHT 0x08 // backlight on/off
+#define CHANGED_POWER 0x10     // standby entered or left
+#define CHANGED_KEYMAP 0x20    // remote key learned
+#define CHANGED_LEARN 0x40     // learn mode started or stopped
+
+/********* Controller state *******************/
+extern int16_t volume;   // current volume, between 0 and -447
+extern bool backlight;   // current backlight state
+extern uint8_t source;    // current input channel
+extern bool isMuted;      // current mute status
+extern uint8_t state;     // current machine state
+extern unsigned long milOnButton; // Stores last time for switch press
+
+extern const char *inputName[];
+
+// Complete controller state, for commands that set several things at once
+struct ControlTarget
+{
+  int16_t volume;
+  uint8_t source;
+  bool muted;
+  bool standby;
+};
+
+// What the panel, the WebSocket clients and the settings cache are shown.
+// The control task publishes one with every state change; the other tasks
+// read only that, never the globals above, so they always see a whole
+// change and a frame agrees with the sequence number it goes out under.
+struct ControlSnapshot
+{
+  int16_t volume;
+  uint8_t source;
+  bool muted;
+  bool standby;
+  bool backlight;
+  uint8_t learn;           // action waiting for a key, KEY_NONE if not learning
+  uint8_t learnedAction;   // last key learned, KEY_NONE if none yet
+  uint8_t learnedProtocol; // IR_* of the last key learned
+  uint8_t learnedCommand;
+  uint16_t learnedAddress;
+};
+
+struct SwitchStats
+{
+  uint32_t requests;    // source changes asked for
+  uint32_t relayWrites; // expander writes, fewer when requests collapse
+  uint32_t lastUs;      // request to level restored
+  uint32_t worstUs;
+};
+
+struct StandbyStats
+{
+  uint32_t entered;
+  uint32_t resumed;
+  uint32_t lastResumeUs;  // wake-up to volume back at its level
+  uint32_t worstResumeUs;
+};
+
+// Controller routines
+void controllerBegin(void);
+void encoderTurned(long value);  // ISR: queue detents for the control task
+void encoderPressed(void);       // ISR: queue a button press
+void commandUpdate(void);        // control task: apply queued commands and remote keys (command.h), call each pass
+void setIO();
+void volumeUpdate(int32_t detents);
+void setVolume();
+void stepVolume(int32_t steps);     // move the volume by taper positions (taper.h), unmuting first
+void selectSource(uint8_t input);   // switch to input 1-4
+ControlTarget currentTarget(void);
+void applyTarget(const ControlTarget &target); // one relay switch, one volume transition, one notification
+void sourceUpdate(int32_t detents);
+void switchUpdate(void);  // run the source switch pipeline, call each control pass
+bool switchActive(void);  // a source switch is fading, settling or restoring
+const SwitchStats &switchStats(void);
+void mute();
+void unMute();
+void toggleMute();
+void standbyEnter(void); // mute, blank the panel, let WiFi sleep; the control loop may block
+void standbyExit(void);  // back to the source and level in use before standby
+bool inStandby(void);
+bool standbyUpdate(void); // call each control pass, true when it may block until the next event
+const StandbyStats &standbyStats(void);
+void learnStart(uint8_t action); // bind the next remote key to a KEY_* action, KEY_NONE cancels
+uint8_t learning(void);          // action waiting for a key, KEY_NONE if not learning
+void notifyClients(void);
+ControlSnapshot controlSnapshot(void); // any task: the state last published by the control task
+size_t stateFrame(const ControlSnapshot &snapshot, char *buffer, size_t size); // JSON state message for WebSocket clients
+void handleCommandMessage(const uint8_t *data, size_t len); // control task: apply a JSON WebSocket message
+
+// Deferred work, run outside the control path
+#define RENDER_IDLE_NONE 0xFFFFFFFFUL // renderUpdate(): nothing waiting to be drawn
+unsigned long renderUpdate(void); // draw changed state on the TFT and notify clients, returns ms until a merged frame is due
@@ -0,0 +1,68 @@
+/* TFT scene compositor
+*********************
+
+The run-time screen is a small scene of widgets: the clock, the level
+(volume in dB, or "Muted") and the source name. Each widget renders into
+its own TFT_eSprite, and displayUpdate() pushes only the part of a changed
+widget whose pixels can differ from what is already on the panel: the
+columns between the old and new text's common prefix and suffix, and of
+those only the rows the font's glyphs can reach, instead of filling the
+screen or redrawing padded strings.
+
+Frames are paced: renderUpdate() draws at most one frame every
+DISPLAY_FRAME_MS and state changes arriving in between are merged into the
+next one. Pixels go out with TFT_eSPI's DMA in strips of DISPLAY_DMA_LINES
+rows through two staging buffers, so the next strip is converted from the
+8-bit sprite while the previous one is still on the bus. A volume or relay
+write waiting for the bus gets it between two strips (see spibus.h). If
+the heap has no DMA-capable memory for the staging buffers, rows are
+pushed one at a time instead, each transfer blocking.
+
+Text is drawn from the smooth fonts in data/ once they are loaded (see
+glyphs.h); until then, or if a font file is missing, the free fonts are
+used.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DISPLAY_TEXT_SIZE 24 // longest widget text, including the terminator
+
+// Smooth fonts, loaded from LittleFS by displayLoadFont()
+#define DISPLAY_FONT_READOUT 0 // /NotoSansBold36.vlw: level and source name
+#define DISPLAY_FONT_CLOCK 1   // /NotoSansMonoSCB20.vlw: clock
+#define DISPLAY_SOURCE_GLYPHS "PhonoMediaCDTuner" // letters of inputName[], cached with the readout font
+
+#ifndef DISPLAY_FRAME_MS
+#define DISPLAY_FRAME_MS 40 // shortest time between frames (25 frames per second)
+#endif
+
+#ifndef DISPLAY_DMA_LINES
+#define DISPLAY_DMA_LINES 12 // rows per DMA strip
+#endif
+
+struct DisplayStats
+{
+  uint32_t updates;    // displayUpdate() calls that pushed something
+  uint32_t pushes;     // sprite windows pushed
+  uint32_t pixels;     // pixels pushed in total
+  uint32_t lastPixels; // pixels pushed by the last update
+  uint32_t frames;     // frames drawn, clock only frames included
+  uint32_t merged;     // state changes folded into a later frame
+  uint32_t frameUs;    // duration of the last frame, DMA included
+  uint32_t frameUsMax; // longest frame
+  uint64_t frameUsTotal;
+};
+
+void displayBegin(void);                          // create the widget sprites, clear the screen
+void displaySetLevel(int16_t volume, bool muted); // volume steps, or the mute indicator
+void displaySetSource(const char *name);
+void displaySetClock(const char *text);
+bool displayLoadFont(uint8_t font, const uint8_t *vlw, size_t len); // cache a .vlw font image, false if unusable
+void displayClear(void);              // redraw everything on the next update
+unsigned long displayFrameWait(void); // ms until the next frame may be drawn
+uint32_t displayUpdate(uint32_t changes = 1); // push changed regions, returns pixels pushed; changes counts the state changes this frame shows
+const DisplayStats &displayStats(void);
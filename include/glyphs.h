@@ -0,0 +1,60 @@
+/* Smooth font glyph cache
+*********************
+
+Anti-aliased glyphs from the TFT_eSPI .vlw fonts in data/, loaded once at
+boot. Only the characters a readout can show are kept, and each glyph is
+blended against the fixed text and background colours when it is loaded,
+so drawing a string is a copy of 8-bit sprite pixels with no font parsing
+or alpha blending.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define GLYPH_MAX 40   // glyphs kept per font
+#ifndef GLYPH_PIXELS_MAX
+#define GLYPH_PIXELS_MAX 32768 // pixel store per font, bytes
+#endif
+#define GLYPH_SIZE_MAX 255 // widest and tallest glyph, and longest advance
+#define GLYPH_FIRST 32 // printable ASCII only
+#define GLYPH_LAST 126
+
+struct Glyph
+{
+  uint8_t width, height; // bitmap size
+  uint8_t advance;       // pen movement after the glyph
+  int8_t dx;             // bitmap left edge from the pen position
+  int8_t dy;             // bitmap top edge above the baseline
+  uint32_t offset;       // first pixel in GlyphFont::pixels
+};
+
+struct GlyphFont
+{
+  uint8_t count;   // glyphs cached
+  uint8_t ascent;  // line height above and below the baseline
+  uint8_t descent;
+  uint8_t space;   // advance for ' ', which .vlw files do not carry
+  uint8_t background; // 8-bit colour the glyphs were blended against
+  int16_t inkTop;     // rows from the line top that the cached glyphs cover
+  int16_t inkBottom;
+  uint8_t index[GLYPH_LAST - GLYPH_FIRST + 1]; // character to glyph number + 1, 0 if not cached
+  Glyph glyphs[GLYPH_MAX];
+  uint8_t *pixels; // 8-bit colours, width * height per glyph
+};
+
+// Parse a .vlw file image and keep the glyphs for chars, blended from bg to fg
+// (16-bit colours). False, with nothing cached, if the data is not a .vlw font,
+// its header or glyph table does not fit the file, or a glyph does not fit
+// the cache; the text is then drawn in the built-in font.
+bool glyphFontLoad(GlyphFont &font, const uint8_t *vlw, size_t len, const char *chars, uint16_t fg, uint16_t bg);
+void glyphFontFree(GlyphFont &font);
+int16_t glyphTextWidth(const GlyphFont &font, const char *text);
+uint8_t glyphLineHeight(const GlyphFont &font);
+// Rows, from the line top, that any cached glyph can draw on
+void glyphInkRows(const GlyphFont &font, int16_t &top, int16_t &bottom);
+// Copy the glyphs of text into an 8-bit pixel buffer, left edge x, line top y.
+// Characters that are not cached are skipped.
+void glyphDraw(const GlyphFont &font, uint8_t *target, int16_t width, int16_t height, int16_t x, int16_t y, const char *text);
@@ -0,0 +1,53 @@
+/* Hardware abstraction for the pre-amp controller logic
+*********************
+
+The controller routines (controller.cpp) only talk to the hardware through
+the objects and functions declared here. On the ESP32 they are the real
+library objects defined in main.cpp; the [env:native] build links the fake
+backends in src/native instead, so the same logic runs on a Linux host.
+
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <TFT_eSPI.h>   // Hardware-specific library
+#include <muses72323.h> // Hardware-specific library
+#include <MCP23S08.h>   // Hardware-specific library
+
+extern Preferences preferences;
+extern MCP23S08 MCP;
+extern TFT_eSPI tft;
+extern Muses72323 Muses;
+
+// Send a text frame to one WebSocket client, false if its send queue is full
+bool halSendText(uint32_t client, const char *data, size_t len);
+bool halSendBinary(uint32_t client, const uint8_t *data, size_t len);
+
+// Wake the render and persistence tasks after the controller state changed
+void halStateChanged(void);
+
+// Put the panel and WiFi into (or take them out of) their low power states
+void halStandby(bool standby);
+
+// Set the SPI clock for a bus device whose library does not set its own
+// (spibus.h); called with the bus held, outside any transaction
+void halBusClock(uint8_t device);
+
+// Heap, WiFi and loop readings for /metrics (metrics.h)
+struct HealthSample;
+void halHealth(HealthSample &sample);
+
+// Control task only: after us microseconds, interrupt it and call
+// stallOverrun() with the program counters of its stack where it was
+// stopped, innermost first (stall.h); 0 cancels the alarm
+void halStallAlarm(uint32_t us);
+
+// Memory the SPI DMA engine can read, NULL if there is none left; free()
+// releases it
+void *halDmaMalloc(size_t size);
+
+// Whole-file access to the flash file system, 0 / false if it fails
+size_t halReadFile(const char *path, uint8_t *data, size_t size);
+bool halWriteFile(const char *path, const uint8_t *data, size_t len);
@@ -0,0 +1,64 @@
+/* Infra-red receiver
+*********************
+
+The receiver pin interrupt timestamps every edge into a lock-free ring
+buffer (irEdge(), the only producer); irRead() on the control task (the
+only consumer) turns the buffered timestamps into mark and space lengths
+and feeds them to one decoder per protocol. Decoding works from the edge
+times, not from when it runs, so a busy loop() only delays a frame and
+never corrupts one, as long as fewer than IR_RING_SIZE edges pile up.
+
+The protocols are rows of a timing table (irProtocols in ir.cpp): RC5 and
+RC6 mode 0 are bi-phase coded, NEC is pulse-distance and Sony SIRC is
+pulse-width coded. NEC and SIRC have no toggle bit, so one is made up: it
+flips on each new key press and stays put while a key is held.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#ifndef IR_RING_SIZE
+#define IR_RING_SIZE 256 // edges buffered, a power of two; an NEC frame has 68
+#endif
+
+#define IR_GAP_US 6000           // a space this long ends a frame (longest in a frame: NEC 4500us leader)
+#define IR_FRAME_TIMEOUT_MS 7    // loop() wait for the gap after the last edge
+#define IR_HOLD_US 150000        // frames of the same key this close together are one held press
+#define IR_RC5_HALF_US 889       // RC5 half-bit time
+
+// Protocols, in irProtocols order
+#define IR_RC5 0
+#define IR_RC6 1
+#define IR_NEC 2
+#define IR_SIRC 3
+#define IR_PROTOCOLS 4
+
+struct IrFrame
+{
+  uint8_t protocol; // IR_RC5...
+  uint8_t toggle;   // changes on each new key press
+  uint16_t address; // system (RC5/RC6), device (NEC, 16 bits when extended) or device and extension (SIRC)
+  uint8_t command;
+  uint32_t us;      // last edge of the burst
+};
+
+struct IrStats
+{
+  std::atomic<uint32_t> edges;     // edges captured by the interrupt
+  std::atomic<uint32_t> overflows; // edges dropped because the ring was full
+  std::atomic<uint32_t> frames;    // frames decoded
+  std::atomic<uint32_t> repeats;   // NEC repeat codes
+  std::atomic<uint32_t> errors;    // bursts no protocol could decode
+  std::atomic<uint32_t> protocol[IR_PROTOCOLS]; // frames decoded per protocol
+};
+
+extern const char *irProtocolName[IR_PROTOCOLS];
+
+void irEdge(uint32_t us, bool level); // from the pin interrupt: time and new level of an edge
+bool irRead(IrFrame &frame);          // next decoded frame, if any
+bool irIdle(void);                    // no frame partly received
+int irProtocolIndex(const char *name); // IR_RC5... for a protocol name, -1 if unknown
+const IrStats &irStats(void);
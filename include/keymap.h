@@ -0,0 +1,52 @@
+/* Remote control key map
+*********************
+
+Maps decoded IR frames (protocol, address, command) to controller actions
+through an open-addressed hash table, so finding a key's action is one
+hash and, almost always, one probe however many remotes are mapped. The
+map starts with the codes of the original RC5 handset and is then loaded
+from /keymap.json on LittleFS when that exists:
+
+  [{"protocol":"NEC","address":4,"command":2,"action":"VolumeUp"}, ...]
+
+keymapLearn() binds a new code from the web UI's learn mode; the map is
+written back by the persistence task (CHANGED_KEYMAP). Only the control
+task looks up and binds codes; keymapSave() works from a copy taken under
+the same lock a binding holds.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ir.h"
+
+#ifndef KEYMAP_SLOTS
+#define KEYMAP_SLOTS 64 // hash table size, a power of two
+#endif
+#define KEYMAP_MAX (KEYMAP_SLOTS * 3 / 4) // codes mapped at most, keeps probe runs short
+#define KEYMAP_FILE "/keymap.json"
+#define KEYMAP_FILE_MAX 4096 // longest key map file
+
+// Actions, in keyActionName order
+#define KEY_NONE 0
+#define KEY_PHONO 1 // KEY_PHONO...KEY_TUNER are inputs 1-4
+#define KEY_MEDIA 2
+#define KEY_CD 3
+#define KEY_TUNER 4
+#define KEY_VOLUME_UP 5
+#define KEY_VOLUME_DOWN 6
+#define KEY_MUTE 7
+#define KEY_STANDBY 8
+#define KEY_DISPLAY 9
+#define KEY_ACTIONS 10
+
+extern const char *keyActionName[KEY_ACTIONS];
+
+void keymapBegin(void);                        // default map, then the file if there is one
+uint8_t keymapLookup(const IrFrame &frame);    // KEY_NONE for an unmapped code
+bool keymapLearn(const IrFrame &frame, uint8_t action); // bind a code, false when the map is full
+uint8_t keymapAction(const char *name);        // KEY_NONE if the name is unknown
+size_t keymapCount(void);
+bool keymapSave(void);                         // write the map to KEYMAP_FILE
@@ -0,0 +1,34 @@
+/* Health metrics
+*********************
+
+GET /metrics returns the controller's health counters in the Prometheus
+text format, for a scraper or a quick look with curl. Everything reported
+is either an atomic counter kept by its own module (broadcast, settings,
+spibus, ir, command) or a platform reading taken by halHealth(), so a
+scrape only loads values and never takes a lock the control task might
+be holding.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define METRICS_TEXT_MAX 4096 // longest /metrics body
+
+// Platform readings, filled in by halHealth()
+struct HealthSample
+{
+  uint32_t heapFree;       // bytes
+  uint32_t heapMinFree;    // lowest free heap since boot
+  uint32_t heapLargest;    // largest block that can be allocated
+  uint32_t loopIterations; // loop() passes since boot
+  uint32_t loopRate;       // loop() passes in the last second
+  int32_t rssi;            // dBm, 0 when not connected
+  uint32_t wifiReconnects; // connections after the first
+  uint32_t wsClients;      // WebSocket clients connected
+  uint64_t uptimeUs;
+};
+
+size_t metricsText(char *buffer, size_t size); // the /metrics body, truncated to size
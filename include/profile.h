@@ -0,0 +1,103 @@
+/* Scoped latency profiler
+*********************
+
+PROFILE_SCOPE(PROFILE_SET_VOLUME) at the top of a block times it with the
+CPU cycle counter, from there to the end of the block, and adds the time
+to that scope's histogram: PROFILE_BUCKETS power-of-two buckets from
+under 2us up, plus the exact count, total and maximum. profileText()
+gives p50, p99 and max per scope, served at /profile and printed on
+Serial once a minute.
+
+Build with -DPROFILE_SCOPES=1 to enable it. Otherwise PROFILE_SCOPE() only
+tells the loop stall watchdog (stall.h) which scope the control task is
+in, and expands to nothing when that is compiled out too.
+
+Each scope is only entered from one task, which owns its histogram:
+recording is a few plain increments, and the histogram is then published
+for profileText() behind a sequence lock, so /profile on the AsyncTCP task
+never reads a count or 64-bit total half written. profileReset() only
+flags the histograms; each owner empties its own at its next record. The
+cycle counter belongs to the core, so a scope on a task that is not pinned
+to a core (the AsyncTCP task) can be off if the task moves in between;
+those are short scopes.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "stall.h"
+
+#ifndef PROFILE_SCOPES
+#define PROFILE_SCOPES 0
+#endif
+
+#ifndef PROFILE_CYCLES_PER_US
+#define PROFILE_CYCLES_PER_US 240 // CPU clock in MHz
+#endif
+#define PROFILE_BUCKETS 16 // bucket b holds times from 2^b to 2^(b+1) us, the last one everything longer
+#define PROFILE_TEXT_MAX 1536 // longest profileText()
+
+// Scopes, in profileScopeName order
+#define PROFILE_SET_VOLUME 0
+#define PROFILE_SET_IO 1
+#define PROFILE_NOTIFY 2
+#define PROFILE_WS_MESSAGE 3 // AsyncTCP side: queueing the message
+#define PROFILE_WS_COMMAND 4 // control task side: parsing and applying it
+#define PROFILE_IR_KEY 5     // a decoded remote key (RC5Update)
+#define PROFILE_TFT_FRAME 6  // displayUpdate(), every window of a frame
+#define PROFILE_TFT_STRIP 7  // one DMA strip converted and queued
+#define PROFILE_TFT_FILL 8   // full screen fill
+#define PROFILE_SCOPE_COUNT 9
+
+extern const char *profileScopeName[PROFILE_SCOPE_COUNT];
+
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_JOIN(profileScope, line)
+
+#if PROFILE_SCOPES
+
+#include <Arduino.h>
+
+void profileRecord(uint8_t scope, uint32_t cycles);
+size_t profileText(char *buffer, size_t size); // table of count, p50, p99 and max per scope
+void profileReset(void); // any task; each scope starts again at its next record
+
+class ProfileScope
+{
+public:
+  ProfileScope(uint8_t scope) : scope(scope), mark(stallScopeEnter(scope)), start(ESP.getCycleCount()) {}
+  ~ProfileScope()
+  {
+    profileRecord(scope, ESP.getCycleCount() - start);
+    stallScopeExit(mark);
+  }
+
+private:
+  uint8_t scope;
+  StallMark mark;
+  uint32_t start;
+};
+
+#define PROFILE_SCOPE(scope) ProfileScope PROFILE_NAME(__LINE__)(scope)
+
+#elif STALL_WATCHDOG
+
+class ProfileScope
+{
+public:
+  ProfileScope(uint8_t scope) : mark(stallScopeEnter(scope)) {}
+  ~ProfileScope() { stallScopeExit(mark); }
+
+private:
+  StallMark mark;
+};
+
+#define PROFILE_SCOPE(scope) ProfileScope PROFILE_NAME(__LINE__)(scope)
+
+#else
+
+#define PROFILE_SCOPE(scope)
+
+#endif
@@ -0,0 +1,50 @@
+/* Volume ramp engine
+*********************
+
+Every write to the Muses72323 goes through here. rampTo() and rampMute()
+start a timed transition and return at once; rampUpdate(), called on every
+pass of the control loop, moves the chip one step along the curve each
+RAMP_TICK_MS. The tick knows nothing of the signal: it is the Muses72323's
+own zero-cross detection (setZeroCrossingOn(true) in controllerBegin) that
+holds each written step until the audio next crosses zero. The ramp keeps
+the change at each crossing small by spreading soft mute, unmute and large
+jumps over many steps, so they are free of clicks and zipper noise.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+// Ramp curves, RAMP_CURVE selects one
+#define RAMP_LINEAR 0 // constant dB per tick
+#define RAMP_EASE 1   // slow start and finish (smoothstep)
+
+#ifndef RAMP_CURVE
+#define RAMP_CURVE RAMP_EASE
+#endif
+
+#ifndef RAMP_TICK_MS
+#define RAMP_TICK_MS 2 // time between chip updates
+#endif
+#ifndef RAMP_MUTE_MS
+#define RAMP_MUTE_MS 150 // soft mute
+#endif
+#ifndef RAMP_UNMUTE_MS
+#define RAMP_UNMUTE_MS 300 // soft unmute, also used at power up
+#endif
+#ifndef RAMP_RESUME_MS
+#define RAMP_RESUME_MS 60 // unmute on leaving standby, inside STANDBY_RESUME_BOUND_MS
+#endif
+#ifndef RAMP_JUMP_MS
+#define RAMP_JUMP_MS 200 // level changes larger than RAMP_JUMP_STEPS
+#endif
+#define RAMP_JUMP_STEPS 24 // 6dB; smaller changes are applied at once
+
+void rampBegin(void);                                 // chip has just been muted
+void rampTo(int16_t level, unsigned long durationMs); // ramp (or jump, for 0ms) to a volume step
+void rampMute(unsigned long durationMs);              // ramp down and mute
+void rampVolume(int16_t level);                       // rampTo with the duration picked from the jump size
+void rampUpdate(void);                                // move the chip on, call from the control loop
+bool rampActive(void);                                // a transition is in progress
+bool rampMuted(void);                                 // chip is muted and no ramp is running
@@ -0,0 +1,33 @@
+/* Write-behind settings cache
+*********************
+
+Volume and source changes are held in RAM and written to NVS once the
+controls have been idle for SETTINGS_IDLE_MS, instead of on every step.
+Values that end up back where they were in flash are not written at all.
+A learned remote key rewrites the key map file (keymap.h) the same way.
+settingsFlush() forces pending values out (OTA start, restart).
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#ifndef SETTINGS_IDLE_MS
+#define SETTINGS_IDLE_MS 3000 // idle time before changed settings are written
+#endif
+
+#define SETTINGS_IDLE_NONE 0xFFFFFFFFUL // nothing waiting to be written
+
+struct SettingsStats
+{
+  std::atomic<uint32_t> nvsWrites;  // values written to NVS
+  std::atomic<uint32_t> fileWrites; // key map files written
+};
+
+void settingsBegin(void);              // open NVS and load volume and source
+void settingsChanged(uint32_t changed); // CHANGED_* flags from the controller
+unsigned long settingsUpdate(void);    // write if idle long enough, returns ms until next write is due
+void settingsFlush(void);              // write pending changes now
+const SettingsStats &settingsStats(void);
@@ -0,0 +1,59 @@
+/* Shared SPI bus arbiter
+*********************
+
+The panel, the Muses72323 and the MCP23S08 share one SPI bus, driven from
+two tasks: the render task pushes pixels while the control task writes
+volume steps and relay patterns. Every transaction is bracketed by
+spiAcquire() / spiRelease() for its device, so they never interleave.
+
+Volume and relay writes come first. The display gives the bus up between
+DMA strips whenever spiYieldWanted() says one of them is waiting, so a
+volume step never waits for more than one strip (DISPLAY_DMA_LINES rows)
+instead of a whole frame, and takes the bus before the display's next
+strip does.
+
+Each device runs at its own clock: TFT_eSPI and the MCP23S08 library set
+theirs in their own transactions (SPI_FREQUENCY, SPI_MCP_FREQUENCY), and
+halBusClock() sets SPI_MUSES_FREQUENCY when the Muses72323 is selected, so
+a volume write never goes out at the panel's clock.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// Bus devices, in spiDeviceName order
+#define SPI_DEVICE_TFT 0
+#define SPI_DEVICE_MUSES 1
+#define SPI_DEVICE_MCP 2
+#define SPI_DEVICES 3
+#define SPI_NO_DEVICE 0xFF
+
+#ifndef SPI_MUSES_FREQUENCY
+#define SPI_MUSES_FREQUENCY 1000000 // two 16-bit words a volume step
+#endif
+#ifndef SPI_MCP_FREQUENCY
+#define SPI_MCP_FREQUENCY 8000000 // the MCP23S08 is good to 10MHz
+#endif
+
+// Written only by the bus holder, read by /metrics and the host report
+// from other tasks
+struct SpiBusStats
+{
+  std::atomic<uint32_t> transactions[SPI_DEVICES];
+  std::atomic<uint64_t> busyUs[SPI_DEVICES];    // time holding the bus
+  std::atomic<uint32_t> holdUsMax[SPI_DEVICES]; // longest single hold
+  std::atomic<uint32_t> waitUsMax[SPI_DEVICES]; // longest wait for the bus
+  std::atomic<uint32_t> chunkUsMax;             // longest display stretch between yield points
+  std::atomic<uint32_t> yields;                 // display transfers split for a waiting write
+};
+
+extern const char *spiDeviceName[SPI_DEVICES];
+
+void spiAcquire(uint8_t device); // wait for the bus; volume and relay writes go ahead of the display
+void spiRelease(uint8_t device);
+bool spiYieldWanted(void);       // display only: a volume or relay write is waiting for the bus
+bool spiHeld(uint8_t device);    // the device's transaction is open; the host fakes check their callers with it
+const SpiBusStats &spiBusStats(void);
@@ -0,0 +1,101 @@
+/* Loop stall watchdog
+*********************
+
+Each pass of loop(), the control task, is timed from stallPassBegin() to
+stallPassEnd(), leaving out the wait for input in standby. A pass longer
+than STALL_BUDGET_US is a stall: a volume step or relay switch queued
+behind it waited that long.
+
+The instrumented scopes (PROFILE_SCOPE, profile.h) tell the watchdog where
+the control task is. Each pass arms an alarm (halStallAlarm) for
+STALL_BUDGET_US; when it goes off, stallOverrun() is called from an
+interrupt of the control task with the backtrace of the code the task was
+running, while it is still stalled. The stall is put down to the innermost
+scope running at that moment, or, if the task was outside every scope, to
+the last scope it entered.
+
+The STALL_WORST worst stall sites, by scope and backtrace, are kept with
+their longest pass and count in a flash file, so the report of a soak test
+survives a reset. The persistence task writes it, at most every
+STALL_SAVE_MS, and prints the latest stall on Serial; GET /stalls returns
+it as text, /stalls?clear starts it again. Backtraces are program counters
+for addr2line:
+
+  xtensa-esp32-elf-addr2line -pfiaC -e .pio/build/<env>/firmware.elf 0x400d1234 ...
+
+Build with -DSTALL_WATCHDOG=0 to compile it out.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#ifndef STALL_WATCHDOG
+#define STALL_WATCHDOG 1
+#endif
+
+#ifndef STALL_BUDGET_US
+#define STALL_BUDGET_US 10000 // longest control loop pass that is not a stall
+#endif
+#ifndef STALL_SAVE_MS
+#define STALL_SAVE_MS 10000 // least time between report file writes
+#endif
+#define STALL_SAVE_NONE 0xFFFFFFFFUL // nothing waiting to be written
+#define STALL_WORST 8                // stall sites kept
+#define STALL_FRAMES 8               // backtrace depth
+#define STALL_NO_SCOPE 0xFF
+#define STALL_TEXT_MAX 1536 // longest stallText()
+#define STALL_FILE "/stalls.bin"
+
+// One stall site
+struct StallRecord
+{
+  uint32_t us;      // longest pass
+  uint32_t count;   // passes over budget
+  uint32_t uptimeS; // when the longest one happened
+  uint8_t scope;    // PROFILE_* scope, STALL_NO_SCOPE if the pass entered none
+  uint8_t inScope;  // the scope was running when the budget ran out, else the pass overran after it
+  uint8_t frames;   // backtrace depth, 0 if the pass ended before the alarm could take one
+  uint8_t reserved;
+  uint32_t pc[STALL_FRAMES];
+};
+
+struct StallStats
+{
+  std::atomic<uint32_t> stalls;    // passes over budget since boot
+  std::atomic<uint32_t> passUsMax; // longest pass since boot
+};
+
+// Where the control task was before a scope was entered, to go back to
+struct StallMark
+{
+  uint8_t scope;
+};
+
+#if STALL_WATCHDOG
+
+void stallBegin(void);                         // load the report file
+void stallPassBegin(void);                     // control task, top of loop()
+void stallPassEnd(void);                       // control task, before waiting for input
+StallMark stallScopeEnter(uint8_t scope);      // PROFILE_SCOPE
+void stallScopeExit(const StallMark &mark);
+void stallOverrun(const uint32_t *pc, uint8_t frames); // halStallAlarm(): the pass is over budget, the control task is at pc
+unsigned long stallUpdate(void);               // persistence task: write the report if due, returns ms until the next write is due
+size_t stallText(char *buffer, size_t size);   // the report, worst first
+void stallClear(void);
+const StallStats &stallStats(void);
+
+#else
+
+inline void stallBegin() {}
+inline void stallPassBegin() {}
+inline void stallPassEnd() {}
+inline StallMark stallScopeEnter(uint8_t /*scope*/) { return StallMark(); }
+inline void stallScopeExit(const StallMark & /*mark*/) {}
+inline void stallOverrun(const uint32_t * /*pc*/, uint8_t /*frames*/) {}
+inline unsigned long stallUpdate() { return STALL_SAVE_NONE; }
+
+#endif
@@ -0,0 +1,31 @@
+/* Volume taper
+*********************
+
+The encoder, the remote and the step commands move through a taper: a
+table of positions, each a Muses72323 level (0.25dB steps), built at
+compile time from VOLUME_TAPER. The default spends its fine steps where
+music is listened to and covers the rest of the 448 chip steps quickly.
+A matching table holds the "-30.25dB" label of every chip step, so
+stepping and drawing the level need no float maths or formatting.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+// {floor, step}: above `floor` (chip steps) positions are `step` chip steps
+// apart, from 0dB down; each floor is also a position
+#define TAPER_LINEAR {{VOLUME_MIN, 1}} // 448 positions, every 0.25dB step
+#define TAPER_COARSE {{VOLUME_MIN, 4}} // 113 positions, 1dB apart
+#define TAPER_AUDIO {{-40, 4}, {-160, 2}, {-280, 8}, {VOLUME_MIN, 24}} // 93 positions: 1dB to -10dB, 0.5dB to -40dB, 2dB to -70dB, then 6dB
+
+#ifndef VOLUME_TAPER
+#define VOLUME_TAPER TAPER_AUDIO
+#endif
+
+#define TAPER_LABEL_SIZE 10 // "-111.75dB" and the terminator
+
+int16_t taperStep(int16_t level, int32_t steps); // level `steps` taper positions away, clamped to the ends
+const char *taperLabel(int16_t level);           // level in dB, e.g. "-30.25dB"
+uint16_t taperPositions(void);
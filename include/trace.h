@@ -0,0 +1,70 @@
+/* Event trace
+*********************
+
+A fixed ring of the last TRACE_EVENTS timestamped events, kept in RAM so a
+lag a user noticed can be looked at afterwards: inputs from the encoder,
+the remote and WebSocket clients, commands applied, SPI transactions, NVS
+writes, frames drawn and clients sent a state frame.
+
+Any task or interrupt records with one atomic increment to claim a slot;
+each slot carries the sequence number it was written for, so a reader
+skips slots being written or overwritten while it copies them. GET /trace
+returns a snapshot as Chrome trace-event JSON, one row per task, for
+chrome://tracing or ui.perfetto.dev.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 512 // events kept, a power of two
+#endif
+
+// Events, in the order of the table in trace.cpp
+#define TRACE_KNOB 0      // detents queued, encoder interrupt
+#define TRACE_BUTTON 1    // button press queued
+#define TRACE_IR 2        // span: last edge of a remote frame to decoded
+#define TRACE_WS 3        // WebSocket message queued, arg client
+#define TRACE_APPLIED 4   // span: input to command applied, arg COMMAND_* source
+#define TRACE_SPI 5       // span: bus held, TRACE_SPI + SPI_DEVICE_*
+#define TRACE_NVS 8       // span: settings written
+#define TRACE_FRAME 9     // span: frame drawn, arg pixels
+#define TRACE_NOTIFY 10   // state frame sent, arg client
+#define TRACE_TYPES 11
+
+#define TRACE_PIECE_MAX 192 // longest JSON piece of the export
+
+struct TraceEvent
+{
+  std::atomic<uint32_t> sequence; // position it was written for, plus one
+  uint32_t us;                    // start
+  uint32_t dur;                   // 0 for an instant event
+  uint16_t type;
+  uint16_t arg;
+};
+
+// An export in progress: a snapshot of the ring and how far through it
+struct TraceExport
+{
+  struct
+  {
+    uint32_t us;
+    uint32_t dur;
+    uint16_t type;
+    uint16_t arg;
+  } events[TRACE_EVENTS];
+  size_t count;
+  size_t next; // item to format next: tracks, then events, then the end
+  char piece[TRACE_PIECE_MAX];
+  size_t pieceLen;
+  size_t piecePos;
+};
+
+void traceInstant(uint8_t type, uint16_t arg = 0);              // any task or interrupt
+void traceSpan(uint8_t type, uint32_t startUs, uint16_t arg = 0); // from startUs to now
+void traceExportBegin(TraceExport &trace);                      // snapshot the ring
+size_t traceExportRead(TraceExport &trace, uint8_t *buffer, size_t size); // next bytes of JSON, 0 at the end
@@ -0,0 +1,80 @@
+# Web UI assets for the file system image
+#
+# Runs before every build of the ESP32 env (extra_scripts in platformio.ini).
+# Copies data/ to $BUILD_DIR/data, adding a minified, gzipped <name>.gz next
+# to each script, style sheet and icon, and points the file system image
+# (pio run -t buildfs / uploadfs) at the copy. The firmware serves the .gz
+# variants itself (include/assets.h); the originals stay for clients that do
+# not take gzip.
+#
+# Only the Python standard library is used. gzip is written with a zero
+# time stamp, so unchanged sources give identical bytes and ETags.
+
+import gzip
+import os
+import re
+import shutil
+
+# Quoted strings and template literals, passed through untouched
+STRINGS = re.compile(r'("(?:\\.|[^"\\\n])*"|\'(?:\\.|[^\'\\\n])*\'|`(?:\\.|[^`\\])*`)')
+
+
+def outside_strings(text, fn):
+    parts = STRINGS.split(text)
+    return "".join(part if i % 2 else fn(part) for i, part in enumerate(parts))
+
+
+def minify_css(text):
+    def code(part):
+        part = re.sub(r"/\*.*?\*/", "", part, flags=re.S)
+        part = re.sub(r"\s+", " ", part)
+        part = re.sub(r" ?([{};,>]) ?", r"\1", part)
+        part = re.sub(r": ", ":", part)
+        return part.replace(";}", "}")
+
+    return outside_strings(text, code).strip()
+
+
+def minify_js(text):
+    # Comments and indentation only; line breaks stay, so automatic
+    # semicolon insertion sees the same code
+    def code(part):
+        part = re.sub(r"/\*.*?\*/", "", part, flags=re.S)
+        return re.sub(r"(^|\n)[ \t]*//[^\n]*", r"\1", part)
+
+    lines = (line.strip() for line in outside_strings(text, code).split("\n"))
+    return "\n".join(line for line in lines if line)
+
+
+COMPRESS = {
+    ".css": minify_css,
+    ".js": minify_js,
+    ".ico": None,
+}
+
+
+def build(source, output):
+    if os.path.isdir(output):
+        shutil.rmtree(output)
+    shutil.copytree(source, output)
+    for name in sorted(os.listdir(source)):
+        ext = os.path.splitext(name)[1].lower()
+        if ext not in COMPRESS:
+            continue
+        with open(os.path.join(source, name), "rb") as f:
+            data = f.read()
+        minify = COMPRESS[ext]
+        if minify:
+            data = minify(data.decode("utf-8")).encode("utf-8")
+        packed = gzip.compress(data, 9, mtime=0)
+        with open(os.path.join(output, name + ".gz"), "wb") as f:
+            f.write(packed)
+        print("assets: %s %d -> %d bytes gzipped" % (name, os.path.getsize(os.path.join(source, name)), len(packed)))
+
+
+Import("env")  # noqa: F821 (provided by PlatformIO)
+
+source = env.subst("$PROJECT_DATA_DIR")  # noqa: F821
+output = os.path.join(env.subst("$BUILD_DIR"), "data")  # noqa: F821
+build(source, output)
+env.Replace(PROJECT_DATA_DIR=output)  # noqa: F821
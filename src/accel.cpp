@@ -0,0 +1,59 @@
+/* Velocity based volume acceleration
+*********************/
+
+#include "accel.h"
+
+struct AccelPoint
+{
+  uint16_t rate;
+  uint8_t multiplier;
+};
+
+static const AccelPoint accelCurve[] = ACCEL_CURVE;
+
+int32_t accelSteps(Accel &accel, int32_t events, unsigned long now)
+{
+  if (events == 0)
+  {
+    return 0;
+  }
+  int8_t direction = events > 0 ? 1 : -1;
+  uint32_t count = events > 0 ? events : -events;
+  unsigned long interval = now - accel.milOnLast;
+  if (accel.milOnLast == 0 || interval > ACCEL_RESET_MS || direction != accel.direction)
+  {
+    // first event after a pause or a change of direction
+    accel.rate = 0;
+  }
+  else
+  {
+    if (interval == 0)
+    {
+      interval = 1;
+    }
+    int32_t sample = count * accel.weight * 1000UL / interval;
+    if (sample > ACCEL_RATE_MAX)
+    {
+      sample = ACCEL_RATE_MAX;
+    }
+    accel.rate += (sample - (int32_t)accel.rate) / ACCEL_SMOOTHING;
+  }
+  accel.direction = direction;
+  accel.milOnLast = now ? now : 1;
+
+  uint8_t multiplier = 1;
+  for (const AccelPoint &point : accelCurve)
+  {
+    if (accel.rate >= point.rate)
+    {
+      multiplier = point.multiplier;
+    }
+  }
+  return events * multiplier;
+}
+
+void accelReset(Accel &accel)
+{
+  accel.rate = 0;
+  accel.milOnLast = 0;
+}
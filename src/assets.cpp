@@ -0,0 +1,98 @@
+/* Static web assets
+*********************/
+
+#include "assets.h"
+#include "hal.h"
+
+Asset assets[ASSETS] = {
+    {ASSET_PAGE, "text/html", false, false, NULL, 0, ""},
+    {"/index.js", "application/javascript", true, false, NULL, 0, ""},
+    {"/index.css", "text/css", true, false, NULL, 0, ""},
+    {"/favicon.ico", "image/x-icon", true, false, NULL, 0, ""},
+};
+
+static AssetStats stats;
+static char version[9] = "";
+
+// 64-bit FNV-1a
+static uint64_t hash(const uint8_t *data, size_t len, uint64_t h = 0xCBF29CE484222325ULL)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    h = (h ^ data[i]) * 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static void load(Asset &asset)
+{
+  asset.read = true;
+  char file[32];
+  snprintf(file, sizeof(file), "%s%s", asset.path, asset.gzip ? ".gz" : "");
+  uint8_t *data = (uint8_t *)malloc(ASSET_CACHE_MAX);
+  size_t len = data ? halReadFile(file, data, ASSET_CACHE_MAX) : 0;
+  if (!len)
+  {
+    free(data);
+    return;
+  }
+  stats.flashReads++;
+  uint8_t *fitted = (uint8_t *)realloc(data, len);
+  asset.data = fitted ? fitted : data;
+  asset.len = len;
+  snprintf(asset.etag, sizeof(asset.etag), "\"%016llx\"", (unsigned long long)hash(asset.data, len));
+}
+
+Asset *assetFind(const char *path)
+{
+  stats.requests++;
+  for (Asset &asset : assets)
+  {
+    if (strcmp(asset.path, path) == 0)
+    {
+      if (!asset.read)
+      {
+        load(asset);
+      }
+      return asset.data ? &asset : NULL;
+    }
+  }
+  return NULL;
+}
+
+bool assetFresh(const Asset &asset, const char *ifNoneMatch)
+{
+  // A list of ETags, or * for any
+  if (ifNoneMatch && (strstr(ifNoneMatch, asset.etag) || strcmp(ifNoneMatch, "*") == 0))
+  {
+    stats.notModified++;
+    return true;
+  }
+  return false;
+}
+
+const char *assetVersion()
+{
+  if (!version[0])
+  {
+    uint64_t h = hash(NULL, 0);
+    for (Asset &asset : assets)
+    {
+      if (asset.gzip)
+      {
+        if (!asset.read)
+        {
+          load(asset);
+        }
+        h = hash((const uint8_t *)asset.etag, strlen(asset.etag), h);
+      }
+    }
+    snprintf(version, sizeof(version), "%08lx", (unsigned long)(h >> 32));
+  }
+  return version;
+}
+
+const AssetStats &assetStats()
+{
+  return stats;
+}
@@ -0,0 +1,114 @@
+/* Binary WebSocket protocol
+*********************/
+
+#include "binary_protocol.h"
+#include "broadcast.h"
+#include "controller.h"
+#include <string.h>
+
+void binaryStateFrame(BinaryFrame &frame, const ControlSnapshot &snapshot, uint32_t sequence)
+{
+  frame.magic = BINARY_MAGIC;
+  frame.version = BINARY_PROTOCOL_VERSION;
+  frame.type = BINARY_STATE;
+  frame.flags = (snapshot.muted ? BINARY_FLAG_MUTED : 0) | (snapshot.standby ? BINARY_FLAG_STANDBY : 0);
+  frame.sequence = sequence;
+  frame.volume = snapshot.volume;
+  frame.source = snapshot.source;
+  frame.command = 0;
+}
+
+void binaryRefusedFrame(BinaryFrame &frame, const uint8_t *data, size_t len)
+{
+  memset(&frame, 0, sizeof(frame));
+  frame.magic = BINARY_MAGIC;
+  frame.version = BINARY_PROTOCOL_VERSION;
+  frame.type = BINARY_REFUSED;
+  frame.command = len == sizeof(BinaryFrame) ? data[offsetof(BinaryFrame, command)] : 0;
+}
+
+// A known command with its fields in range
+static bool validCommand(const BinaryFrame &frame)
+{
+  bool sourceValid = frame.source >= 1 && frame.source <= 4;
+  bool volumeValid = frame.volume >= VOLUME_MIN && frame.volume <= VOLUME_MAX;
+  switch (frame.command)
+  {
+  case BINARY_CMD_SOURCE:
+    return sourceValid;
+  case BINARY_CMD_VOLUME_UP:
+  case BINARY_CMD_VOLUME_DOWN:
+  case BINARY_CMD_MUTE_TOGGLE:
+    return true;
+  case BINARY_CMD_VOLUME:
+    return volumeValid;
+  case BINARY_CMD_STATE:
+    return sourceValid && volumeValid;
+  default:
+    return false;
+  }
+}
+
+bool handleBinaryMessage(const uint8_t *data, size_t len)
+{
+  BinaryFrame frame;
+  if (len != sizeof(frame))
+  {
+    return false;
+  }
+  memcpy(&frame, data, sizeof(frame));
+  if (frame.magic != BINARY_MAGIC || frame.version != BINARY_PROTOCOL_VERSION)
+  {
+    return false;
+  }
+
+  switch (frame.type)
+  {
+  case BINARY_COMMAND:
+    // Only a command that will be applied wakes the pre-amp; a STATE
+    // command says itself whether to stay in standby
+    if (!validCommand(frame))
+    {
+      return false;
+    }
+    if (frame.command != BINARY_CMD_STATE)
+    {
+      standbyExit();
+    }
+    switch (frame.command)
+    {
+    case BINARY_CMD_SOURCE:
+      selectSource(frame.source);
+      break;
+    case BINARY_CMD_VOLUME_UP:
+      stepVolume(1);
+      break;
+    case BINARY_CMD_VOLUME_DOWN:
+      stepVolume(-1);
+      break;
+    case BINARY_CMD_MUTE_TOGGLE:
+      toggleMute();
+      break;
+    case BINARY_CMD_VOLUME:
+    case BINARY_CMD_STATE:
+    {
+      ControlTarget target = currentTarget();
+      target.volume = frame.volume;
+      target.muted = false;
+      if (frame.command == BINARY_CMD_STATE)
+      {
+        target.source = frame.source;
+        target.muted = frame.flags & BINARY_FLAG_MUTED;
+        target.standby = frame.flags & BINARY_FLAG_STANDBY;
+      }
+      applyTarget(target);
+      break;
+    }
+    default:
+      return false;
+    }
+    return true;
+  default:
+    return false;
+  }
+}
@@ -0,0 +1,182 @@
+/* Coalesced WebSocket state broadcasts
+*********************/
+
+#include "broadcast.h"
+#include "binary_protocol.h"
+#include "controller.h"
+#include "hal.h"
+#include "trace.h"
+#include <atomic>
+
+#define CLIENT_CLAIMED 0xFFFFFFFFUL // slot taken, not yet filled in
+
+struct ClientSlot
+{
+  std::atomic<uint32_t> id;   // WebSocket client id, 0 when free
+  std::atomic<bool> binary;   // client speaks the binary protocol
+  std::atomic<bool> stale;    // send the current state whatever the last sequence
+  uint32_t sequence;          // state sequence last sent to this client
+  unsigned long milOnSend;    // time of the last frame sent to this client
+  bool deferred;              // held back by the rate cap since its last frame
+};
+
+static ClientSlot clients[BROADCAST_MAX_CLIENTS];
+static std::atomic<bool> pending(false);
+static std::atomic<unsigned long> milOnRequest(0);
+static ControlSnapshot snapshot; // state the frames of `sequence` are built from
+static uint32_t sequence = 0;     // bumped each time the state differs from the last frame
+static char jsonFrame[BROADCAST_FRAME_SIZE];
+static size_t jsonLen = 0;
+static uint32_t jsonSequence = 0; // sequence jsonFrame was built for
+static BinaryFrame binaryFrame;
+static BroadcastStats stats;
+
+void broadcastRequest()
+{
+  stats.requested++;
+  if (!pending.exchange(true))
+  {
+    milOnRequest = millis();
+  }
+}
+
+void broadcastClientConnected(uint32_t client, bool binary)
+{
+  for (ClientSlot &slot : clients)
+  {
+    uint32_t expected = 0;
+    if (slot.id.compare_exchange_strong(expected, CLIENT_CLAIMED))
+    {
+      // The render task skips the slot until its protocol is set
+      slot.binary = binary;
+      slot.stale = true;
+      slot.id = client;
+      break;
+    }
+  }
+  // A new client gets the current state straight away
+  broadcastRequest();
+}
+
+void broadcastClientDisconnected(uint32_t client)
+{
+  for (ClientSlot &slot : clients)
+  {
+    uint32_t expected = client;
+    if (slot.id.compare_exchange_strong(expected, 0))
+    {
+      break;
+    }
+  }
+}
+
+uint32_t broadcastSequence()
+{
+  return sequence;
+}
+
+// Clients are not shown the backlight
+static bool sameState(const ControlSnapshot &a, const ControlSnapshot &b)
+{
+  return a.volume == b.volume && a.source == b.source && a.muted == b.muted && a.standby == b.standby && a.learn == b.learn &&
+         a.learnedAction == b.learnedAction && a.learnedProtocol == b.learnedProtocol && a.learnedCommand == b.learnedCommand &&
+         a.learnedAddress == b.learnedAddress;
+}
+
+// Send the current frame to one client in its protocol
+static bool sendFrame(ClientSlot &slot, uint32_t id)
+{
+  if (slot.binary)
+  {
+    return halSendBinary(id, (const uint8_t *)&binaryFrame, sizeof(binaryFrame));
+  }
+  if (jsonSequence != sequence)
+  {
+    // Only built when a JSON client needs it, from the snapshot the sequence was given to
+    jsonLen = stateFrame(snapshot, jsonFrame, sizeof(jsonFrame));
+    jsonSequence = sequence;
+  }
+  return halSendText(id, jsonFrame, jsonLen);
+}
+
+unsigned long broadcastUpdate()
+{
+  unsigned long now = millis();
+  unsigned long next = BROADCAST_IDLE_NONE;
+
+  if (pending)
+  {
+    unsigned long elapsed = now - milOnRequest;
+    if (elapsed >= BROADCAST_WINDOW_MS)
+    {
+      pending = false;
+      ControlSnapshot current = controlSnapshot();
+      if (sequence != 0 && sameState(current, snapshot))
+      {
+        stats.unchanged++;
+      }
+      else
+      {
+        snapshot = current;
+        sequence++;
+        binaryStateFrame(binaryFrame, snapshot, sequence);
+        stats.composed++;
+      }
+    }
+    else
+    {
+      next = BROADCAST_WINDOW_MS - elapsed;
+    }
+  }
+
+  for (ClientSlot &slot : clients)
+  {
+    uint32_t id = slot.id;
+    if (id == 0 || id == CLIENT_CLAIMED || sequence == 0)
+    {
+      continue;
+    }
+    bool stale = slot.stale;
+    if (!stale && slot.sequence == sequence)
+    {
+      continue;
+    }
+    unsigned long wait;
+    unsigned long since = now - slot.milOnSend;
+    if (!stale && since < BROADCAST_MIN_INTERVAL_MS)
+    {
+      // Counted once per frame put off, not on every pass until it goes
+      if (!slot.deferred)
+      {
+        slot.deferred = true;
+        stats.rateLimited++;
+      }
+      wait = BROADCAST_MIN_INTERVAL_MS - since;
+    }
+    else if (sendFrame(slot, id))
+    {
+      slot.stale = false;
+      slot.deferred = false;
+      slot.sequence = sequence;
+      slot.milOnSend = now;
+      stats.sent++;
+      traceInstant(TRACE_NOTIFY, id);
+      continue;
+    }
+    else
+    {
+      stats.queueFull++;
+      wait = BROADCAST_RETRY_MS;
+    }
+    if (wait < next)
+    {
+      next = wait;
+    }
+  }
+  return next;
+}
+
+const BroadcastStats &broadcastStats()
+{
+  return stats;
+}
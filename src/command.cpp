@@ -0,0 +1,155 @@
+/* Input command queue
+*********************/
+
+#include "command.h"
+#include "trace.h"
+#include <Arduino.h>
+#include <string.h>
+
+#define COMMAND_LAP(position) ((position) & ~(uint32_t)(COMMAND_QUEUE_SIZE - 1))
+
+static_assert((COMMAND_QUEUE_SIZE & (COMMAND_QUEUE_SIZE - 1)) == 0, "COMMAND_QUEUE_SIZE must be a power of two");
+
+// A slot's turn, relative to the lap of the queue position it is used at:
+// lap when free, lap + 1 once its command is published, and the next lap
+// once that has been taken. Zero-initialised slots are free for lap 0.
+struct CommandSlot
+{
+  std::atomic<uint32_t> turn;
+  Command command;
+};
+
+static_assert(COMMAND_LONG_BUFFERS <= 32, "COMMAND_LONG_BUFFERS must fit the free mask");
+
+static CommandSlot slots[COMMAND_QUEUE_SIZE];
+static uint8_t longData[COMMAND_LONG_BUFFERS][COMMAND_LONG_MAX];
+static std::atomic<uint32_t> longFree((uint32_t)((1ULL << COMMAND_LONG_BUFFERS) - 1)); // bit set per free buffer
+static std::atomic<uint32_t> head(0); // next position to claim, producers
+static uint32_t tail;                 // next position to take, control task
+static CommandStats stats;
+
+const char *commandSourceName[COMMAND_SOURCES] = {"knob", "button", "IR", "WebSocket", "WebSocket bin"};
+
+// Only WebSocket messages are long, so interrupts never get here
+static uint8_t longClaim()
+{
+  uint32_t free = longFree.load(std::memory_order_relaxed);
+  while (free)
+  {
+    uint8_t buffer = __builtin_ctz(free);
+    if (longFree.compare_exchange_weak(free, free & ~(1UL << buffer), std::memory_order_acquire))
+    {
+      return buffer;
+    }
+  }
+  return COMMAND_NO_BUFFER;
+}
+
+static void longFreed(uint8_t buffer)
+{
+  longFree.fetch_or(1UL << buffer, std::memory_order_release);
+}
+
+bool IRAM_ATTR commandQueue(uint8_t source, uint32_t client, const void *data, size_t len, uint32_t us)
+{
+  uint8_t buffer = COMMAND_NO_BUFFER;
+  if (len > COMMAND_DATA_MAX)
+  {
+    buffer = len <= COMMAND_LONG_MAX ? longClaim() : COMMAND_NO_BUFFER;
+    if (buffer == COMMAND_NO_BUFFER)
+    {
+      stats.refused.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  uint32_t position = head.load(std::memory_order_relaxed);
+  CommandSlot *slot;
+  for (;;)
+  {
+    slot = &slots[position & (COMMAND_QUEUE_SIZE - 1)];
+    int32_t ahead = slot->turn.load(std::memory_order_acquire) - COMMAND_LAP(position);
+    if (ahead == 0)
+    {
+      if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (ahead < 0)
+    {
+      // Still holds the previous lap's command
+      if (buffer != COMMAND_NO_BUFFER)
+      {
+        longFreed(buffer);
+      }
+      stats.refused.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else
+    {
+      position = head.load(std::memory_order_relaxed); // another producer claimed it
+    }
+  }
+  slot->command.source = source;
+  slot->command.buffer = buffer;
+  slot->command.len = len;
+  slot->command.client = client;
+  slot->command.us = us;
+  if (len)
+  {
+    memcpy(buffer == COMMAND_NO_BUFFER ? slot->command.data : longData[buffer], data, len);
+  }
+  slot->turn.store(COMMAND_LAP(position) + 1, std::memory_order_release);
+  stats.queued[source].fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool commandTake(Command &command)
+{
+  CommandSlot &slot = slots[tail & (COMMAND_QUEUE_SIZE - 1)];
+  if (slot.turn.load(std::memory_order_acquire) != COMMAND_LAP(tail) + 1)
+  {
+    return false;
+  }
+  uint32_t depth = head.load(std::memory_order_relaxed) - tail;
+  if (depth > stats.depthMax)
+  {
+    stats.depthMax = depth;
+  }
+  command = slot.command;
+  slot.turn.store(COMMAND_LAP(tail) + COMMAND_QUEUE_SIZE, std::memory_order_release);
+  tail++;
+  return true;
+}
+
+const uint8_t *commandData(const Command &command)
+{
+  return command.buffer == COMMAND_NO_BUFFER ? command.data : longData[command.buffer];
+}
+
+void commandRelease(Command &command)
+{
+  if (command.buffer != COMMAND_NO_BUFFER)
+  {
+    longFreed(command.buffer);
+    command.buffer = COMMAND_NO_BUFFER;
+  }
+}
+
+void commandApplied(uint8_t source, uint32_t us, uint32_t count)
+{
+  uint32_t latency = micros() - us;
+  traceSpan(TRACE_APPLIED, us, source);
+  stats.applied[source] += count;
+  stats.lastUs[source] = latency;
+  stats.totalUs[source] += (uint64_t)latency * count;
+  if (latency > stats.worstUs[source])
+  {
+    stats.worstUs[source] = latency;
+  }
+}
+
+const CommandStats &commandStats()
+{
+  return stats;
+}
@@ -0,0 +1,1000 @@
+/* Pre-amp controller logic
+*********************
+
+Volume, source and mute handling for the IR remote, rotary encoder and
+WebSocket clients. Split out of main.cpp so the same code can be built for
+the ESP32 and for the [env:native] host target (see hal.h).
+
+Inputs arrive as commands (command.h) and are applied by commandUpdate()
+on the control task, which alone changes the controller state. The control
+routines only write to the Muses72323 and MCP23S08. Display,
+WebSocket and flash updates are recorded as CHANGED_* flags and carried out
+later by renderUpdate() and the settings cache (settings.h), which the
+firmware runs in their own lower priority tasks. Those read the state only
+through controlSnapshot(), which the control task publishes with each
+change.
+
+*/
+
+#include "controller.h"
+#include "hal.h"
+#include "settings.h"
+#include "accel.h"
+#include "broadcast.h"
+#include "ramp.h"
+#include "spibus.h"
+#include "display.h"
+#include "ir.h"
+#include "keymap.h"
+#include "taper.h"
+#include "command.h"
+#include "profile.h"
+#include "trace.h"
+#include "binary_protocol.h"
+#include <ArduinoJson.h>
+#include <atomic>
+
+/********* Global Variables *******************/
+int16_t volume;        // current volume, between 0 and -447
+bool backlight;        // current backlight state
+uint8_t source;        // current input channel
+bool isMuted;          // current mute status
+uint8_t state = 0;     // current machine state
+unsigned long milOnButton; // Stores last time for switch press
+
+// Remote keys: the last frame, and the learn mode
+static IrFrame lastFrame;
+static std::atomic<uint8_t> learnAction(KEY_NONE); // set by WebSocket commands
+static IrFrame learned;                            // last code learned
+static uint8_t learnedAction = KEY_NONE;           // what it was bound to, KEY_NONE if the map was full
+
+// Detents turned while the command queue was full, added to by the encoder ISR
+static std::atomic<int32_t> encoderDelta(0);
+
+// Acceleration for the knob and for held remote volume keys
+static Accel knobAccel = {1, 0, 0, 0};
+static Accel remoteAccel = {0, 0, 0, 0}; // weight set by the protocol of each press
+static const uint8_t irRepeatWeight[IR_PROTOCOLS] = IR_REPEAT_WEIGHTS;
+
+// Shadow of the MCP23S08 output latch, one relay per bit
+static uint8_t relayLatch;
+
+// Source switch pipeline: fade out, switch, settle, restore
+#define SWITCH_IDLE 0
+#define SWITCH_FADE 1    // soft mute running
+#define SWITCH_SETTLE 2  // relays switched, output held muted
+#define SWITCH_RESTORE 3 // level coming back
+static uint8_t switchPhase = SWITCH_IDLE;
+static unsigned long milOnPhase; // start of the settle or restore phase
+static unsigned long usOnSwitch;
+static SwitchStats switching;
+
+// Standby bookkeeping
+static unsigned long usOnResume;
+static bool resuming;
+static StandbyStats standby;
+
+// Changes not yet drawn, and how many state changes they add up to
+static std::atomic<uint32_t> renderPending(0);
+static std::atomic<uint32_t> renderRequests(0);
+
+// Global Constants
+//------------------
+const char *inputName[] = {"Phono", "Media", "CD", "Tuner"};                        // Elektor i/p board
+static const char *sourceKeys[] = {"Phono", "Media", "CD", "Tuner"};                // WebSocket command names
+
+// The snapshot other tasks read, behind a sequence lock: the count is odd
+// while the control task is writing the words, and a reader that saw it
+// odd or changed reads again
+#define SNAPSHOT_WORDS (sizeof(ControlSnapshot) / sizeof(uint32_t))
+static_assert(sizeof(ControlSnapshot) % sizeof(uint32_t) == 0, "ControlSnapshot must be whole words");
+static std::atomic<uint32_t> snapshotCount(0);
+static std::atomic<uint32_t> snapshotWords[SNAPSHOT_WORDS];
+
+static void publish()
+{
+  ControlSnapshot snapshot = {volume, source, isMuted, state == STATE_OFF, backlight, learnAction.load(),
+                              learnedAction, learned.protocol, learned.command, learned.address};
+  uint32_t words[SNAPSHOT_WORDS];
+  memcpy(words, &snapshot, sizeof(snapshot));
+  uint32_t count = snapshotCount.load(std::memory_order_relaxed);
+  snapshotCount.store(count + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < SNAPSHOT_WORDS; i++)
+  {
+    snapshotWords[i].store(words[i], std::memory_order_relaxed);
+  }
+  snapshotCount.store(count + 2, std::memory_order_release);
+}
+
+// Record a state change for the render and persistence tasks
+static void stateChanged(uint32_t changed)
+{
+  publish();
+  renderPending.fetch_or(changed);
+  renderRequests.fetch_add(1);
+  settingsChanged(changed);
+  halStateChanged();
+}
+
+// Move the volume by a number of taper positions, unmuting first
+void stepVolume(int32_t steps)
+{
+  if (isMuted)
+  {
+    unMute();
+  }
+  int16_t target = taperStep(volume, steps);
+  if (target != volume)
+  {
+    volume = target;
+    setVolume();
+  }
+}
+
+static void backlightOn()
+{
+  if (!backlight)
+  {
+    backlight = ACTIVE;
+    stateChanged(CHANGED_BACKLIGHT);
+  }
+}
+
+void selectSource(uint8_t input)
+{
+  source = input;
+  setIO();
+}
+
+// Write the relays for source. The whole port is written from a shadow of
+// the output latch, so the old relay opens and the new one closes in one
+// transaction and exactly one is ever closed; an unchanged source costs no
+// SPI traffic at all.
+static bool writeRelays()
+{
+  uint8_t pattern = 1 << (source - 1);
+  if (pattern == relayLatch)
+  {
+    return false;
+  }
+  spiAcquire(SPI_DEVICE_MCP);
+  MCP.write8(pattern);
+  spiRelease(SPI_DEVICE_MCP);
+  relayLatch = pattern;
+  switching.relayWrites++;
+  return true;
+}
+
+// Ask for the relays to follow source. With the chip muted they switch at
+// once; otherwise switchUpdate() fades the output out, switches, lets the
+// contacts settle and brings the level back. Requests made meanwhile only
+// move source, so the relays go straight to the newest one.
+static void switchRelays()
+{
+  if ((1 << (source - 1)) == relayLatch)
+  {
+    return;
+  }
+  switching.requests++;
+  if (switchPhase == SWITCH_FADE || switchPhase == SWITCH_SETTLE)
+  {
+    return;
+  }
+  usOnSwitch = micros();
+  if (rampMuted())
+  {
+    writeRelays();
+    switchPhase = SWITCH_IDLE;
+    return;
+  }
+  rampMute(SWITCH_FADE_MS);
+  switchPhase = SWITCH_FADE;
+}
+
+void switchUpdate()
+{
+  switch (switchPhase)
+  {
+  case SWITCH_FADE:
+    if (!rampActive())
+    {
+      writeRelays();
+      milOnPhase = millis();
+      switchPhase = SWITCH_SETTLE;
+    }
+    break;
+  case SWITCH_SETTLE:
+    if (millis() - milOnPhase < SWITCH_SETTLE_MS)
+    {
+      break;
+    }
+    if (writeRelays())
+    {
+      milOnPhase = millis(); // source moved on while settling, still silent
+      break;
+    }
+    // The level and mute state may have changed during the switch
+    if (isMuted || state == STATE_OFF)
+    {
+      switchPhase = SWITCH_IDLE;
+      break;
+    }
+    rampTo(volume, SWITCH_RESTORE_MS);
+    milOnPhase = millis();
+    switchPhase = SWITCH_RESTORE;
+    break;
+  case SWITCH_RESTORE:
+    // Done when the level is back, or when a newer ramp took over from it
+    if (!rampActive() || millis() - milOnPhase >= SWITCH_RESTORE_MS)
+    {
+      switchPhase = SWITCH_IDLE;
+      switching.lastUs = micros() - usOnSwitch;
+      if (switching.lastUs > switching.worstUs)
+      {
+        switching.worstUs = switching.lastUs;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Fading or settling: level changes wait for the restore at the end
+static bool levelHeld()
+{
+  return switchPhase == SWITCH_FADE || switchPhase == SWITCH_SETTLE;
+}
+
+bool switchActive()
+{
+  return switchPhase != SWITCH_IDLE;
+}
+
+const SwitchStats &switchStats()
+{
+  return switching;
+}
+
+ControlTarget currentTarget()
+{
+  ControlTarget target = {volume, source, isMuted, state == STATE_OFF};
+  return target;
+}
+
+void applyTarget(const ControlTarget &target)
+{
+  if (!target.standby)
+  {
+    standbyExit();
+  }
+  uint32_t changed = 0;
+  if (target.source != source)
+  {
+    source = target.source;
+    switchRelays();
+    changed |= CHANGED_SOURCE;
+  }
+  if (target.volume != volume)
+  {
+    volume = target.volume;
+    changed |= CHANGED_VOLUME;
+  }
+  if (target.muted != isMuted)
+  {
+    isMuted = target.muted;
+    changed |= CHANGED_MUTE;
+  }
+  // One transition of the volume chip at most
+  if (levelHeld())
+  {
+    // restored with the source switch
+  }
+  else if (isMuted)
+  {
+    if (changed & CHANGED_MUTE)
+    {
+      rampMute(RAMP_MUTE_MS);
+    }
+  }
+  else if (changed & (CHANGED_VOLUME | CHANGED_MUTE))
+  {
+    rampVolume(volume);
+  }
+  if (changed)
+  {
+    if (!backlight)
+    {
+      backlight = ACTIVE;
+      changed |= CHANGED_BACKLIGHT;
+    }
+    stateChanged(changed);
+  }
+  if (target.standby)
+  {
+    standbyEnter();
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Standby
+// ----------------------------------------------------------------------------
+
+void standbyEnter()
+{
+  if (state == STATE_OFF)
+  {
+    return;
+  }
+  state = STATE_OFF;
+  // The chip is muted; isMuted keeps the user's setting for the resume
+  if (!isMuted)
+  {
+    rampMute(RAMP_MUTE_MS);
+  }
+  backlight = STANDBY;
+  standby.entered++;
+  stateChanged(CHANGED_POWER | CHANGED_BACKLIGHT);
+}
+
+void standbyExit()
+{
+  if (state != STATE_OFF)
+  {
+    return;
+  }
+  state = STATE_RUN;
+  usOnResume = micros();
+  resuming = true;
+  // Source relays are left switched in standby, so only the level comes back
+  if (!isMuted && !levelHeld())
+  {
+    rampTo(volume, RAMP_RESUME_MS);
+  }
+  backlight = ACTIVE;
+  stateChanged(CHANGED_POWER | CHANGED_BACKLIGHT);
+}
+
+bool inStandby()
+{
+  return state == STATE_OFF;
+}
+
+bool standbyUpdate()
+{
+  if (resuming && !rampActive())
+  {
+    resuming = false;
+    standby.resumed++;
+    standby.lastResumeUs = micros() - usOnResume;
+    if (standby.lastResumeUs > standby.worstResumeUs)
+    {
+      standby.worstResumeUs = standby.lastResumeUs;
+    }
+    if (standby.lastResumeUs > STANDBY_RESUME_BOUND_MS * 1000UL)
+    {
+      Serial.printf("Resume from standby took %luus\n", (unsigned long)standby.lastResumeUs);
+    }
+  }
+  return state == STATE_OFF && !rampActive() && !switchActive();
+}
+
+const StandbyStats &standbyStats()
+{
+  return standby;
+}
+
+// ----------------------------------------------------------------------------
+// Start-up
+// ----------------------------------------------------------------------------
+
+void controllerBegin()
+{
+  // Source select pins as outputs. The expander keeps its latch through an
+  // ESP32 reset, so the shadow starts from what the relays really are.
+  spiAcquire(SPI_DEVICE_MCP);
+  MCP.begin();
+  MCP.setSPIspeed(SPI_MCP_FREQUENCY);
+  MCP.pinMode8(0x00); //  0 = output , 1 = input
+  relayLatch = MCP.read8();
+  spiRelease(SPI_DEVICE_MCP);
+
+  // Initialize muses (SPI, pin modes)...
+  spiAcquire(SPI_DEVICE_MUSES);
+  Muses.begin();
+  Muses.setExternalClock(false); // must be set!
+  Muses.setZeroCrossingOn(true);
+  Muses.mute();
+  spiRelease(SPI_DEVICE_MUSES);
+  rampBegin();
+  keymapBegin();
+  // Load saved settings (volume, balance, source)
+  settingsBegin();
+  delay(10);
+  // set source while the chip is still muted
+  setIO();
+  // Verify the latch now holds exactly the saved source
+  spiAcquire(SPI_DEVICE_MCP);
+  uint8_t readBack = MCP.read8();
+  if (readBack != relayLatch)
+  {
+    Serial.printf("Source relays read back 0x%02X, expected 0x%02X; rewriting\n", readBack, relayLatch);
+    MCP.write8(relayLatch);
+  }
+  spiRelease(SPI_DEVICE_MCP);
+  // set startup volume
+  setVolume();
+  // unmute
+  isMuted = 0;
+  publish();
+}
+
+// ----------------------------------------------------------------------------
+// WebSocket messages
+// ----------------------------------------------------------------------------
+
+void notifyClients()
+{
+  PROFILE_SCOPE(PROFILE_NOTIFY);
+  broadcastRequest();
+}
+
+ControlSnapshot controlSnapshot()
+{
+  uint32_t words[SNAPSHOT_WORDS];
+  uint32_t count;
+  do
+  {
+    count = snapshotCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < SNAPSHOT_WORDS; i++)
+    {
+      words[i] = snapshotWords[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((count & 1) || count != snapshotCount.load(std::memory_order_relaxed));
+  ControlSnapshot snapshot;
+  memcpy(&snapshot, words, sizeof(snapshot));
+  return snapshot;
+}
+
+size_t stateFrame(const ControlSnapshot &snapshot, char *buffer, size_t size)
+{
+  JsonDocument json;
+  json["source"] = inputName[snapshot.source - 1];
+  json["volume"] = snapshot.volume;
+  json["mute"] = snapshot.muted ? "on" : "off";
+  json["standby"] = snapshot.standby ? "on" : "off";
+  json["learn"] = snapshot.learn == KEY_NONE ? "off" : keyActionName[snapshot.learn];
+  if (snapshot.learnedAction != KEY_NONE)
+  {
+    char code[40];
+    snprintf(code, sizeof(code), "%s %u/%u %s", irProtocolName[snapshot.learnedProtocol], snapshot.learnedAddress, snapshot.learnedCommand,
+             keyActionName[snapshot.learnedAction]);
+    json["learned"] = code;
+  }
+  return serializeJson(json, buffer, size);
+}
+
+// Merge one command object into the batch target, false if a value is invalid.
+// Source and volume changes unmute unless the same object also sets "Mute".
+static bool parseCommand(JsonObject command, ControlTarget &target)
+{
+  // Legacy single-step messages from index.js: {"CD":"toggle"}, {"Volup":"toggle"}...
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    const char *sel = command[sourceKeys[i]];
+    if (sel && strcmp(sel, "toggle") == 0)
+    {
+      target.source = i + 1;
+      target.muted = false;
+    }
+  }
+  const char *vol = command["Volup"];
+  if (vol && strcmp(vol, "toggle") == 0)
+  {
+    target.volume = taperStep(target.volume, 1);
+    target.muted = false;
+  }
+  vol = command["Voldown"];
+  if (vol && strcmp(vol, "toggle") == 0)
+  {
+    target.volume = taperStep(target.volume, -1);
+    target.muted = false;
+  }
+
+  // Absolute values: {"Source":3}, {"Source":"CD"}, {"Volume":-120}, {"VolumeDb":-30.5}
+  JsonVariant sel = command["Source"];
+  if (!sel.isNull())
+  {
+    uint8_t input = 0;
+    if (sel.is<int>())
+    {
+      input = sel.as<int>();
+    }
+    else if (sel.is<const char *>())
+    {
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        if (strcmp(sel.as<const char *>(), sourceKeys[i]) == 0)
+        {
+          input = i + 1;
+        }
+      }
+    }
+    if (input < 1 || input > 4)
+    {
+      return false;
+    }
+    target.source = input;
+    target.muted = false;
+  }
+  JsonVariant level = command["Volume"];
+  if (!level.isNull())
+  {
+    if (!level.is<int>() || level.as<int>() < VOLUME_MIN || level.as<int>() > VOLUME_MAX)
+    {
+      return false;
+    }
+    target.volume = level.as<int>();
+    target.muted = false;
+  }
+  level = command["VolumeDb"];
+  if (!level.isNull())
+  {
+    if (!level.is<float>())
+    {
+      return false;
+    }
+    float steps = level.as<float>() * 4;
+    if (steps < VOLUME_MIN || steps > VOLUME_MAX)
+    {
+      return false;
+    }
+    target.volume = (int16_t)(steps - 0.5f); // nearest 0.25dB step (steps <= 0)
+    target.muted = false;
+  }
+
+  // Standby: true/false or "toggle"; any other command wakes the pre-amp
+  JsonVariant standbyKey = command["Standby"];
+  if (!standbyKey.isNull())
+  {
+    if (standbyKey.is<bool>())
+    {
+      target.standby = standbyKey.as<bool>();
+    }
+    else if (standbyKey.is<const char *>() && strcmp(standbyKey.as<const char *>(), "toggle") == 0)
+    {
+      target.standby = state != STATE_OFF;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  // Mute: "toggle" (index.js), true/false or "on"/"off"
+  JsonVariant mut = command["Mute"];
+  if (!mut.isNull())
+  {
+    if (mut.is<bool>())
+    {
+      target.muted = mut.as<bool>();
+    }
+    else if (mut.is<const char *>() && strcmp(mut.as<const char *>(), "toggle") == 0)
+    {
+      target.muted = !target.muted;
+    }
+    else if (mut.is<const char *>() && strcmp(mut.as<const char *>(), "on") == 0)
+    {
+      target.muted = true;
+    }
+    else if (mut.is<const char *>() && strcmp(mut.as<const char *>(), "off") == 0)
+    {
+      target.muted = false;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void handleCommandMessage(const uint8_t *data, size_t len)
+{
+  PROFILE_SCOPE(PROFILE_WS_COMMAND);
+  JsonDocument json;
+  DeserializationError err = deserializeJson(json, data, len);
+  if (err)
+  {
+    Serial.print(F("deserializeJson() failed with code "));
+    Serial.println(err.c_str());
+    return;
+  }
+
+  // Learn mode: {"Learn":"VolumeUp"} binds the next remote key, {"Learn":"cancel"}
+  // stops waiting. Neither touches the audio state or wakes the pre-amp.
+  const char *learn = json["Learn"];
+  if (learn)
+  {
+    learnStart(keymapAction(learn));
+    return;
+  }
+
+  // A message is one command object or an array of them. Either way the whole
+  // message is one batch: merged into a single target, applied once.
+  ControlTarget target = currentTarget();
+  target.standby = false;
+  bool valid = true;
+  if (json.is<JsonArray>())
+  {
+    for (JsonVariant command : json.as<JsonArray>())
+    {
+      valid = valid && command.is<JsonObject>() && parseCommand(command.as<JsonObject>(), target);
+    }
+  }
+  else
+  {
+    valid = json.is<JsonObject>() && parseCommand(json.as<JsonObject>(), target);
+  }
+  if (!valid)
+  {
+    Serial.println(F("WebSocket command rejected: invalid value"));
+    return;
+  }
+  applyTarget(target);
+}
+
+// ----------------------------------------------------------------------------
+// Volume / source control
+// ----------------------------------------------------------------------------
+
+void encoderTurned(long value)
+{
+  int32_t detents = value;
+  traceInstant(TRACE_KNOB, value);
+  if (!commandQueue(COMMAND_KNOB, 0, &detents, sizeof(detents), micros()))
+  {
+    encoderDelta.fetch_add(value); // picked up by the next commandUpdate(), not lost
+  }
+}
+
+void encoderPressed()
+{
+  traceInstant(TRACE_BUTTON);
+  commandQueue(COMMAND_BUTTON, 0, NULL, 0, micros());
+}
+
+void volumeUpdate(int32_t detents)
+{
+  stepVolume(accelSteps(knobAccel, detents, millis()));
+}
+
+void setVolume()
+{
+  PROFILE_SCOPE(PROFILE_SET_VOLUME);
+  // set new volume setting, ramping when unmuting or for large jumps
+  if (!levelHeld())
+  {
+    rampVolume(volume);
+  }
+  backlightOn();
+  stateChanged(CHANGED_VOLUME);
+}
+
+void sourceUpdate(int32_t detents)
+{
+  // Step through the four inputs, wrapping round, with one switch per update
+  milOnButton = millis();
+  source = ((source - 1 + detents % 4 + 4) % 4) + 1;
+  backlightOn();
+  setIO();
+}
+
+// Select an input from the remote, unmuting if the screen was off
+static void remoteSource(uint8_t input)
+{
+  if (!backlight)
+  {
+    unMute(); // unmute output
+  }
+  source = input;
+  setIO();
+}
+
+static void remoteKey(const IrFrame &frame)
+{
+  PROFILE_SCOPE(PROFILE_IR_KEY);
+  // A held key repeats its frame; a new press flips the toggle or is another key
+  bool newPress = frame.toggle != lastFrame.toggle || frame.protocol != lastFrame.protocol ||
+                  frame.address != lastFrame.address || frame.command != lastFrame.command;
+  lastFrame = frame;
+  uint8_t learn = learnAction.exchange(KEY_NONE);
+  if (learn != KEY_NONE)
+  {
+    // The key is bound, not acted on
+    if (keymapLearn(frame, learn))
+    {
+      learned = frame;
+      learnedAction = learn;
+      stateChanged(CHANGED_KEYMAP | CHANGED_LEARN);
+    }
+    else
+    {
+      Serial.println(F("Key map full, code not learned"));
+      stateChanged(CHANGED_LEARN);
+    }
+    return;
+  }
+  // One hash lookup, however many remotes are mapped
+  uint8_t action = keymapLookup(frame);
+  if (action == KEY_NONE)
+  {
+    return;
+  }
+  if (state == STATE_OFF)
+  {
+    // A new press of any mapped key only wakes the pre-amp
+    if (newPress)
+    {
+      standbyExit();
+    }
+    return;
+  }
+  switch (action)
+  {
+  case KEY_PHONO:
+  case KEY_MEDIA:
+  case KEY_CD:
+  case KEY_TUNER:
+    if (newPress)
+    {
+      remoteSource(action - KEY_PHONO + 1);
+    }
+    break;
+  case KEY_STANDBY:
+    if (newPress)
+    {
+      standbyEnter();
+    }
+    break;
+  case KEY_MUTE:
+    if (newPress)
+    {
+      toggleMute();
+    }
+    break;
+  case KEY_VOLUME_UP:
+  case KEY_VOLUME_DOWN:
+    // Accelerating while the key is held
+    if (newPress)
+    {
+      accelReset(remoteAccel);
+      remoteAccel.weight = irRepeatWeight[frame.protocol];
+    }
+    stepVolume(accelSteps(remoteAccel, action == KEY_VOLUME_UP ? 1 : -1, millis()));
+    break;
+  case KEY_DISPLAY:
+    // Display Toggle
+    if (newPress)
+    {
+      backlight = backlight ? STANDBY : ACTIVE;
+      stateChanged(CHANGED_BACKLIGHT);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void learnStart(uint8_t action)
+{
+  learnAction.store(action);
+  stateChanged(CHANGED_LEARN);
+}
+
+uint8_t learning()
+{
+  return learnAction.load();
+}
+
+void unMute()
+{
+  backlightOn();
+  isMuted = 0;
+  //  set volume
+  setVolume();
+  // set source
+  setIO();
+  stateChanged(CHANGED_MUTE);
+}
+
+void mute()
+{
+  isMuted = 1;
+  rampMute(RAMP_MUTE_MS);
+  stateChanged(CHANGED_MUTE);
+}
+
+void toggleMute()
+{
+  if (isMuted)
+  {
+    unMute();
+  }
+  else
+  {
+    mute();
+  }
+}
+
+static void knobTurned(int32_t detents)
+{
+  switch (state)
+  {
+  case STATE_RUN:
+    if (detents)
+    {
+      volumeUpdate(detents);
+    }
+    break;
+  case STATE_OFF:
+    if (detents)
+    {
+      standbyExit(); // the turn that woke us is not applied
+    }
+    break;
+  case STATE_IO:
+    if (detents)
+    {
+      sourceUpdate(detents);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static void buttonPressed()
+{
+  switch (state)
+  {
+  case STATE_RUN:
+    state = STATE_IO;
+    milOnButton = millis();
+    break;
+  case STATE_OFF:
+    standbyExit();
+    break;
+  default:
+    break;
+  }
+}
+
+// Apply the detents of a run of knob commands in one go, so the
+// acceleration sees them as one pass of the control loop
+static void knobFlush(int32_t &detents, uint32_t &count, uint32_t usOnFirst)
+{
+  if (detents)
+  {
+    knobTurned(detents);
+  }
+  if (count)
+  {
+    commandApplied(COMMAND_KNOB, usOnFirst, count);
+  }
+  detents = 0;
+  count = 0;
+}
+
+void commandUpdate()
+{
+  // Every detent turned since the last pass, none are dropped
+  int32_t detents = encoderDelta.exchange(0);
+  uint32_t knobCount = 0;
+  uint32_t usOnKnob = 0;
+  Command command;
+  while (commandTake(command))
+  {
+    if (command.source == COMMAND_KNOB)
+    {
+      int32_t turned;
+      memcpy(&turned, command.data, sizeof(turned));
+      detents += turned;
+      usOnKnob = knobCount++ ? usOnKnob : command.us;
+      continue;
+    }
+    // Detents turned before this command take effect before it
+    knobFlush(detents, knobCount, usOnKnob);
+    switch (command.source)
+    {
+    case COMMAND_BUTTON:
+      buttonPressed();
+      break;
+    case COMMAND_WS_TEXT:
+      handleCommandMessage(commandData(command), command.len);
+      break;
+    case COMMAND_WS_BINARY:
+      if (!handleBinaryMessage(commandData(command), command.len))
+      {
+        Serial.printf("WebSocket client #%u sent an invalid binary frame\n", (unsigned)command.client);
+      }
+      break;
+    }
+    commandRelease(command);
+    commandApplied(command.source, command.us);
+  }
+  knobFlush(detents, knobCount, usOnKnob);
+  // Remote frames are decoded here, on the control task, from the edge ring
+  // the IR interrupt fills, and timed from the end of their burst
+  IrFrame frame;
+  while (irRead(frame))
+  {
+    traceSpan(TRACE_IR, frame.us, frame.command);
+    remoteKey(frame);
+    commandApplied(COMMAND_IR, frame.us);
+  }
+  if (state == STATE_IO && (millis() - milOnButton) > TIME_EXITSELECT * 1000)
+  {
+    state = STATE_RUN;
+  }
+}
+
+void setIO()
+{
+  PROFILE_SCOPE(PROFILE_SET_IO);
+  switchRelays();
+  if (isMuted)
+  {
+    backlightOn();
+    isMuted = 0;
+    stateChanged(CHANGED_MUTE);
+    // set volume
+    setVolume();
+  }
+  stateChanged(CHANGED_SOURCE);
+}
+
+// ----------------------------------------------------------------------------
+// Deferred display and WebSocket updates
+// ----------------------------------------------------------------------------
+
+unsigned long renderUpdate()
+{
+  if (!renderPending.load())
+  {
+    return RENDER_IDLE_NONE;
+  }
+  // Too soon after the last frame: leave the changes pending so they merge
+  unsigned long wait = displayFrameWait();
+  if (wait)
+  {
+    return wait;
+  }
+  uint32_t changed = renderPending.exchange(0);
+  ControlSnapshot snapshot = controlSnapshot();
+  // Backlight off before the panel sleeps, on after it wakes
+  if ((changed & CHANGED_POWER) && !snapshot.standby)
+  {
+    halStandby(false);
+  }
+  if (changed & CHANGED_BACKLIGHT)
+  {
+    digitalWrite(TFT_BL, snapshot.backlight ? HIGH : LOW);
+  }
+  if ((changed & CHANGED_POWER) && snapshot.standby)
+  {
+    halStandby(true);
+  }
+  // The compositor pushes only the pixels that differ from the panel
+  displaySetLevel(snapshot.volume, snapshot.muted);
+  displaySetSource(inputName[snapshot.source - 1]);
+  displayUpdate(renderRequests.exchange(0));
+  if (changed & (CHANGED_VOLUME | CHANGED_SOURCE | CHANGED_MUTE | CHANGED_LEARN))
+  {
+    notifyClients();
+  }
+  return RENDER_IDLE_NONE;
+}
+
@@ -0,0 +1,391 @@
+/* TFT scene compositor
+*********************/
+
+#include "display.h"
+#include "hal.h"
+#include "glyphs.h"
+#include "taper.h"
+#include "spibus.h"
+#include "profile.h"
+#include "trace.h"
+#include "Free_Fonts.h" // Include the Free fonts header file
+
+#define DISPLAY_FG TFT_BLUE
+#define DISPLAY_BG TFT_WHITE
+#define DISPLAY_WIDTH 320 // panel width in landscape, the widest a widget can be
+#define DISPLAY_OVERHANG 2 // columns a glyph may reach past its advance, and rows past the line
+
+struct Widget
+{
+  int16_t x, y, w, h;     // position on the panel
+  const GFXfont *font;
+  uint8_t size;           // text size multiplier
+  char text[DISPLAY_TEXT_SIZE];  // text shown on the panel
+  char next[DISPLAY_TEXT_SIZE];  // text for the next update
+  bool dirty;             // next differs from text
+  bool full;              // push the whole widget
+  TFT_eSprite *sprite;
+  GlyphFont *glyphs;      // cached smooth font, the free font is used until it is loaded
+};
+
+// Smooth fonts from data/, with the characters each one has to draw
+static GlyphFont readoutFont; // NotoSansBold36: level and source name
+static GlyphFont clockFont;   // NotoSansMonoSCB20: fixed pitch, so a tick changes only its digits
+static const char *const fontGlyphs[] = {"0123456789-.dBMuted" DISPLAY_SOURCE_GLYPHS, "0123456789:-"};
+static GlyphFont *const fonts[] = {&readoutFont, &clockFont};
+
+// Same places as the original screen layout
+static Widget clockWidget = {40, 12, 240, 56, FSS24, 1, "", "", false, false, nullptr, &clockFont};
+static Widget levelWidget = {0, 78, 320, 84, FSS18, 2, "", "", false, false, nullptr, &readoutFont};
+static Widget sourceWidget = {30, 172, 240, 56, FSS24, 1, "", "", false, false, nullptr, &readoutFont};
+static Widget *const widgets[] = {&clockWidget, &levelWidget, &sourceWidget};
+
+static DisplayStats stats;
+static unsigned long milOnFrame; // when the last frame was drawn
+
+#define DISPLAY_DMA_STRIP (DISPLAY_WIDTH * DISPLAY_DMA_LINES)
+
+static uint16_t colour16[256]; // 8-bit sprite colour to 16-bit panel colour
+static uint16_t *dmaBuffer[2]; // staging buffers, one filling while the other is sent
+static uint8_t dmaNext;
+static bool dma; // false if the staging buffers or DMA could not be set up, rows are pushed blocking instead
+
+static void setText(Widget &widget, const char *text)
+{
+  if (strcmp(widget.next, text) != 0)
+  {
+    strncpy(widget.next, text, DISPLAY_TEXT_SIZE - 1);
+    widget.next[DISPLAY_TEXT_SIZE - 1] = 0;
+    widget.dirty = true;
+  }
+}
+
+static bool smooth(const Widget &widget)
+{
+  return widget.glyphs && widget.glyphs->count;
+}
+
+static int16_t textWidth(Widget &widget, const char *text)
+{
+  return smooth(widget) ? glyphTextWidth(*widget.glyphs, text) : widget.sprite->textWidth(text);
+}
+
+static void drawText(Widget &widget)
+{
+  widget.sprite->fillSprite(DISPLAY_BG);
+  if (smooth(widget))
+  {
+    int16_t x = widget.w / 2 - glyphTextWidth(*widget.glyphs, widget.next) / 2;
+    int16_t y = (widget.h - glyphLineHeight(*widget.glyphs)) / 2;
+    glyphDraw(*widget.glyphs, (uint8_t *)widget.sprite->getPointer(), widget.w, widget.h, x, y, widget.next);
+  }
+  else
+  {
+    widget.sprite->drawString(widget.next, widget.w / 2, widget.h / 2);
+  }
+}
+
+// Top and bottom row (sprite y) that the old or the new text can cover.
+// Both are drawn in the same font and centred the same way, so the rows
+// above and below the line are background in either.
+static void changedRows(Widget &widget, int16_t &top, int16_t &bottom)
+{
+  top = 0;
+  bottom = widget.h;
+  if (widget.full)
+  {
+    return;
+  }
+  if (smooth(widget))
+  {
+    int16_t y = (widget.h - glyphLineHeight(*widget.glyphs)) / 2;
+    glyphInkRows(*widget.glyphs, top, bottom);
+    top += y;
+    bottom += y;
+  }
+  else
+  {
+    int16_t height = widget.sprite->fontHeight();
+    top = widget.h / 2 - height / 2 - DISPLAY_OVERHANG;
+    bottom = top + height + 2 * DISPLAY_OVERHANG;
+  }
+  if (top < 0)
+  {
+    top = 0;
+  }
+  if (bottom > widget.h)
+  {
+    bottom = widget.h;
+  }
+}
+
+// Left and right edge (sprite x) of the columns that differ between the
+// text on the panel and the new text. Both are drawn centred, so when the
+// widths match only the span between the common prefix and suffix changes.
+static void changedColumns(Widget &widget, int16_t &left, int16_t &right)
+{
+  int16_t oldWidth = textWidth(widget, widget.text);
+  int16_t newWidth = textWidth(widget, widget.next);
+  int16_t centre = widget.w / 2;
+  if (widget.full)
+  {
+    left = 0;
+    right = widget.w;
+    return;
+  }
+  if (oldWidth != newWidth)
+  {
+    int16_t half = (oldWidth > newWidth ? oldWidth : newWidth) / 2 + 1 + DISPLAY_OVERHANG;
+    left = centre - half;
+    right = centre + half;
+  }
+  else
+  {
+    size_t len = strlen(widget.next);
+    size_t prefix = 0;
+    while (prefix < len && widget.text[prefix] == widget.next[prefix])
+    {
+      prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < len - prefix && widget.text[len - 1 - suffix] == widget.next[len - 1 - suffix])
+    {
+      suffix++;
+    }
+    char part[DISPLAY_TEXT_SIZE];
+    memcpy(part, widget.next, prefix);
+    part[prefix] = 0;
+    left = centre - newWidth / 2 + textWidth(widget, part) - DISPLAY_OVERHANG;
+    strcpy(part, widget.next + len - suffix);
+    right = centre + newWidth / 2 - textWidth(widget, part) + 1 + DISPLAY_OVERHANG;
+  }
+  if (left < 0)
+  {
+    left = 0;
+  }
+  if (right > widget.w)
+  {
+    right = widget.w;
+  }
+}
+
+static void busBegin()
+{
+  spiAcquire(SPI_DEVICE_TFT);
+  tft.startWrite();
+}
+
+static void busEnd()
+{
+  tft.dmaWait();
+  tft.endWrite();
+  spiRelease(SPI_DEVICE_TFT);
+}
+
+// Without DMA: one row at a time from the stack, each transfer blocking.
+// The window is set again for every row, because a yield ends the
+// panel's memory write.
+static void pushRows(Widget &widget, int16_t left, int16_t right, int16_t top, int16_t bottom)
+{
+  const uint8_t *pixels = (const uint8_t *)widget.sprite->getPointer();
+  int16_t width = right - left;
+  uint16_t line[DISPLAY_WIDTH];
+  for (int16_t y = top; y < bottom; y++)
+  {
+    const uint8_t *in = pixels + y * widget.w + left;
+    for (int16_t x = 0; x < width; x++)
+    {
+      line[x] = colour16[in[x]];
+    }
+    tft.setAddrWindow(widget.x + left, widget.y + y, width, 1);
+    tft.pushPixels(line, width);
+    if (spiYieldWanted())
+    {
+      busEnd();
+      busBegin();
+    }
+  }
+}
+
+// Pushes a rectangle of a widget as DMA strips. pushImageDMA() waits for
+// the transfer before it, so filling one staging buffer overlaps the
+// transfer from the other. Between strips the bus goes to a waiting volume
+// or relay write.
+static void pushWindow(Widget &widget, int16_t left, int16_t right, int16_t top, int16_t bottom)
+{
+  if (!dma)
+  {
+    pushRows(widget, left, right, top, bottom);
+    return;
+  }
+  const uint8_t *pixels = (const uint8_t *)widget.sprite->getPointer();
+  int16_t width = right - left;
+  for (int16_t row = top; row < bottom; row += DISPLAY_DMA_LINES)
+  {
+    PROFILE_SCOPE(PROFILE_TFT_STRIP);
+    int16_t lines = bottom - row < DISPLAY_DMA_LINES ? bottom - row : DISPLAY_DMA_LINES;
+    uint16_t *strip = dmaBuffer[dmaNext];
+    dmaNext ^= 1;
+    uint16_t *out = strip;
+    for (int16_t y = row; y < row + lines; y++)
+    {
+      const uint8_t *in = pixels + y * widget.w + left;
+      for (int16_t x = 0; x < width; x++)
+      {
+        *out++ = colour16[in[x]];
+      }
+    }
+    tft.pushImageDMA(widget.x + left, widget.y + row, width, lines, strip);
+    if (spiYieldWanted())
+    {
+      busEnd();
+      busBegin();
+    }
+  }
+}
+
+void displayBegin()
+{
+  for (Widget *widget : widgets)
+  {
+    widget->sprite = new TFT_eSprite(&tft);
+    widget->sprite->setColorDepth(8);
+    widget->sprite->createSprite(widget->w, widget->h);
+    widget->sprite->setFreeFont(widget->font);
+    widget->sprite->setTextSize(widget->size);
+    widget->sprite->setTextDatum(MC_DATUM);
+    widget->sprite->setTextColor(DISPLAY_FG, DISPLAY_BG);
+  }
+  // 8-bit sprite colours in panel byte order, ready for the DMA buffers
+  for (int i = 0; i < 256; i++)
+  {
+    uint16_t colour = tft.color8to16(i);
+    colour16[i] = colour << 8 | colour >> 8;
+  }
+  for (uint16_t *&buffer : dmaBuffer)
+  {
+    buffer = (uint16_t *)halDmaMalloc(DISPLAY_DMA_STRIP * sizeof(uint16_t));
+  }
+  dma = dmaBuffer[0] && dmaBuffer[1] && tft.initDMA();
+  if (!dma)
+  {
+    for (uint16_t *&buffer : dmaBuffer)
+    {
+      free(buffer);
+      buffer = NULL;
+    }
+    Serial.println(F("Display: no DMA, rows are pushed blocking"));
+  }
+  spiAcquire(SPI_DEVICE_TFT);
+  tft.fillScreen(DISPLAY_BG);
+  spiRelease(SPI_DEVICE_TFT);
+}
+void displaySetLevel(int16_t volume, bool muted)
+{
+  // Labels are preformatted, one per chip step
+  setText(levelWidget, muted ? "Muted" : taperLabel(volume));
+}
+
+void displaySetSource(const char *name)
+{
+  setText(sourceWidget, name);
+}
+
+void displaySetClock(const char *text)
+{
+  setText(clockWidget, text);
+}
+
+bool displayLoadFont(uint8_t font, const uint8_t *vlw, size_t len)
+{
+  if (font >= sizeof(fonts) / sizeof(fonts[0]))
+  {
+    return false;
+  }
+  glyphFontFree(*fonts[font]);
+  bool loaded = glyphFontLoad(*fonts[font], vlw, len, fontGlyphs[font], DISPLAY_FG, DISPLAY_BG);
+  displayClear();
+  return loaded;
+}
+
+void displayClear()
+{
+  PROFILE_SCOPE(PROFILE_TFT_FILL);
+  spiAcquire(SPI_DEVICE_TFT);
+  tft.fillScreen(DISPLAY_BG);
+  spiRelease(SPI_DEVICE_TFT);
+  for (Widget *widget : widgets)
+  {
+    widget->dirty = true;
+    widget->full = true;
+  }
+}
+
+unsigned long displayFrameWait()
+{
+  unsigned long elapsed = millis() - milOnFrame;
+  if (stats.frames == 0 || elapsed >= DISPLAY_FRAME_MS)
+  {
+    return 0;
+  }
+  return DISPLAY_FRAME_MS - elapsed;
+}
+
+uint32_t displayUpdate(uint32_t changes)
+{
+  PROFILE_SCOPE(PROFILE_TFT_FRAME);
+  unsigned long start = micros();
+  uint32_t pixels = 0;
+  bool drawn = false;
+  for (Widget *widget : widgets)
+  {
+    if (!widget->dirty || !widget->sprite)
+    {
+      continue;
+    }
+    int16_t left, right, top, bottom;
+    changedColumns(*widget, left, right);
+    changedRows(*widget, top, bottom);
+    drawText(*widget);
+    if (right > left && bottom > top)
+    {
+      if (pixels == 0)
+      {
+        busBegin();
+      }
+      pushWindow(*widget, left, right, top, bottom);
+      pixels += (right - left) * (bottom - top);
+      stats.pushes++;
+    }
+    strcpy(widget->text, widget->next);
+    widget->dirty = false;
+    widget->full = false;
+    drawn = true;
+  }
+  if (pixels)
+  {
+    busEnd();
+    stats.updates++;
+    stats.pixels += pixels;
+    stats.lastPixels = pixels;
+    traceSpan(TRACE_FRAME, start, pixels > 0xFFFF ? 0xFFFF : pixels);
+  }
+  if (drawn)
+  {
+    milOnFrame = millis();
+    stats.frames++;
+    stats.merged += changes > 1 ? changes - 1 : 0;
+    stats.frameUs = micros() - start;
+    stats.frameUsTotal += stats.frameUs;
+    if (stats.frameUs > stats.frameUsMax)
+    {
+      stats.frameUsMax = stats.frameUs;
+    }
+  }
+  return pixels;
+}
+
+const DisplayStats &displayStats()
+{
+  return stats;
+}
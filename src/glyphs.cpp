@@ -0,0 +1,195 @@
+/* Smooth font glyph cache
+*********************/
+
+#include "glyphs.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define VLW_HEADER 24 // glyph count, version, size, unused, ascent, descent
+#define VLW_GLYPH 28  // code, height, width, advance, dy, dx, unused
+
+static int32_t readInt(const uint8_t *p)
+{
+  return (int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+}
+
+// Blend two RGB565 colours and reduce to the RGB332 used by 8-bit sprites
+static uint8_t blend(uint16_t fg, uint16_t bg, uint8_t alpha)
+{
+  uint16_t r = ((fg >> 11) * alpha + (bg >> 11) * (255 - alpha)) / 255;
+  uint16_t g = (((fg >> 5) & 0x3F) * alpha + ((bg >> 5) & 0x3F) * (255 - alpha)) / 255;
+  uint16_t b = ((fg & 0x1F) * alpha + (bg & 0x1F) * (255 - alpha)) / 255;
+  return (r >> 2) << 5 | (g >> 3) << 2 | b >> 3;
+}
+
+static const Glyph *findGlyph(const GlyphFont &font, char c)
+{
+  if (c < GLYPH_FIRST || c > GLYPH_LAST || !font.index[c - GLYPH_FIRST])
+  {
+    return nullptr;
+  }
+  return &font.glyphs[font.index[c - GLYPH_FIRST] - 1];
+}
+
+static bool inRange(int32_t value, int32_t min, int32_t max)
+{
+  return value >= min && value <= max;
+}
+
+// Leave the font empty, so the built-in one is used
+static bool reject(GlyphFont &font)
+{
+  free(font.pixels);
+  memset(&font, 0, sizeof(font));
+  return false;
+}
+
+bool glyphFontLoad(GlyphFont &font, const uint8_t *vlw, size_t len, const char *chars, uint16_t fg, uint16_t bg)
+{
+  memset(&font, 0, sizeof(font));
+  if (len < VLW_HEADER)
+  {
+    return false;
+  }
+  // Every size is checked against what is left of the file before it is
+  // used, so a damaged or foreign file cannot overflow the arithmetic
+  int32_t count = readInt(vlw);
+  int32_t ascent = readInt(vlw + 16);
+  int32_t descent = readInt(vlw + 20);
+  if (count <= 0 || (size_t)count > (len - VLW_HEADER) / VLW_GLYPH || !inRange(ascent, 0, GLYPH_SIZE_MAX) ||
+      !inRange(descent, 0, GLYPH_SIZE_MAX - ascent))
+  {
+    return false;
+  }
+  font.ascent = ascent;
+  font.descent = descent;
+  font.space = (font.ascent + font.descent) * 2 / 7;
+  font.background = blend(fg, bg, 0);
+
+  // First pass: pick the wanted glyphs and size the pixel store
+  const uint8_t *table = vlw + VLW_HEADER;
+  size_t bitmap = VLW_HEADER + count * VLW_GLYPH;
+  size_t total = 0;
+  uint32_t sources[GLYPH_MAX];
+  for (int32_t i = 0; i < count; i++)
+  {
+    const uint8_t *entry = table + i * VLW_GLYPH;
+    int32_t code = readInt(entry);
+    int32_t height = readInt(entry + 4);
+    int32_t width = readInt(entry + 8);
+    int32_t advance = readInt(entry + 12);
+    int32_t dy = readInt(entry + 16);
+    int32_t dx = readInt(entry + 20);
+    if (!inRange(width, 0, GLYPH_SIZE_MAX) || !inRange(height, 0, GLYPH_SIZE_MAX) || !inRange(advance, 0, GLYPH_SIZE_MAX) ||
+        !inRange(dy, INT8_MIN, INT8_MAX) || !inRange(dx, INT8_MIN, INT8_MAX) || (size_t)(width * height) > len - bitmap)
+    {
+      return reject(font);
+    }
+    if (code >= GLYPH_FIRST && code <= GLYPH_LAST && strchr(chars, code) && !font.index[code - GLYPH_FIRST] &&
+        font.count < GLYPH_MAX)
+    {
+      Glyph &glyph = font.glyphs[font.count];
+      glyph.width = width;
+      glyph.height = height;
+      glyph.advance = advance;
+      glyph.dy = dy;
+      glyph.dx = dx;
+      glyph.offset = total;
+      int16_t top = font.ascent - dy;
+      if (!font.count || top < font.inkTop)
+      {
+        font.inkTop = top;
+      }
+      if (!font.count || top + height > font.inkBottom)
+      {
+        font.inkBottom = top + height;
+      }
+      sources[font.count] = bitmap;
+      font.index[code - GLYPH_FIRST] = ++font.count;
+      total += width * height;
+      if (total > GLYPH_PIXELS_MAX)
+      {
+        return reject(font);
+      }
+    }
+    bitmap += width * height;
+  }
+
+  // Second pass: blend the alpha bitmaps into sprite colours
+  font.pixels = (uint8_t *)malloc(total ? total : 1);
+  if (!font.pixels)
+  {
+    return reject(font);
+  }
+  for (uint8_t i = 0; i < font.count; i++)
+  {
+    const Glyph &glyph = font.glyphs[i];
+    for (uint32_t p = 0; p < (uint32_t)glyph.width * glyph.height; p++)
+    {
+      font.pixels[glyph.offset + p] = blend(fg, bg, vlw[sources[i] + p]);
+    }
+  }
+  return true;
+}
+
+void glyphFontFree(GlyphFont &font)
+{
+  free(font.pixels);
+  memset(&font, 0, sizeof(font));
+}
+
+int16_t glyphTextWidth(const GlyphFont &font, const char *text)
+{
+  int16_t width = 0;
+  for (; *text; text++)
+  {
+    const Glyph *glyph = findGlyph(font, *text);
+    width += glyph ? glyph->advance : (*text == ' ' ? font.space : 0);
+  }
+  return width;
+}
+
+uint8_t glyphLineHeight(const GlyphFont &font)
+{
+  return font.ascent + font.descent;
+}
+
+void glyphInkRows(const GlyphFont &font, int16_t &top, int16_t &bottom)
+{
+  top = font.inkTop;
+  bottom = font.inkBottom;
+}
+
+void glyphDraw(const GlyphFont &font, uint8_t *target, int16_t width, int16_t height, int16_t x, int16_t y, const char *text)
+{
+  int16_t baseline = y + font.ascent;
+  for (; *text; text++)
+  {
+    const Glyph *glyph = findGlyph(font, *text);
+    if (!glyph)
+    {
+      x += *text == ' ' ? font.space : 0;
+      continue;
+    }
+    const uint8_t *pixels = font.pixels + glyph->offset;
+    for (int16_t row = 0; row < glyph->height; row++)
+    {
+      int16_t ty = baseline - glyph->dy + row;
+      if (ty < 0 || ty >= height)
+      {
+        continue;
+      }
+      for (int16_t col = 0; col < glyph->width; col++)
+      {
+        int16_t tx = x + glyph->dx + col;
+        uint8_t pixel = pixels[row * glyph->width + col];
+        // Background pixels are left alone so overhanging neighbours survive
+        if (tx >= 0 && tx < width && pixel != font.background)
+        {
+          target[ty * width + tx] = pixel;
+        }
+      }
+    }
+    x += glyph->advance;
+  }
+}
@@ -0,0 +1,410 @@
+/* Infra-red receiver
+*********************/
+
+#include "ir.h"
+#include <Arduino.h>
+
+#define IR_TOLERANCE_US 100 // accepted error on a leader or pulse-coded length, on top of 25%
+#define IR_MARK_MAX_US 20000 // a mark this long is a stuck receiver, not a leader
+
+// Line codings
+#define IR_BIPHASE 0        // each bit is a mark and a space, their order gives the value
+#define IR_PULSE_DISTANCE 1 // fixed marks, the space after each gives the value
+#define IR_PULSE_WIDTH 2    // fixed spaces, the length of each mark gives the value
+
+// Where the toggle comes from
+#define IR_TOGGLE_BIT 0    // sent in the frame
+#define IR_TOGGLE_REPEAT 1 // held keys send repeat codes, so every full frame is a new press
+#define IR_TOGGLE_HOLD 2   // held keys resend the frame; another key or a pause is a new press
+
+#define IR_NO_WIDE_BIT 0xFF
+
+// One row of the timing table, all lengths in microseconds
+struct IrProtocol
+{
+  uint8_t coding;
+  uint8_t toggle;
+  uint16_t unit;        // bi-phase half bit, or the fixed mark (distance) or space (width)
+  uint16_t zero;        // pulse coded: the variable space or mark of a 0...
+  uint16_t one;         // ...and of a 1
+  uint16_t leaderMark;  // 0: no leader
+  uint16_t leaderSpace;
+  uint16_t repeatSpace; // leader space of a repeat code, 0: none
+  uint8_t minBits;
+  uint8_t maxBits;
+  uint8_t wideBit;      // bi-phase: bit sent with double length halves (RC6 trailer)
+  bool oneMarkFirst;    // bi-phase: a 1 is a mark then a space
+  bool lsbFirst;        // first bit received is the least significant
+  bool (*fields)(uint32_t bits, uint8_t count, IrFrame &frame); // split the bits, false if a check fails
+};
+
+// S1, S2 (inverted command bit 6 in extended RC5), toggle, 5 address, 6 command bits
+static bool rc5Fields(uint32_t bits, uint8_t /*count*/, IrFrame &frame)
+{
+  frame.toggle = (bits >> 11) & 1;
+  frame.address = (bits >> 6) & 0x1F;
+  frame.command = (bits & 0x3F) | (((bits >> 12) & 1) ? 0 : 0x40);
+  return (bits >> 13) & 1;
+}
+
+// Start bit, 3 mode bits, trailer (the toggle), 8 address, 8 command bits; mode 0 only
+static bool rc6Fields(uint32_t bits, uint8_t /*count*/, IrFrame &frame)
+{
+  frame.toggle = (bits >> 16) & 1;
+  frame.address = (bits >> 8) & 0xFF;
+  frame.command = bits & 0xFF;
+  return (bits >> 17) == 0x8;
+}
+
+// Address, inverted address (or its high byte when extended), command, inverted command
+static bool necFields(uint32_t bits, uint8_t /*count*/, IrFrame &frame)
+{
+  uint8_t low = bits & 0xFF;
+  uint8_t high = (bits >> 8) & 0xFF;
+  frame.command = (bits >> 16) & 0xFF;
+  frame.address = (uint8_t)~high == low ? low : (bits & 0xFFFF);
+  return (uint8_t)~(bits >> 24) == frame.command;
+}
+
+// 7 command bits, then 5, 8 or 13 address (device and extension) bits
+static bool sircFields(uint32_t bits, uint8_t count, IrFrame &frame)
+{
+  frame.command = bits & 0x7F;
+  frame.address = bits >> 7;
+  return count == 12 || count == 15 || count == 20;
+}
+
+static const IrProtocol irProtocols[IR_PROTOCOLS] = {
+    // coding, toggle, unit, zero, one, leader mark, space, repeat, bits, wide bit, 1 mark first, LSB first
+    {IR_BIPHASE, IR_TOGGLE_BIT, IR_RC5_HALF_US, 0, 0, 0, 0, 0, 14, 14, IR_NO_WIDE_BIT, false, false, rc5Fields},
+    {IR_BIPHASE, IR_TOGGLE_BIT, 444, 0, 0, 2666, 889, 0, 21, 21, 4, true, false, rc6Fields},
+    {IR_PULSE_DISTANCE, IR_TOGGLE_REPEAT, 560, 560, 1690, 9000, 4500, 2250, 32, 32, IR_NO_WIDE_BIT, false, true, necFields},
+    {IR_PULSE_WIDTH, IR_TOGGLE_HOLD, 600, 600, 1200, 2400, 600, 0, 12, 20, IR_NO_WIDE_BIT, false, true, sircFields},
+};
+
+const char *irProtocolName[IR_PROTOCOLS] = {"RC5", "RC6", "NEC", "SIRC"};
+
+// Decoder phases
+#define IR_LEADER_MARK 0
+#define IR_LEADER_SPACE 1
+#define IR_DATA 2
+#define IR_FAILED 3 // not this protocol, wait for the end of the burst
+
+// Per protocol decoder state, all of them see every burst
+struct IrDecoder
+{
+  uint8_t phase;
+  bool repeat;       // the leader was a repeat code's
+  uint64_t halves;   // bi-phase: half-bit levels, mark = 1, first one highest
+  uint8_t halfCount;
+  uint32_t bits;     // bits received so far
+  uint8_t bitCount;
+  bool held;         // last is recent enough to be repeated
+  IrFrame last;      // previous frame, for repeat codes and made up toggles
+  uint32_t lastUs;   // when it ended
+};
+
+// Edge ring: timestamp with the new level in bit 0
+static uint32_t ring[IR_RING_SIZE];
+static std::atomic<uint32_t> ringHead(0); // written by the interrupt
+static std::atomic<uint32_t> ringTail(0); // written by irRead()
+static IrStats stats;
+
+// Burst state. The receiver idles high (space) and goes low (mark) while
+// it sees the carrier; a burst starts on a falling edge and ends with a
+// space of IR_GAP_US.
+static IrDecoder decoders[IR_PROTOCOLS];
+static bool inBurst;
+static bool level;      // level since the last edge
+static uint32_t lastUs; // time of the last edge
+static IrFrame pending; // frame decoded from the last burst
+
+void IRAM_ATTR irEdge(uint32_t us, bool newLevel)
+{
+  uint32_t head = ringHead.load(std::memory_order_relaxed);
+  stats.edges.fetch_add(1, std::memory_order_relaxed);
+  if (head - ringTail.load(std::memory_order_acquire) >= IR_RING_SIZE)
+  {
+    stats.overflows.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  ring[head & (IR_RING_SIZE - 1)] = (us & ~1UL) | newLevel;
+  ringHead.store(head + 1, std::memory_order_release);
+}
+
+static bool near(uint32_t us, uint16_t expected)
+{
+  uint32_t tolerance = expected / 4 + IR_TOLERANCE_US;
+  return us + tolerance >= expected && us <= expected + tolerance;
+}
+
+static void addBit(const IrProtocol &p, IrDecoder &d, bool one)
+{
+  d.bits = p.lsbFirst ? d.bits | (uint32_t)one << d.bitCount : d.bits << 1 | one;
+  d.bitCount++;
+}
+
+static void begin(const IrProtocol &p, IrDecoder &d)
+{
+  d.phase = p.leaderMark ? IR_LEADER_MARK : IR_DATA;
+  d.repeat = false;
+  d.halves = 0;
+  // RC5: the burst starts in the middle of the first start bit, whose first half is a space
+  d.halfCount = p.coding == IR_BIPHASE && !p.leaderMark && !p.oneMarkFirst ? 1 : 0;
+  d.bits = 0;
+  d.bitCount = 0;
+}
+
+// A bi-phase mark or space is one, two or (next to a wide bit) three halves long
+static void biphasePulse(const IrProtocol &p, IrDecoder &d, bool mark, uint32_t us)
+{
+  uint32_t count = (us + p.unit / 2) / p.unit;
+  uint32_t error = us > count * p.unit ? us - count * p.unit : count * p.unit - us;
+  uint8_t longest = p.wideBit == IR_NO_WIDE_BIT ? 2 : 3;
+  if (count < 1 || count > longest || error > p.unit * 2 / 5 || d.halfCount + count > 64)
+  {
+    d.phase = IR_FAILED;
+    return;
+  }
+  while (count--)
+  {
+    d.halves = d.halves << 1 | mark;
+    d.halfCount++;
+  }
+}
+
+static void codedPulse(const IrProtocol &p, IrDecoder &d, bool mark, uint32_t us)
+{
+  if (mark != (p.coding == IR_PULSE_WIDTH))
+  {
+    // The fixed length pulse between bits
+    if (!near(us, p.unit))
+    {
+      d.phase = IR_FAILED;
+    }
+    return;
+  }
+  bool one = us * 2 > (uint32_t)p.zero + p.one;
+  if (d.repeat || d.bitCount == p.maxBits || !near(us, one ? p.one : p.zero))
+  {
+    d.phase = IR_FAILED;
+    return;
+  }
+  addBit(p, d, one);
+}
+
+static void pulse(const IrProtocol &p, IrDecoder &d, bool mark, uint32_t us)
+{
+  switch (d.phase)
+  {
+  case IR_LEADER_MARK:
+    d.phase = mark && near(us, p.leaderMark) ? IR_LEADER_SPACE : IR_FAILED;
+    break;
+  case IR_LEADER_SPACE:
+    d.repeat = p.repeatSpace && near(us, p.repeatSpace);
+    d.phase = d.repeat || near(us, p.leaderSpace) ? IR_DATA : IR_FAILED;
+    break;
+  case IR_DATA:
+    if (p.coding == IR_BIPHASE)
+    {
+      biphasePulse(p, d, mark, us);
+    }
+    else
+    {
+      codedPulse(p, d, mark, us);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Level of the next `width` halves, counting down from pos; false if they differ
+static bool readHalf(const IrDecoder &d, uint8_t &pos, uint8_t width, bool &mark)
+{
+  mark = (d.halves >> --pos) & 1;
+  while (--width)
+  {
+    if (((d.halves >> --pos) & 1) != mark)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Check the half-bit pairs of a complete bi-phase frame and turn them into bits
+static bool biphaseBits(const IrProtocol &p, IrDecoder &d)
+{
+  uint8_t expected = 2 * p.maxBits + (p.wideBit == IR_NO_WIDE_BIT ? 0 : 2);
+  if (d.halfCount + 1 == expected)
+  {
+    // The last half is a space, so it only ended with the gap
+    d.halves <<= 1;
+    d.halfCount++;
+  }
+  if (d.halfCount != expected)
+  {
+    return false;
+  }
+  uint8_t pos = expected;
+  for (uint8_t bit = 0; bit < p.maxBits; bit++)
+  {
+    uint8_t width = bit == p.wideBit ? 2 : 1;
+    bool first, second;
+    if (!readHalf(d, pos, width, first) || !readHalf(d, pos, width, second) || first == second)
+    {
+      return false;
+    }
+    addBit(p, d, first == p.oneMarkFirst);
+  }
+  return true;
+}
+
+// End of burst: -1 if it was not this protocol, 1 if it gave a frame
+static int8_t finish(const IrProtocol &p, IrDecoder &d, uint32_t us, IrFrame &frame)
+{
+  if (d.phase != IR_DATA)
+  {
+    return -1;
+  }
+  if (d.repeat)
+  {
+    if (d.bitCount)
+    {
+      return -1;
+    }
+    stats.repeats.fetch_add(1, std::memory_order_relaxed);
+    if (!d.held || us - d.lastUs > IR_HOLD_US)
+    {
+      d.held = false; // the frame it repeats was missed
+      return 0;
+    }
+    d.lastUs = us;
+    frame = d.last;
+    return 1;
+  }
+  if ((p.coding == IR_BIPHASE && !biphaseBits(p, d)) || d.bitCount < p.minBits)
+  {
+    return -1;
+  }
+  frame.protocol = &p - irProtocols;
+  frame.toggle = 0;
+  if (!p.fields(d.bits, d.bitCount, frame))
+  {
+    return -1;
+  }
+  if (p.toggle != IR_TOGGLE_BIT)
+  {
+    bool same = d.held && us - d.lastUs <= IR_HOLD_US && frame.address == d.last.address && frame.command == d.last.command;
+    frame.toggle = (p.toggle == IR_TOGGLE_HOLD && same) ? d.last.toggle : !d.last.toggle;
+  }
+  d.last = frame;
+  d.lastUs = us;
+  d.held = true;
+  stats.frames.fetch_add(1, std::memory_order_relaxed);
+  stats.protocol[frame.protocol].fetch_add(1, std::memory_order_relaxed);
+  return 1;
+}
+
+// The first protocol that recognises the burst has it
+static bool endBurst()
+{
+  inBurst = false;
+  for (uint8_t i = 0; i < IR_PROTOCOLS; i++)
+  {
+    int8_t result = finish(irProtocols[i], decoders[i], lastUs, pending);
+    if (result >= 0)
+    {
+      pending.us = lastUs;
+      return result > 0;
+    }
+  }
+  stats.errors.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+// Feed one edge, true when it completes a frame
+static bool feed(uint32_t us, bool newLevel)
+{
+  bool decoded = false;
+  if (inBurst)
+  {
+    uint32_t elapsed = us - lastUs;
+    if (level == HIGH && elapsed > IR_GAP_US)
+    {
+      decoded = endBurst(); // this edge may start the next burst below
+    }
+    else
+    {
+      for (uint8_t i = 0; i < IR_PROTOCOLS; i++)
+      {
+        if (newLevel == level)
+        {
+          decoders[i].phase = IR_FAILED; // an edge was lost
+        }
+        else if (decoders[i].phase != IR_FAILED)
+        {
+          pulse(irProtocols[i], decoders[i], level == LOW, elapsed);
+        }
+      }
+      level = newLevel;
+      lastUs = us;
+      return false;
+    }
+  }
+  if (newLevel == LOW)
+  {
+    inBurst = true;
+    level = LOW;
+    lastUs = us;
+    for (uint8_t i = 0; i < IR_PROTOCOLS; i++)
+    {
+      begin(irProtocols[i], decoders[i]);
+    }
+  }
+  return decoded;
+}
+
+bool irRead(IrFrame &frame)
+{
+  bool decoded = false;
+  uint32_t tail = ringTail.load(std::memory_order_relaxed);
+  while (!decoded && tail != ringHead.load(std::memory_order_acquire))
+  {
+    uint32_t edge = ring[tail & (IR_RING_SIZE - 1)];
+    ringTail.store(++tail, std::memory_order_release);
+    decoded = feed(edge & ~1UL, edge & 1);
+  }
+  if (!decoded && inBurst && micros() - lastUs > (level == HIGH ? IR_GAP_US : IR_MARK_MAX_US))
+  {
+    decoded = endBurst();
+  }
+  if (decoded)
+  {
+    frame = pending;
+  }
+  return decoded;
+}
+
+bool irIdle()
+{
+  return !inBurst && ringTail.load(std::memory_order_relaxed) == ringHead.load(std::memory_order_acquire);
+}
+
+int irProtocolIndex(const char *name)
+{
+  for (uint8_t i = 0; i < IR_PROTOCOLS; i++)
+  {
+    if (strcmp(name, irProtocolName[i]) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const IrStats &irStats()
+{
+  return stats;
+}
@@ -0,0 +1,160 @@
+/* Remote control key map
+*********************/
+
+#include "keymap.h"
+#include "hal.h"
+#include <ArduinoJson.h>
+#include <mutex>
+
+struct KeySlot
+{
+  uint32_t code;  // protocol, address and command, see keyCode()
+  uint8_t action; // KEY_NONE: empty
+};
+
+static KeySlot slots[KEYMAP_SLOTS];
+static size_t count;
+static std::mutex lock; // slots, while the persistence task copies them
+static char fileText[KEYMAP_FILE_MAX];
+
+const char *keyActionName[KEY_ACTIONS] = {"None", "Phono", "Media", "CD", "Tuner", "VolumeUp", "VolumeDown", "Mute", "Standby", "Display"};
+
+// The RC5 handset codes the controller has always answered to:
+// system 0x10 (pre-amplifier) and 0x14 (CD player, Play selects CD)
+static const struct
+{
+  uint8_t address;
+  uint8_t command;
+  uint8_t action;
+} defaults[] = {
+    {0x10, 1, KEY_PHONO}, {0x10, 3, KEY_TUNER}, {0x10, 7, KEY_CD}, {0x10, 8, KEY_MEDIA}, {0x10, 12, KEY_STANDBY},
+    {0x10, 13, KEY_MUTE}, {0x10, 16, KEY_VOLUME_UP}, {0x10, 17, KEY_VOLUME_DOWN}, {0x10, 59, KEY_DISPLAY}, {0x14, 53, KEY_CD}};
+
+static uint32_t keyCode(uint8_t protocol, uint16_t address, uint8_t command)
+{
+  return (uint32_t)protocol << 24 | (uint32_t)address << 8 | command;
+}
+
+// The slot holding a code, or the empty slot it would go in. Fibonacci
+// hashing spreads the neighbouring codes of one remote over the table.
+static KeySlot &probe(uint32_t code)
+{
+  uint32_t i = ((code * 2654435769UL) >> 16) & (KEYMAP_SLOTS - 1);
+  while (slots[i].action != KEY_NONE && slots[i].code != code)
+  {
+    i = (i + 1) & (KEYMAP_SLOTS - 1);
+  }
+  return slots[i];
+}
+
+static bool bind(uint32_t code, uint8_t action)
+{
+  KeySlot &slot = probe(code);
+  if (slot.action == KEY_NONE)
+  {
+    if (count >= KEYMAP_MAX)
+    {
+      return false;
+    }
+    count++;
+  }
+  slot.code = code;
+  slot.action = action;
+  return true;
+}
+
+static void clear()
+{
+  memset(slots, 0, sizeof(slots));
+  count = 0;
+}
+
+void keymapBegin()
+{
+  clear();
+  for (auto &key : defaults)
+  {
+    bind(keyCode(IR_RC5, key.address, key.command), key.action);
+  }
+  size_t len = halReadFile(KEYMAP_FILE, (uint8_t *)fileText, sizeof(fileText));
+  if (!len)
+  {
+    return;
+  }
+  JsonDocument json;
+  if (deserializeJson(json, fileText, len) || !json.is<JsonArray>())
+  {
+    Serial.println(F("Key map " KEYMAP_FILE " unreadable, using the default map"));
+    return;
+  }
+  // A saved map replaces the defaults, so keys can be taken out of it
+  clear();
+  uint8_t skipped = 0;
+  for (JsonVariant key : json.as<JsonArray>())
+  {
+    int protocol = irProtocolIndex(key["protocol"] | "");
+    uint8_t action = keymapAction(key["action"] | "");
+    if (protocol < 0 || action == KEY_NONE || !key["address"].is<int>() || !key["command"].is<int>() ||
+        !bind(keyCode(protocol, key["address"].as<int>(), key["command"].as<int>()), action))
+    {
+      skipped++;
+    }
+  }
+  Serial.printf("Key map: %u codes loaded, %u skipped\n", (unsigned)count, skipped);
+}
+
+uint8_t keymapLookup(const IrFrame &frame)
+{
+  return probe(keyCode(frame.protocol, frame.address, frame.command)).action;
+}
+
+bool keymapLearn(const IrFrame &frame, uint8_t action)
+{
+  if (action == KEY_NONE || action >= KEY_ACTIONS)
+  {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  return bind(keyCode(frame.protocol, frame.address, frame.command), action);
+}
+
+uint8_t keymapAction(const char *name)
+{
+  for (uint8_t i = KEY_NONE + 1; i < KEY_ACTIONS; i++)
+  {
+    if (strcmp(name, keyActionName[i]) == 0)
+    {
+      return i;
+    }
+  }
+  return KEY_NONE;
+}
+
+size_t keymapCount()
+{
+  return count;
+}
+
+bool keymapSave()
+{
+  KeySlot copy[KEYMAP_SLOTS];
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    memcpy(copy, slots, sizeof(copy));
+  }
+  JsonDocument json;
+  JsonArray keys = json.to<JsonArray>();
+  for (auto &slot : copy)
+  {
+    if (slot.action != KEY_NONE)
+    {
+      JsonObject key = keys.add<JsonObject>();
+      key["protocol"] = irProtocolName[slot.code >> 24];
+      key["address"] = (slot.code >> 8) & 0xFFFF;
+      key["command"] = slot.code & 0xFF;
+      key["action"] = keyActionName[slot.action];
+    }
+  }
+  size_t len = serializeJson(json, fileText, sizeof(fileText));
+  return halWriteFile(KEYMAP_FILE, (const uint8_t *)fileText, len);
+}
@@ -37,7 +37,6 @@ Arduino + 4x20 LCD version 2.0 Date	27 April 2022
 #include <Preferences.h>
 #include <SPI.h>
 #include <TFT_eSPI.h> // Hardware-specific library
-#include <RC5.h>
 #include <muses72323.h> // Hardware-specific library
 #include <ESP32RotaryEncoder.h>
 #include <MCP23S08.h> // Hardware-specific library
@@ -46,11 +45,32 @@ Arduino + 4x20 LCD version 2.0 Date	27 April 2022
 #include <WiFi.h>
 #include <ESPmDNS.h>
 #include "time.h"
+#include <sys/time.h>
+#include <esp_timer.h>
+#include <esp_debug_helpers.h>
+#include <freertos/xtensa_context.h>
+#include <esp_heap_caps.h>
+#include <atomic>
 #include <ESPAsyncWebServer.h>
 #include <ElegantOTA.h>
 #include <AsyncTCP.h>
-#include <ArduinoJson.h>
 #include "Free_Fonts.h" // Include the Free fonts header file
+#include "hal.h"
+#include "controller.h"
+#include "settings.h"
+#include "broadcast.h"
+#include "binary_protocol.h"
+#include "ramp.h"
+#include "display.h"
+#include "ir.h"
+#include "spibus.h"
+#include "command.h"
+#include "metrics.h"
+#include "profile.h"
+#include "trace.h"
+#include "stall.h"
+#include "assets.h"
+#include <memory>
 #define FlashFS LittleFS
 
 // Current software
@@ -59,22 +79,6 @@ Arduino + 4x20 LCD version 2.0 Date	27 April 2022
 // version number
 #define VERSION_NUM "3.0"
 
-/******* MACHINE STATES *******/
-#define STATE_BALANCE 1 // when user adjusts balance
-#define STATE_RUN 0     // normal run state
-#define STATE_IO 1      // when user selects input/output
-#define STATE_OFF 4     // when power down
-#define ON LOW
-#define OFF HIGH
-#define STANDBY 0 // Standby
-#define ACTIVE 1  // Active
-
-// Preference modes
-#define RW_MODE false
-#define RO_MODE true
-
-#define TIME_EXITSELECT 5 //** Time in seconds to exit I/O select mode when no activity
-
 Preferences preferences;
 
 // 23S08 Construct
@@ -84,8 +88,6 @@ TFT_eSPI tft = TFT_eSPI(); // Invoke custom library
 
 // define IR input
 unsigned int IR_PIN = 27;
-// RC5 construct
-RC5 rc5(IR_PIN);
 
 // define preAmp control pins
 const int s_select_72323 = 16;
@@ -93,7 +95,7 @@ const int s_select_72323 = 16;
 static const byte MUSES_ADDRESS = 0;
 
 // preAmp construct
-static Muses72323 Muses(MUSES_ADDRESS, s_select_72323); // muses chip address (usually 0), slave select pin0;
+Muses72323 Muses(MUSES_ADDRESS, s_select_72323); // muses chip address (usually 0), slave select pin0;
 
 // define encoder pins
 const uint8_t DI_ENCODER_A = 33;
@@ -114,21 +116,37 @@ AsyncWebSocket ws("/ws");
 // Rotary construct
 RotaryEncoder rotaryEncoder(DI_ENCODER_A, DI_ENCODER_B, DI_ENCODER_SW);
 
+/******* TASKS *******/
+// loop() is the control task: it runs alone on the application core and only
+// touches the Muses72323 and MCP23S08. Drawing and flash writes run in these
+// lower priority tasks on the protocol core, woken by halStateChanged().
+#define TASK_CORE 0
+#define RENDER_TASK_PRIORITY 2
+#define PERSIST_TASK_PRIORITY 1
+TaskHandle_t renderTaskHandle = NULL;
+TaskHandle_t persistTaskHandle = NULL;
+TaskHandle_t controlTaskHandle = NULL; // loop()
+
+/******* CLOCK *******/
+// A one-shot esp_timer re-armed for each RTC second boundary wakes the render
+// task to redraw the clock, instead of polling getLocalTime().
+#define CLOCK_ALIGN_US 1000 // fire this long after the second changes
+esp_timer_handle_t clockTimer = NULL;
+std::atomic<bool> clockDue(false);
+int32_t clockLateUs = 0;    // last tick's distance from the second boundary
+int32_t clockLateUsMax = 0; // worst since boot
+std::atomic<uint32_t> loopIterations(0); // loop() passes
+uint32_t loopIterationsLast = 0;
+std::atomic<uint32_t> loopRate(0); // loop() passes in the last second
+std::atomic<uint32_t> wifiConnects(0); // times an IP address was obtained
+
 /******* TIMING *******/
-unsigned long milOnButton;  // Stores last time for switch press
 unsigned long milOnAction;  // Stores last time of user input
 unsigned long milOnFadeIn;  // LCD fade timing
 unsigned long milOnFadeOut; // LCD fade timing
 
 /********* Global Variables *******************/
-float atten;     // current attenuation, between 0 and -111.75
-int16_t volume; // current volume, between 0 and -447
-bool backlight;  // current backlight state
 uint16_t counter = 0;
-uint8_t source;        // current input channel
-uint8_t oldsource = 1; // previous input channel
-bool isMuted;          // current mute status
-uint8_t state = 0;     // current machine state
 uint8_t balanceState;  // current balance state
 bool btnstate = 0;
 bool oldbtnstate = 0;
@@ -136,23 +154,16 @@ int lastSeconds = 0;    // last seconds
 int currentSeconds = 0; // current seconds
 
 /*System addresses and codes used here match RC-5 infra-red codes for amplifiers (and CDs)*/
-uint16_t oldtoggle;
 u_char oldaddress;
 u_char oldcommand;
 u_char toggle;
 u_char address;
 u_char command;
 
-// Used to know when to fire an event when the knob is turned
-volatile bool turnedRightFlag = false;
-volatile bool turnedLeftFlag = false;
-
 char buffer1[20] = "";
-char buffer2[20] = "";
 
 // Global Constants
 //------------------
-const char *inputName[] = {"  Phono ", "   Media  ", "     CD    ", "   Tuner  "}; // Elektor i/p board
 const int source_size = 6;
 const int volume_size = 6;
 const int source_x = 100;
@@ -165,23 +176,20 @@ const long gmtOffset_sec = 0;
 const int daylightOffset_sec = 3600;
 
 // Function prototypes
-void RC5Update(void);
-void setIO();
 void knobCallback(long value);
 void buttonCallback(unsigned long duration);
-void RotaryUpdate();
-void volumeUpdate();
-void setVolume();
-void sourceUpdate();
-void mute();
-void unMute();
-void toggleMute();
 void initLittleFS(void);
+void loadFont(uint8_t font, const char *path);
 void initWiFi(void);
+void onWiFiConnected(arduino_event_id_t event, arduino_event_info_t info);
 String processor(const String &var);
 void onRootRequest(AsyncWebServerRequest *request);
+void onAssetRequest(AsyncWebServerRequest *request);
+void onMetricsRequest(AsyncWebServerRequest *request);
+void onProfileRequest(AsyncWebServerRequest *request);
+void onTraceRequest(AsyncWebServerRequest *request);
+void onStallsRequest(AsyncWebServerRequest *request);
 void initWebServer(void);
-void notifyClients(void);
 void handleWebSocketMessage(void *arg, uint8_t *data, size_t len);
 void onEvent(AsyncWebSocket *server,
              AsyncWebSocketClient *client,
@@ -191,9 +199,15 @@ void onEvent(AsyncWebSocket *server,
              size_t len);
 void initWebSocket(void);
 void printLocalTime(void);
+void clockBegin(void);
+void clockTick(void *arg);
 void setTimezone(String timezone);
 void setTime(int yr, int month, int mday, int hr, int minute, int sec, int isDst);
 void initTime(String timezone);
+void renderTask(void *parameter);
+void wakeControlFromISR(void);
+void irInterrupt(void);
+void persistTask(void *parameter);
 void onOTAStart();
 void onOTAProgress(size_t current, size_t final);
 void onOTAEnd(bool success);
@@ -204,7 +218,8 @@ void onOTAStart()
 {
   // Log when OTA has started
   Serial.println("OTA update started!");
-  // <Add your own code here>
+  // Save pending settings before the new firmware is written
+  settingsFlush();
 }
 
 void onOTAProgress(size_t current, size_t final)
@@ -275,12 +290,47 @@ void setTime(int yr, int month, int mday, int hr, int minute, int sec, int isDst
   settimeofday(&now, NULL);
 }
 
+void clockBegin()
+{
+  esp_timer_create_args_t args = {};
+  args.callback = clockTick;
+  args.name = "clock";
+  esp_timer_create(&args, &clockTimer);
+  clockTick(NULL);
+}
+
+// Runs in the esp_timer task: schedule the next boundary from the RTC, so
+// the tick never drifts, then hand the redraw to the render task
+void clockTick(void *arg)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  esp_timer_start_once(clockTimer, 1000000 - now.tv_usec + CLOCK_ALIGN_US);
+  // Early wake-ups belong to the coming second
+  clockLateUs = now.tv_usec < 500000 ? now.tv_usec - CLOCK_ALIGN_US : now.tv_usec - 1000000 - CLOCK_ALIGN_US;
+  if (abs(clockLateUs) > clockLateUsMax)
+  {
+    clockLateUsMax = abs(clockLateUs);
+  }
+  clockDue.store(true);
+  if (renderTaskHandle)
+  {
+    xTaskNotifyGive(renderTaskHandle);
+  }
+}
+
+// Called by the render task once per clock tick
 void printLocalTime()
 {
+  uint32_t loops = loopIterations.load();
+  loopRate.store(loops - loopIterationsLast);
+  loopIterationsLast = loops;
+
   struct tm timeinfo;
-  if (!getLocalTime(&timeinfo))
+  if (!getLocalTime(&timeinfo, 0))
   {
-    tft.drawString("Failed to obtain time", 160, 160, 1);
+    displaySetClock("--:--:--");
+    displayUpdate();
     //Serial.println("Failed to obtain time");
     return;
   }
@@ -288,8 +338,18 @@ void printLocalTime()
   if (lastSeconds != currentSeconds)
   {
     lastSeconds = currentSeconds;
-    strftime(buffer1, 20, "  %H:%M:%S  ", &timeinfo);
-    tft.drawString(buffer1, 160, 40, 1);
+    strftime(buffer1, 20, "%H:%M:%S", &timeinfo);
+    displaySetClock(buffer1);
+    displayUpdate();
+    if (currentSeconds == 0)
+    {
+      Serial.printf("loop %u/s, clock tick %dus late (worst %dus)\n", loopRate.load(), clockLateUs, clockLateUsMax);
+#if PROFILE_SCOPES
+      static char profile[PROFILE_TEXT_MAX];
+      profileText(profile, sizeof(profile));
+      Serial.print(profile);
+#endif
+    }
   }
 }
 
@@ -306,12 +366,66 @@ void initLittleFS()
   Serial.println("\nFlash FS available!");
 }
 
+// Read a .vlw font into the display's glyph cache; the file buffer is only
+// needed while the glyphs are copied out
+void loadFont(uint8_t font, const char *path)
+{
+  File file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    Serial.printf("Font %s not found, using the built-in font\n", path);
+    return;
+  }
+  size_t len = file.size();
+  uint8_t *data = (uint8_t *)malloc(len);
+  if (data && file.read(data, len) == len && displayLoadFont(font, data, len))
+  {
+    Serial.printf("Font %s cached\n", path);
+  }
+  else
+  {
+    Serial.printf("Font %s could not be loaded, using the built-in font\n", path);
+  }
+  free(data);
+  file.close();
+}
+
+size_t halReadFile(const char *path, uint8_t *data, size_t size)
+{
+  File file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    return 0;
+  }
+  size_t len = file.size() <= size ? file.read(data, file.size()) : 0;
+  file.close();
+  return len;
+}
+
+bool halWriteFile(const char *path, const uint8_t *data, size_t len)
+{
+  File file = LittleFS.open(path, "w");
+  if (!file)
+  {
+    return false;
+  }
+  bool written = file.write(data, len) == len;
+  file.close();
+  return written;
+}
+
 // ----------------------------------------------------------------------------
 // Connecting to the WiFi network
 // ----------------------------------------------------------------------------
 
+void onWiFiConnected(arduino_event_id_t event, arduino_event_info_t info)
+{
+  wifiConnects.fetch_add(1, std::memory_order_relaxed);
+}
+
 void initWiFi()
 {
+  WiFi.onEvent(onWiFiConnected, ARDUINO_EVENT_WIFI_STA_GOT_IP);
   WiFi.mode(WIFI_STA);
   WiFi.begin(ssid, password);
   Serial.printf("Trying to connect [%s] ", WiFi.macAddress().c_str());
@@ -328,33 +442,164 @@ void initWiFi()
 // ----------------------------------------------------------------------------
 String processor(const String &var)
 {
+  // Runs on the AsyncTCP task, so only the published state is read
+  ControlSnapshot snapshot = controlSnapshot();
   if (var == "VOLUME")
   {
-    return String(volume);
+    return String(snapshot.volume);
   }
   if (var == "SOURCE")
   {
-    return String(inputName[source - 1]);
+    return String(inputName[snapshot.source - 1]);
+  }
+  if (var == "ASSETS")
+  {
+    return String(assetVersion());
   }
   if (var == "STATE1")
   {
-    return String(String(var == "STATE1" && isMuted ? "on" : "off"));
+    return String(String(var == "STATE1" && snapshot.muted ? "on" : "off"));
   }
   if (var == "STATE2")
   {
-    return String(String(var == "STATE2" && isMuted ? "off" : "on"));
+    return String(String(var == "STATE2" && snapshot.muted ? "off" : "on"));
   }
   return String();
 }
 
 void onRootRequest(AsyncWebServerRequest *request)
 {
-  request->send(LittleFS, "/index.html", "text/html", false, processor);
+  Asset *page = assetFind(ASSET_PAGE);
+  if (!page)
+  {
+    request->send(LittleFS, ASSET_PAGE, "text/html", false, processor);
+    return;
+  }
+  request->send(request->beginResponse_P(200, page->type, page->data, page->len, processor));
 }
 
+// Script, style sheet and icon: gzipped from RAM, or the plain file
+void onAssetRequest(AsyncWebServerRequest *request)
+{
+  AsyncWebHeader *accept = request->getHeader("Accept-Encoding");
+  Asset *asset = accept && strstr(accept->value().c_str(), "gzip") ? assetFind(request->url().c_str()) : NULL;
+  if (!asset)
+  {
+    request->send(LittleFS, request->url());
+    return;
+  }
+  AsyncWebHeader *match = request->getHeader("If-None-Match");
+  AsyncWebServerResponse *response;
+  if (match && assetFresh(*asset, match->value().c_str()))
+  {
+    response = request->beginResponse(304);
+  }
+  else
+  {
+    response = request->beginResponse_P(200, asset->type, asset->data, asset->len);
+    response->addHeader("Content-Encoding", "gzip");
+  }
+  response->addHeader("ETag", asset->etag);
+  response->addHeader("Cache-Control", ASSET_CACHE_CONTROL);
+  response->addHeader("Vary", "Accept-Encoding");
+  request->send(response);
+}
+
+// Built into a heap buffer on the AsyncTCP task from atomic counters only
+void onMetricsRequest(AsyncWebServerRequest *request)
+{
+  char *text = (char *)malloc(METRICS_TEXT_MAX);
+  if (!text)
+  {
+    request->send(503);
+    return;
+  }
+  size_t len = metricsText(text, METRICS_TEXT_MAX);
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  response->write((const uint8_t *)text, len);
+  free(text);
+  request->send(response);
+}
+
+// The event ring as Chrome trace JSON, streamed in chunks from a snapshot
+void onTraceRequest(AsyncWebServerRequest *request)
+{
+  std::shared_ptr<TraceExport> trace((TraceExport *)malloc(sizeof(TraceExport)), free);
+  if (!trace)
+  {
+    request->send(503);
+    return;
+  }
+  traceExportBegin(*trace);
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [trace](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                                   { return traceExportRead(*trace, buffer, maxLen); });
+  response->addHeader("Content-Disposition", "attachment; filename=trace.json");
+  request->send(response);
+}
+
+#if PROFILE_SCOPES
+// Scope histograms as a text table; /profile?reset starts them again
+void onProfileRequest(AsyncWebServerRequest *request)
+{
+  char *text = (char *)malloc(PROFILE_TEXT_MAX);
+  if (!text)
+  {
+    request->send(503);
+    return;
+  }
+  size_t len = profileText(text, PROFILE_TEXT_MAX);
+  AsyncResponseStream *response = request->beginResponseStream("text/plain");
+  response->write((const uint8_t *)text, len);
+  free(text);
+  request->send(response);
+  if (request->hasParam("reset"))
+  {
+    profileReset();
+  }
+}
+#endif
+
+#if STALL_WATCHDOG
+// Worst control loop stalls; /stalls?clear starts the report again
+void onStallsRequest(AsyncWebServerRequest *request)
+{
+  char *text = (char *)malloc(STALL_TEXT_MAX);
+  if (!text)
+  {
+    request->send(503);
+    return;
+  }
+  size_t len = stallText(text, STALL_TEXT_MAX);
+  AsyncResponseStream *response = request->beginResponseStream("text/plain");
+  response->write((const uint8_t *)text, len);
+  free(text);
+  request->send(response);
+  if (request->hasParam("clear"))
+  {
+    stallClear();
+    halStateChanged();
+  }
+}
+#endif
+
 void initWebServer()
 {
   server.on("/", onRootRequest);
+  for (const Asset &asset : assets)
+  {
+    if (asset.gzip)
+    {
+      server.on(asset.path, HTTP_GET, onAssetRequest);
+    }
+  }
+  server.on("/metrics", HTTP_GET, onMetricsRequest);
+  server.on("/trace", HTTP_GET, onTraceRequest);
+#if PROFILE_SCOPES
+  server.on("/profile", HTTP_GET, onProfileRequest);
+#endif
+#if STALL_WATCHDOG
+  server.on("/stalls", HTTP_GET, onStallsRequest);
+#endif
   server.serveStatic("/", LittleFS, "/");
   ElegantOTA.begin(&server); // Start ElegantOTA
   // ElegantOTA callbacks
@@ -368,111 +613,60 @@ void initWebServer()
 // WebSocket initialization
 // ----------------------------------------------------------------------------
 
-void notifyClients()
+bool halSendText(uint32_t client, const char *data, size_t len)
+{
+  if (!ws.availableForWrite(client))
+  {
+    return false;
+  }
+  ws.text(client, data, len);
+  return true;
+}
+
+bool halSendBinary(uint32_t client, const uint8_t *data, size_t len)
 {
-  JsonDocument json;
-  json["source"] = inputName[source - 1];
-  json["volume"] = volume;
-  json["mute"] = isMuted ? "on" : "off";
-  char buffer[60];
-  size_t len = serializeJson(json, buffer);
-  ws.textAll(buffer, len);
+  if (!ws.availableForWrite(client))
+  {
+    return false;
+  }
+  ws.binary(client, data, len);
+  return true;
 }
 
-void handleWebSocketMessage(void *arg, uint8_t *data, size_t len)
+// Runs on the AsyncTCP task: messages are only queued, the control task
+// parses and applies them
+void handleWebSocketMessage(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len)
 {
+  PROFILE_SCOPE(PROFILE_WS_MESSAGE);
   AwsFrameInfo *info = (AwsFrameInfo *)arg;
-  if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
+  // The rest of a message that came in pieces has been answered already
+  if (info->index != 0 || (info->opcode != WS_TEXT && info->opcode != WS_BINARY))
   {
-    JsonDocument json;
-    DeserializationError err = deserializeJson(json, data);
-    if (err)
-    {
-      Serial.print(F("deserializeJson() failed with code "));
-      Serial.println(err.c_str());
-      return;
-    }
- 
-   if (json["Phono"])
-    {
-      const char *sel = json["Phono"];
-      if (strcmp(sel, "toggle") == 0)
-      {
-        oldsource = source;
-        source = 1;
-        setIO();
-      }
-    }
-    else if (json["Media"])
-    {
-      const char *sel = json["Media"];
-      if (strcmp(sel, "toggle") == 0)
-      {
-        oldsource = source;
-        source = 2;
-        setIO();
-      }
-    }
-    else if (json["CD"])
-    {
-      const char *sel = json["CD"];
-      if (strcmp(sel, "toggle") == 0)
-      {
-        oldsource = source;
-        source = 3;
-        setIO();
-      }
-    }
-    else if (json["Tuner"])
-    {
-      const char *sel = json["Tuner"];
-      if (strcmp(sel, "toggle") == 0)
-      {
-        oldsource = source;
-        source = 4;
-        setIO();
-      }
-    }
-    else if (json["Volup"])
-    {
-      const char *vol = json["Volup"];
-      if (strcmp(vol, "toggle") == 0)
-      {
-        if (isMuted)
-        {
-          unMute();
-        }
-        if (volume < 0)
-        {
-          volume = volume + 1;
-          setVolume();
-        }
-      }
-    }
-    else if (json["Voldown"])
+    return;
+  }
+  // A message in pieces is longer than a TCP segment, so also too long
+  bool whole = info->final && info->len == len;
+  if (!whole || !commandQueue(info->opcode == WS_TEXT ? COMMAND_WS_TEXT : COMMAND_WS_BINARY, client->id(), data, len, micros()))
+  {
+    bool tooLong = !whole || len > COMMAND_LONG_MAX;
+    Serial.printf("WebSocket client #%u: command refused (%s, %u bytes)\n", client->id(), tooLong ? "too long" : "queue full",
+                  (unsigned)info->len);
+    if (info->opcode == WS_BINARY)
     {
-      const char *vol = json["Voldown"];
-      if (strcmp(vol, "toggle") == 0)
-      {
-        if (isMuted)
-        {
-          unMute();
-        }
-        if (volume > -447)
-        {
-          volume = volume - 1;
-          setVolume();
-        }
-      }
+      BinaryFrame frame;
+      binaryRefusedFrame(frame, data, len);
+      client->binary((const uint8_t *)&frame, sizeof(frame));
     }
-    else if (json["Mute"])
+    else
     {
-      const char *mut = json["Mute"];
-      if (strcmp(mut, "toggle") == 0)
-      {
-        toggleMute();
-      }
+      client->text(tooLong ? "{\"error\":\"too long\"}" : "{\"error\":\"busy\"}");
     }
+    return;
+  }
+  traceInstant(TRACE_WS, client->id());
+  if (controlTaskHandle)
+  {
+    xTaskNotifyGive(controlTaskHandle);
   }
 }
 
@@ -487,13 +681,21 @@ void onEvent(AsyncWebSocket *server,
   switch (type)
   {
   case WS_EVT_CONNECT:
-    Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
+  {
+    // arg is the upgrade request; binary clients name the subprotocol in it
+    AsyncWebServerRequest *request = (AsyncWebServerRequest *)arg;
+    AsyncWebHeader *protocol = request ? request->getHeader("Sec-WebSocket-Protocol") : NULL;
+    bool binary = protocol && protocol->value() == BINARY_SUBPROTOCOL;
+    Serial.printf("WebSocket client #%u connected from %s%s\n", client->id(), client->remoteIP().toString().c_str(), binary ? ", binary" : "");
+    broadcastClientConnected(client->id(), binary);
     break;
+  }
   case WS_EVT_DISCONNECT:
     Serial.printf("WebSocket client #%u disconnected\n", client->id());
+    broadcastClientDisconnected(client->id());
     break;
   case WS_EVT_DATA:
-    handleWebSocketMessage(arg, data, len);
+    handleWebSocketMessage(client, arg, data, len);
     break;
   case WS_EVT_PONG:
   case WS_EVT_ERROR:
@@ -507,364 +709,209 @@ void initWebSocket()
   server.addHandler(&ws);
 }
 
-void knobCallback(long value)
-{
-  // See the note in the `loop()` function for
-  // an explanation as to why we're setting
-  // boolean values here instead of running
-  // functions directly.
-
-  // Don't do anything if either flag is set;
-  // it means we haven't taken action yet
-  if (turnedRightFlag || turnedLeftFlag)
-    return;
+// ----------------------------------------------------------------------------
+// Render and persistence tasks
+// ----------------------------------------------------------------------------
 
-  // Set a flag that we can look for in `loop()`
-  // so that we know we have something to do
-  switch (value)
+void halStateChanged()
+{
+  if (controlTaskHandle)
   {
-  case 1:
-    turnedRightFlag = true;
-    break;
-
-  case -1:
-    turnedLeftFlag = true;
-    break;
+    xTaskNotifyGive(controlTaskHandle);
+  }
+  if (renderTaskHandle)
+  {
+    xTaskNotifyGive(renderTaskHandle);
+  }
+  if (persistTaskHandle)
+  {
+    xTaskNotifyGive(persistTaskHandle);
   }
-
-  // Override the tracked value back to 0 so that
-  // we can continue tracking right/left events
-  rotaryEncoder.setEncoderValue(0);
 }
 
-void buttonCallback(unsigned long duration)
+void halStandby(bool standby)
 {
-  int _duration = duration;
-  if (_duration > 50)
+  if (standby)
   {
-    switch (state)
-    {
-    case STATE_RUN:
-      state = STATE_IO;
-      milOnButton = millis();
-      break;
-    default:
-      break;
-    }
+    spiAcquire(SPI_DEVICE_TFT);
+    tft.writecommand(TFT_DISPOFF);
+    tft.writecommand(TFT_SLPIN);
+    spiRelease(SPI_DEVICE_TFT);
+    WiFi.setSleep(WIFI_PS_MAX_MODEM);
+  }
+  else
+  {
+    WiFi.setSleep(WIFI_PS_MIN_MODEM);
+    spiAcquire(SPI_DEVICE_TFT);
+    tft.writecommand(TFT_SLPOUT);
+    spiRelease(SPI_DEVICE_TFT);
+    delay(5); // the panel needs 5ms after sleep out; its frame memory survives
+    spiAcquire(SPI_DEVICE_TFT);
+    tft.writecommand(TFT_DISPON);
+    spiRelease(SPI_DEVICE_TFT);
   }
 }
 
-void volumeUpdate()
+void halHealth(HealthSample &sample)
 {
-  if (turnedRightFlag)
-  {
-    if (isMuted)
-    {
-      unMute();
-    }
-    if (volume < 0)
-    {
-      volume = volume + 1;
-      setVolume();
-    }
-    // Set flag back to false so we can watch for the next move
-    turnedRightFlag = false;
-  }
-  else if (turnedLeftFlag)
+  sample.heapFree = ESP.getFreeHeap();
+  sample.heapMinFree = ESP.getMinFreeHeap();
+  sample.heapLargest = ESP.getMaxAllocHeap();
+  sample.loopIterations = loopIterations.load(std::memory_order_relaxed);
+  sample.loopRate = loopRate.load(std::memory_order_relaxed);
+  sample.rssi = WiFi.isConnected() ? WiFi.RSSI() : 0;
+  uint32_t connects = wifiConnects.load(std::memory_order_relaxed);
+  sample.wifiReconnects = connects ? connects - 1 : 0;
+  sample.wsClients = ws.count();
+  sample.uptimeUs = esp_timer_get_time();
+}
+
+/******* STALL ALARM *******/
+// A hardware timer, not an esp_timer: esp_timer callbacks run in a task on
+// the other core, which cannot see where the control task is. The timer's
+// interrupt is attached from setup(), so it goes off on the control task's
+// core and stops it where it stalled.
+#define STALL_TIMER 0
+#define STALL_TIMER_DIVIDER 80 // 1MHz from the 80MHz APB clock
+hw_timer_t *stallTimer = NULL;
+
+static void IRAM_ATTR onStallTimer()
+{
+  uint32_t pc[STALL_FRAMES];
+  uint8_t frames = 0;
+  if (xTaskGetCurrentTaskHandle() == controlTaskHandle)
   {
-    if (isMuted)
-    {
-      unMute();
-    }
-    if (volume != 447)
+    // Interrupt entry saved the task's registers on its stack, at the top
+    // of stack its TCB starts with
+    const XtExcFrame *saved = *(const XtExcFrame *const *)controlTaskHandle;
+    esp_backtrace_frame_t frame = {(uint32_t)saved->pc, (uint32_t)saved->a1, (uint32_t)saved->a0};
+    while (frames < STALL_FRAMES)
     {
-      volume = volume - 1;
-      setVolume();
+      // Return addresses carry the caller's window size in their top bits;
+      // back up to the call instruction. The first pc is where the task
+      // was stopped, and is kept as it is.
+      pc[frames] = frames ? ((frame.pc & 0x3FFFFFFF) | 0x40000000) - 3 : frame.pc;
+      frames++;
+      if (!frame.next_pc || !esp_backtrace_get_next_frame(&frame))
+      {
+        break;
+      }
     }
-    // Set flag back to false so we can watch for the next move
-    turnedLeftFlag = false;
   }
+  stallOverrun(pc, frames);
 }
 
-void setVolume()
+void stallAlarmBegin()
 {
-  // set new volume setting
-  Muses.setVolume(volume, volume);
-  preferences.putInt("VOLUME", volume);
-  // display volume setting
-  if (!backlight)
-  {
-    backlight = ACTIVE;
-    digitalWrite(TFT_BL, HIGH); // Turn on backlight
-  }
-  float atten = ((float)volume / 4);
-  sprintf(buffer2, "  %.2fdB  ", atten);
-  tft.setTextSize(2);
-  tft.setFreeFont(FSS18);
-  tft.drawString(buffer2, 150, 120, 1);
-  tft.setTextSize(1);
-  tft.setFreeFont(FSS24);
-  notifyClients();
+  stallTimer = timerBegin(STALL_TIMER, STALL_TIMER_DIVIDER, true);
+  timerAttachInterrupt(stallTimer, onStallTimer, true);
 }
 
-void sourceUpdate()
+void halStallAlarm(uint32_t us)
 {
-  if (turnedRightFlag)
+  if (!stallTimer)
   {
-    oldsource = source;
-    milOnButton = millis();
-    if (oldsource < 4)
-    {
-      source++;
-    }
-    else
-    {
-      source = 1;
-    }
-    setIO();
-    // Set flag back to false so we can watch for the next move
-    turnedRightFlag = false;
+    return;
   }
-  else if (turnedLeftFlag)
+  if (us)
   {
-    oldsource = source;
-    milOnButton = millis();
-    if (source > 1)
-    {
-      source--;
-    }
-    else
-    {
-      source = 4;
-    }
-    if (!backlight)
-    {
-      backlight = ACTIVE;
-      digitalWrite(TFT_BL, HIGH); // Turn on backlight
-    }
-    setIO();
-    // Set flag back to false so we can watch for the next move
-    turnedLeftFlag = false;
+    timerWrite(stallTimer, 0);
+    timerAlarmWrite(stallTimer, us, false);
+    timerAlarmEnable(stallTimer);
+  }
+  else
+  {
+    timerAlarmDisable(stallTimer);
   }
 }
 
-void RC5Update()
+void *halDmaMalloc(size_t size)
 {
-  /*
-  System addresses and codes used here match RC-5 infra-red codes for amplifiers (and CDs)
-  */
-  u_char toggle;
-  u_char address;
-  u_char command;
-  // Poll for new RC5 command
-  if (rc5.read(&toggle, &address, &command))
-  {
-    if (address == 0x10) // standard system address for preamplifier
-    {
-      switch (command)
-      {
-      case 1:
-        // Phono
-        if ((oldtoggle != toggle))
-        {
-          if (!backlight)
-          {
-            unMute(); // unmute output
-          }
-          oldsource = source;
-          source = 1;
-          setIO();
-        }
-        break;
-      case 3:
-        // Tuner
-        if ((oldtoggle != toggle))
-        {
-          if (!backlight)
-          {
-            unMute(); // unmute output
-          }
-          oldsource = source;
-          source = 4;
-          setIO();
-        }
-        break;
-      case 7:
-        // CD
-        if ((oldtoggle != toggle))
-        {
-          if (!backlight)
-          {
-            unMute(); // unmute output
-          }
-          oldsource = source;
-          source = 3;
-          setIO();
-        }
-        break;
-      case 8:
-        // Media
-        if ((oldtoggle != toggle))
-        {
-          if (!backlight)
-          {
-            unMute(); // unmute output
-          }
-          oldsource = source;
-          source = 2;
-          setIO();
-        }
-        break;
-      case 13:
-        // Mute
-        if ((oldtoggle != toggle))
-        {
-          toggleMute();
-        }
-        break;
-      case 16:
-        // Increase Vol
-        if (isMuted)
-        {
-          unMute();
-        }
-        if (volume < 0)
-        {
-          volume = volume + 1;
-          setVolume();
-        }
-        break;
-      case 17:
-        // Reduce Vol
-        if (isMuted)
-        {
-          unMute();
-        }
-        if (volume != 447)
-        {
-          volume = volume - 1;
-          setVolume();
-        }
-        break;
-      case 59:
-        // Display Toggle
-        if ((oldtoggle != toggle))
-        {
-          if (backlight)
-          {
-            backlight = STANDBY;
-            digitalWrite(TFT_BL, LOW); // Turn off backlight
-            // mute();                    // mute output
-          }
-          else
-          {
-            backlight = ACTIVE;
-            digitalWrite(TFT_BL, HIGH); // Turn on backlight
-            // unMute(); // unmute output
-          }
-        }
-        break;
-      default:
-        break;
-      }
-    }
-    else if (address == 0x14) // system address for CD
-    {
-      if ((oldtoggle != toggle))
-      {
-        if (command == 53) // Play
-        {
-          if (!backlight)
-          {
-            unMute(); // unmute output
-          }
-          oldsource = source;
-          source = 3;
-          setIO();
-        }
-      }
-    }
-    oldtoggle = toggle;
-  }
+  return heap_caps_malloc(size, MALLOC_CAP_DMA);
 }
 
-void unMute()
+// The Muses72323 library writes without a transaction of its own, at
+// whatever clock the bus was left at, which is the panel's after a frame
+void halBusClock(uint8_t device)
 {
-  if (!backlight)
+  if (device == SPI_DEVICE_MUSES)
   {
-    backlight = ACTIVE;
-    digitalWrite(TFT_BL, HIGH);
+    SPI.setFrequency(SPI_MUSES_FREQUENCY);
   }
-  isMuted = 0;
-  //  set volume
-  setVolume();
-  // set source
-  setIO();
-  notifyClients();
 }
 
-void mute()
+// Every IR receiver edge goes to the decoder's ring buffer; loop() only
+// blocks in standby, so the wake-up is for that
+void IRAM_ATTR irInterrupt()
 {
-  isMuted = 1;
-  Muses.mute();
-  tft.setTextSize(2);
-  tft.setFreeFont(FSS18);
-  tft.drawString("    Muted    ", 160, 120, 1);
-  tft.setTextSize(1);
-  tft.setFreeFont(FSS24);
-  notifyClients();
+  irEdge(micros(), digitalRead(IR_PIN));
+  wakeControlFromISR();
 }
 
-void toggleMute()
+// Wake loop() from an encoder or IR interrupt
+void IRAM_ATTR wakeControlFromISR()
 {
-  if (isMuted)
+  BaseType_t woken = pdFALSE;
+  if (controlTaskHandle)
   {
-    unMute();
+    vTaskNotifyGiveFromISR(controlTaskHandle, &woken);
   }
-  else
+  if (woken)
   {
-    mute();
+    portYIELD_FROM_ISR();
   }
 }
 
-void RotaryUpdate()
+void renderTask(void *parameter)
 {
-  switch (state)
+  unsigned long wait = RENDER_IDLE_NONE;
+  for (;;)
   {
-  case STATE_RUN:
-    volumeUpdate();
-    break;
-  case STATE_IO:
-    sourceUpdate();
-    if ((millis() - milOnButton) > TIME_EXITSELECT * 1000)
+    // Woken by state changes and by the clock tick
+    ulTaskNotifyTake(pdTRUE, wait == RENDER_IDLE_NONE ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+    // Changes during a frame interval are drawn together when it ends
+    unsigned long frame = renderUpdate();
+    if (clockDue.exchange(false) && !controlSnapshot().standby)
     {
-      state = STATE_RUN;
+      printLocalTime();
     }
-    break;
-  default:
-    break;
+    // Wake again in time for the next frame or coalesced WebSocket frame
+    wait = min(frame, broadcastUpdate());
   }
 }
 
-void setIO()
+void persistTask(void *parameter)
 {
-  MCP.write1((oldsource - 1), LOW); // Reset source select to NONE
-  MCP.write1((source - 1), HIGH);   // Set new source
-  preferences.putUInt("SOURCE", source);
-  if (isMuted)
+  unsigned long wait = SETTINGS_IDLE_NONE;
+  for (;;)
   {
-    if (!backlight)
-    {
-      backlight = ACTIVE;
-      digitalWrite(TFT_BL, HIGH);
-    }
-    isMuted = 0;
-    tft.fillScreen(TFT_WHITE);
-    // set volume
-    setVolume();
+    // Each change restarts the idle wait; a timeout means the controls went quiet
+    ulTaskNotifyTake(pdTRUE, wait == SETTINGS_IDLE_NONE ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+    wait = min(settingsUpdate(), stallUpdate());
+  }
+}
+
+void knobCallback(long value)
+{
+  // This runs in interrupt context, so only queue the detent;
+  // commandUpdate() in `loop()` applies it.
+  encoderTurned(value);
+  wakeControlFromISR();
+
+  // Override the tracked value back to 0 so that
+  // we can continue tracking right/left events
+  rotaryEncoder.setEncoderValue(0);
+}
+
+void buttonCallback(unsigned long duration)
+{
+  int _duration = duration;
+  if (_duration > 50)
+  {
+    // Enters source select, or leaves standby, on the control task
+    encoderPressed();
+    wakeControlFromISR();
   }
-  notifyClients();
-  tft.drawString(inputName[source - 1], 150, 200, 1);
 }
 
 // This section of code runs only once at start-up.
@@ -889,7 +936,15 @@ void setup()
   // This is where the rotary inputs are configured and the interrupts get attached
   rotaryEncoder.begin();
 
+  // IR edges are captured from here on, whatever loop() is doing
+  pinMode(IR_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(IR_PIN), irInterrupt, CHANGE);
+
+  // Save pending settings when restarting (e.g. after an OTA update)
+  esp_register_shutdown_handler(settingsFlush);
+
   initLittleFS();
+  stallBegin();
   initWiFi();
   if (!MDNS.begin("esp32HiFi")) {
     Serial.println("Error setting up MDNS responder!");
@@ -920,35 +975,34 @@ void setup()
   // Init and get the time
   initTime("GMT0BST,M3.5.0/1,M10.4.0"); // Set for Europe / London
 
-  tft.setFreeFont(FSS24);
-  tft.fillScreen(TFT_WHITE);
-
-  // This initialises the Source select pins as outputs, all deselected (i.e. o/p=low)
-  MCP.begin();
-  MCP.pinMode8(0x00); //  0 = output , 1 = input
-
-  // Initialize muses (SPI, pin modes)...
-  Muses.begin();
-  Muses.setExternalClock(false); // must be set!
-  Muses.setZeroCrossingOn(true);
-  Muses.mute();
-  // Load saved settings (volume, balance, source)
-  preferences.begin("settings", RW_MODE);
-  source = preferences.getUInt("SOURCE", 1);
-  volume = preferences.getInt("VOLUME", -447);
-  printLocalTime();
-  delay(10);
-  // set startup volume
-  setVolume();
-  // set source
-  setIO();
-  // unmute
-  isMuted = 0;
+  // Run-time screen, drawn through the sprite compositor from here on
+  displayBegin();
+  loadFont(DISPLAY_FONT_READOUT, "/NotoSansBold36.vlw");
+  loadFont(DISPLAY_FONT_CLOCK, "/NotoSansMonoSCB20.vlw");
+
+  // Display and settings are handled by their own tasks from here on
+  xTaskCreatePinnedToCore(renderTask, "render", 4096, NULL, RENDER_TASK_PRIORITY, &renderTaskHandle, TASK_CORE);
+  xTaskCreatePinnedToCore(persistTask, "persist", 4096, NULL, PERSIST_TASK_PRIORITY, &persistTaskHandle, TASK_CORE);
+  clockBegin();
+  controlTaskHandle = xTaskGetCurrentTaskHandle();
+  stallAlarmBegin();
+  // Initialise source select, volume controller and saved settings
+  controllerBegin();
 }
 
 void loop()
 {
-  RC5Update();
-  RotaryUpdate();
-  printLocalTime();
+  loopIterations.fetch_add(1, std::memory_order_relaxed);
+  stallPassBegin();
+  commandUpdate();
+  rampUpdate();
+  switchUpdate();
+  bool idle = standbyUpdate();
+  stallPassEnd();
+  if (idle)
+  {
+    // Nothing to do until an IR edge, the encoder or a WebSocket command,
+    // or until a frame being received times out
+    ulTaskNotifyTake(pdTRUE, irIdle() ? portMAX_DELAY : pdMS_TO_TICKS(IR_FRAME_TIMEOUT_MS));
+  }
 }
@@ -0,0 +1,106 @@
+/* Health metrics
+*********************/
+
+#include "metrics.h"
+#include "hal.h"
+#include "broadcast.h"
+#include "settings.h"
+#include "spibus.h"
+#include "ir.h"
+#include "command.h"
+#include "stall.h"
+#include <stdarg.h>
+
+struct MetricsText
+{
+  char *buffer;
+  size_t size;
+  size_t len;
+};
+
+static void append(MetricsText &text, const char *format, ...)
+{
+  if (text.len >= text.size)
+  {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(text.buffer + text.len, text.size - text.len, format, args);
+  va_end(args);
+  if (n > 0)
+  {
+    text.len = text.len + n < text.size ? text.len + n : text.size - 1;
+  }
+}
+
+// HELP and TYPE lines of a metric
+static void describe(MetricsText &text, const char *name, const char *type, const char *help)
+{
+  append(text, "# HELP preamp_%s %s\n# TYPE preamp_%s %s\n", name, help, name, type);
+}
+
+static void metric(MetricsText &text, const char *name, const char *type, const char *help, unsigned long long value)
+{
+  describe(text, name, type, help);
+  append(text, "preamp_%s %llu\n", name, value);
+}
+
+size_t metricsText(char *buffer, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  buffer[0] = 0;
+  MetricsText text = {buffer, size, 0};
+  HealthSample health;
+  halHealth(health);
+
+  metric(text, "uptime_seconds", "gauge", "Time since boot.", health.uptimeUs / 1000000);
+  metric(text, "heap_free_bytes", "gauge", "Free heap.", health.heapFree);
+  metric(text, "heap_min_free_bytes", "gauge", "Lowest free heap since boot.", health.heapMinFree);
+  metric(text, "heap_largest_free_block_bytes", "gauge", "Largest heap block that can be allocated.", health.heapLargest);
+  metric(text, "loop_iterations_total", "counter", "Control loop passes.", health.loopIterations);
+  metric(text, "loop_iterations_per_second", "gauge", "Control loop passes in the last second.", health.loopRate);
+#if STALL_WATCHDOG
+  metric(text, "loop_stalls_total", "counter", "Control loop passes over the stall budget.", stallStats().stalls.load());
+  metric(text, "loop_pass_max_microseconds", "gauge", "Longest control loop pass since boot.", stallStats().passUsMax.load());
+#endif
+  describe(text, "wifi_rssi_dbm", "gauge", "WiFi signal strength, 0 when not connected.");
+  append(text, "preamp_wifi_rssi_dbm %ld\n", (long)health.rssi);
+  metric(text, "wifi_reconnects_total", "counter", "WiFi connections after the first.", health.wifiReconnects);
+  metric(text, "websocket_clients", "gauge", "WebSocket clients connected.", health.wsClients);
+  metric(text, "websocket_frames_sent_total", "counter", "State frames sent, summed over clients.", broadcastStats().sent.load());
+
+  const SettingsStats &settings = settingsStats();
+  metric(text, "nvs_writes_total", "counter", "Settings written to NVS.", settings.nvsWrites.load());
+  metric(text, "keymap_file_writes_total", "counter", "Key map files written to flash.", settings.fileWrites.load());
+
+  const SpiBusStats &bus = spiBusStats();
+  describe(text, "spi_transactions_total", "counter", "SPI bus transactions per device.");
+  for (uint8_t device = 0; device < SPI_DEVICES; device++)
+  {
+    append(text, "preamp_spi_transactions_total{device=\"%s\"} %lu\n", spiDeviceName[device], (unsigned long)bus.transactions[device].load());
+  }
+
+  const IrStats &ir = irStats();
+  describe(text, "ir_frames_total", "counter", "Remote frames decoded per protocol.");
+  for (uint8_t protocol = 0; protocol < IR_PROTOCOLS; protocol++)
+  {
+    append(text, "preamp_ir_frames_total{protocol=\"%s\"} %lu\n", irProtocolName[protocol], (unsigned long)ir.protocol[protocol].load());
+  }
+  metric(text, "ir_errors_total", "counter", "IR bursts no protocol could decode.", ir.errors.load());
+
+  const CommandStats &commands = commandStats();
+  describe(text, "commands_queued_total", "counter", "Input commands queued for the control task.");
+  for (uint8_t source = 0; source < COMMAND_SOURCES; source++)
+  {
+    if (source != COMMAND_IR)
+    {
+      append(text, "preamp_commands_queued_total{source=\"%s\"} %lu\n", commandSourceName[source], (unsigned long)commands.queued[source].load());
+    }
+  }
+  metric(text, "commands_refused_total", "counter", "Input commands refused by a full queue.", commands.refused.load());
+  return text.len;
+}
@@ -0,0 +1,67 @@
+/* Host fake of the Arduino core
+*********************
+
+Just enough of Arduino.h for the controller logic to build in [env:native].
+Time is virtual: millis()/micros() only move when delay() or hostAdvance()
+is called, so host runs are repeatable.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define IRAM_ATTR
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+#define F(string_literal) (string_literal)
+
+typedef uint8_t byte;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void yield(void);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+// Advance the virtual clock by the given number of microseconds
+void hostAdvance(unsigned long us);
+// Call `call` once, from the hostAdvance() of this thread that takes the
+// virtual clock us microseconds on from now; 0 cancels it
+void hostAlarm(unsigned long us, void (*call)(void));
+
+// Called by the device fakes on every transfer; counts the ones made without
+// the device's bus transaction open (spiAcquire, spibus.h)
+void hostBusAccess(uint8_t device);
+extern uint32_t hostBusFaults;
+
+class HostSerial
+{
+public:
+  void begin(unsigned long /*baud*/) {}
+  size_t print(const char *s) { return fputs(s, stdout) < 0 ? 0 : strlen(s); }
+  size_t println(const char *s = "") { return print(s) + print("\n"); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HostSerial Serial;
+
+// The CPU cycle counter, counting 240 a microsecond of host wall-clock time
+class HostEsp
+{
+public:
+  uint32_t getCycleCount();
+};
+
+extern HostEsp ESP;
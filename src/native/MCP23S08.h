@@ -0,0 +1,50 @@
+/* Host fake of the MCP23S08 SPI port expander library
+*********************/
+
+#pragma once
+
+#include <Arduino.h>
+#include <stdint.h>
+#include "spibus.h"
+
+class MCP23S08
+{
+public:
+  MCP23S08(uint8_t /*select*/) {}
+
+  bool begin() { return true; }
+  void setSPIspeed(uint32_t speed) { SPIspeed = speed; }
+  bool pinMode8(uint8_t /*mask*/)
+  {
+    transfers++;
+    hostBusAccess(SPI_DEVICE_MCP);
+    return true;
+  }
+  // The library reads the port, then writes it back with the pin changed
+  bool write1(uint8_t pin, uint8_t value)
+  {
+    if (pin > 7)
+      return false;
+    latch = value ? (latch | (1 << pin)) : (latch & ~(1 << pin));
+    transfers += 2;
+    hostBusAccess(SPI_DEVICE_MCP);
+    return true;
+  }
+  bool write8(uint8_t value)
+  {
+    latch = value;
+    transfers++;
+    hostBusAccess(SPI_DEVICE_MCP);
+    return true;
+  }
+  uint8_t read8()
+  {
+    transfers++;
+    hostBusAccess(SPI_DEVICE_MCP);
+    return latch;
+  }
+
+  uint8_t latch = 0;      // output latch, one relay per bit
+  uint32_t transfers = 0; // number of SPI transactions
+  uint32_t SPIspeed = 8000000;
+};
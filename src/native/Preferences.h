@@ -0,0 +1,41 @@
+/* Host fake of the ESP32 Preferences (NVS) library
+*********************
+
+Keeps keys in memory and counts every put, so host runs can see how often
+the controller would have written to flash.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+class Preferences
+{
+public:
+  bool begin(const char */*name*/, bool /*readOnly*/ = false) { return true; }
+  void end() {}
+
+  int32_t getInt(const char *key, int32_t defaultValue = 0) { return get(key, defaultValue); }
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0) { return (uint32_t)get(key, defaultValue); }
+  size_t putInt(const char *key, int32_t value) { return put(key, value); }
+  size_t putUInt(const char *key, uint32_t value) { return put(key, (int64_t)value); }
+
+  uint32_t writes = 0; // number of put calls (each one is a flash write on the ESP32)
+
+private:
+  int64_t get(const char *key, int64_t defaultValue)
+  {
+    auto it = values.find(key);
+    return it == values.end() ? defaultValue : it->second;
+  }
+  size_t put(const char *key, int64_t value)
+  {
+    writes++;
+    values[key] = value;
+    return 4;
+  }
+  std::map<std::string, int64_t> values;
+};
@@ -0,0 +1,182 @@
+/* Host fake of the TFT_eSPI display library
+*********************
+
+The panel is a 320x240 framebuffer of 16-bit pixels. Sprites are 8-bit, and
+text is rendered as one solid box per character, coloured by the character,
+so a changed character changes its pixels. Every pixel written to the panel
+is counted; DMA pushes complete immediately.
+
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "spibus.h"
+
+#define TFT_WHITE 0xFFFF
+#define TFT_BLUE 0x001F
+#define MC_DATUM 4
+
+// ILI9341 commands
+#define TFT_SLPIN 0x10
+#define TFT_SLPOUT 0x11
+#define TFT_DISPOFF 0x28
+#define TFT_DISPON 0x29
+
+#define HOST_TFT_WIDTH 320
+#define HOST_TFT_HEIGHT 240
+
+struct GFXfont
+{
+  uint8_t advance; // character width in pixels at text size 1
+  uint8_t height;  // line height in pixels at text size 1
+};
+extern const GFXfont FreeSans18pt7b;
+extern const GFXfont FreeSans24pt7b;
+
+class TFT_eSPI
+{
+public:
+  TFT_eSPI() : frame(HOST_TFT_WIDTH * HOST_TFT_HEIGHT, 0) {}
+  void init() {}
+  void setRotation(uint8_t /*r*/) {}
+  void setTextDatum(uint8_t /*datum*/) {}
+  void setTextSize(uint8_t /*size*/) {}
+  void setTextColor(uint16_t /*fg*/, uint16_t /*bg*/) {}
+  void setFreeFont(const GFXfont */*f*/) {}
+  void writecommand(uint8_t c)
+  {
+    hostBusAccess(SPI_DEVICE_TFT);
+    if (c == TFT_SLPIN)
+      sleeping = true;
+    else if (c == TFT_SLPOUT)
+      sleeping = false;
+  }
+  void fillScreen(uint32_t color)
+  {
+    hostBusAccess(SPI_DEVICE_TFT);
+    frame.assign(frame.size(), color);
+    fills++;
+    pixelsPushed += frame.size();
+  }
+  int16_t drawString(const char */*string*/, int32_t /*x*/, int32_t /*y*/, uint8_t /*font*/)
+  {
+    strings++;
+    return 0;
+  }
+  void pushRect(int32_t x, int32_t y, int32_t w, int32_t h, const uint16_t *data, int32_t stride)
+  {
+    hostBusAccess(SPI_DEVICE_TFT);
+    for (int32_t row = 0; row < h; row++)
+    {
+      for (int32_t col = 0; col < w; col++)
+      {
+        int32_t px = x + col, py = y + row;
+        if (px >= 0 && px < HOST_TFT_WIDTH && py >= 0 && py < HOST_TFT_HEIGHT)
+        {
+          frame[py * HOST_TFT_WIDTH + px] = data[row * stride + col];
+          pixelsPushed++;
+        }
+      }
+    }
+  }
+  void pushImage(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t *data) { pushRect(x, y, w, h, data, w); }
+  void pushImageDMA(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t *data)
+  {
+    pushRect(x, y, w, h, data, w);
+    dmaPushes++;
+    hostAdvance(w * h * 8 / 5); // 16 bits a pixel at 10MHz
+  }
+  void setAddrWindow(int32_t x, int32_t y, int32_t w, int32_t /*h*/)
+  {
+    hostBusAccess(SPI_DEVICE_TFT);
+    window = {x, y, w};
+    written = 0;
+  }
+  // Fills the window row by row, as the panel's memory write does
+  void pushPixels(const void *data, uint32_t len)
+  {
+    const uint16_t *pixels = (const uint16_t *)data;
+    for (uint32_t i = 0; i < len; i++, written++)
+    {
+      pushRect(window.x + written % window.w, window.y + written / window.w, 1, 1, &pixels[i], 1);
+    }
+  }
+  bool initDMA() { return true; }
+  void dmaWait() {}
+  void startWrite() {}
+  void endWrite() {}
+  uint16_t color8to16(uint8_t c)
+  {
+    static const uint8_t blue[] = {0, 11, 21, 31};
+    return (c & 0xE0) << 8 | (c & 0xC0) << 5 | (c & 0x1C) << 6 | (c & 0x1C) << 3 | blue[c & 0x03];
+  }
+  uint16_t readPixel(int32_t x, int32_t y) { return frame[y * HOST_TFT_WIDTH + x]; }
+  int16_t width() { return HOST_TFT_WIDTH; }
+  int16_t height() { return HOST_TFT_HEIGHT; }
+
+  uint32_t fills = 0;        // number of full screen fills
+  uint32_t strings = 0;      // number of strings drawn directly on the panel
+  uint32_t pixelsPushed = 0; // pixels written to the panel
+  uint32_t dmaPushes = 0;    // DMA transfers started
+  bool sleeping = false;     // panel in sleep mode
+  struct
+  {
+    int32_t x, y, w;
+  } window = {0, 0, 1}; // set by setAddrWindow()
+  uint32_t written = 0; // pixels pushed into it
+  std::vector<uint16_t> frame;
+};
+
+class TFT_eSprite
+{
+public:
+  TFT_eSprite(TFT_eSPI *tft) : tft(tft) {}
+  void setColorDepth(int8_t /*depth*/) {}
+  void *createSprite(int16_t w, int16_t h)
+  {
+    width = w;
+    height = h;
+    buffer.assign(w * h, 0);
+    return buffer.data();
+  }
+  void setFreeFont(const GFXfont *f) { font = f; }
+  void setTextSize(uint8_t s) { size = s; }
+  void setTextDatum(uint8_t /*datum*/) {}
+  void setTextColor(uint16_t fg, uint16_t /*bg*/) { colour = fg; }
+  int16_t textWidth(const char *string) { return strlen(string) * font->advance * size; }
+  int16_t fontHeight() { return font->height * size; }
+  void fillSprite(uint32_t color) { buffer.assign(buffer.size(), color16to8(color)); }
+  void *getPointer() { return buffer.data(); }
+  int16_t drawString(const char *string, int32_t x, int32_t y)
+  {
+    int32_t w = font->advance * size, h = font->height * size;
+    int32_t left = x - textWidth(string) / 2, top = y - h / 2;
+    for (int32_t i = 0; string[i]; i++)
+    {
+      for (int32_t row = top; row < top + h; row++)
+      {
+        for (int32_t col = left + i * w; col < left + (i + 1) * w; col++)
+        {
+          if (col >= 0 && col < width && row >= 0 && row < height)
+          {
+            buffer[row * width + col] = color16to8(colour) ^ (uint8_t)string[i];
+          }
+        }
+      }
+    }
+    return textWidth(string);
+  }
+private:
+  static uint8_t color16to8(uint16_t c) { return (c & 0xE000) >> 8 | (c & 0x0700) >> 6 | (c & 0x0018) >> 3; }
+
+  TFT_eSPI *tft;
+  const GFXfont *font = nullptr;
+  uint8_t size = 1;
+  uint16_t colour = 0;
+  int16_t width = 0, height = 0;
+  std::vector<uint8_t> buffer;
+};
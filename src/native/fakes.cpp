@@ -0,0 +1,81 @@
+/* Host fakes for the Arduino core and TFT fonts
+*********************/
+
+#include <Arduino.h>
+#include <TFT_eSPI.h>
+#include "spibus.h"
+#include <stdarg.h>
+#include <chrono>
+
+static unsigned long hostMicros = 0;
+static uint8_t pinState[40];
+
+HostSerial Serial;
+uint32_t hostBusFaults = 0;
+HostEsp ESP;
+
+const GFXfont FreeSans18pt7b = {17, 42};
+const GFXfont FreeSans24pt7b = {26, 56};
+
+unsigned long millis() { return hostMicros / 1000; }
+
+unsigned long micros() { return hostMicros; }
+
+// The calling thread's alarm, as a timer interrupt on its core would be
+static thread_local void (*alarmCall)(void) = nullptr;
+static thread_local unsigned long alarmAt = 0;
+
+void hostAlarm(unsigned long us, void (*call)(void))
+{
+  alarmAt = hostMicros + us;
+  alarmCall = us ? call : nullptr;
+}
+
+void hostAdvance(unsigned long us)
+{
+  hostMicros += us;
+  if (alarmCall && (long)(hostMicros - alarmAt) >= 0)
+  {
+    void (*call)(void) = alarmCall;
+    alarmCall = nullptr;
+    call();
+  }
+}
+
+void delay(unsigned long ms) { hostAdvance(ms * 1000); }
+
+void hostBusAccess(uint8_t device)
+{
+  if (!spiHeld(device))
+    hostBusFaults++;
+}
+
+void yield() {}
+
+uint32_t HostEsp::getCycleCount()
+{
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() * 240 / 1000;
+}
+
+void pinMode(uint8_t /*pin*/, uint8_t /*mode*/) {}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  if (pin < sizeof(pinState))
+    pinState[pin] = val;
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pin < sizeof(pinState) ? pinState[pin] : LOW;
+}
+
+size_t HostSerial::printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int len = vprintf(format, args);
+  va_end(args);
+  return len < 0 ? 0 : len;
+}
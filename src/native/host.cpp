@@ -0,0 +1,361 @@
+/* Native host fixture
+*********************/
+
+#include "host.h"
+#include <execinfo.h>
+#include "hal.h"
+#include "settings.h"
+#include "ramp.h"
+#include "display.h"
+#include "spibus.h"
+#include "command.h"
+#include "stall.h"
+#include "metrics.h"
+
+Preferences preferences;
+MCP23S08 MCP(10);
+TFT_eSPI tft;
+Muses72323 Muses(0, 16);
+
+uint32_t wsFrames = 0;
+char lastFrame[BROADCAST_FRAME_SIZE] = "";
+
+bool halSendText(uint32_t /*client*/, const char *data, size_t len)
+{
+  wsFrames++;
+  if (len >= sizeof(lastFrame))
+    len = sizeof(lastFrame) - 1;
+  memcpy(lastFrame, data, len);
+  lastFrame[len] = 0;
+  return true;
+}
+
+uint32_t binaryFrames = 0;
+uint32_t binaryGaps = 0;
+BinaryFrame lastBinary = {};
+
+bool halSendBinary(uint32_t /*client*/, const uint8_t *data, size_t len)
+{
+  BinaryFrame frame;
+  if (len != sizeof(frame))
+    return false;
+  memcpy(&frame, data, len);
+  if (lastBinary.sequence && frame.sequence != lastBinary.sequence + 1)
+    binaryGaps++;
+  lastBinary = frame;
+  binaryFrames++;
+  return true;
+}
+
+
+void halStateChanged()
+{
+}
+
+void halStandby(bool standby)
+{
+  spiAcquire(SPI_DEVICE_TFT);
+  tft.writecommand(standby ? TFT_SLPIN : TFT_SLPOUT);
+  spiRelease(SPI_DEVICE_TFT);
+}
+
+// A unit on a steady network, with the host's own loop count
+uint32_t hostLoops = 0;
+
+void halHealth(HealthSample &sample)
+{
+  sample.heapFree = 180000;
+  sample.heapMinFree = 150000;
+  sample.heapLargest = 110000;
+  sample.loopIterations = hostLoops;
+  sample.loopRate = 1000;
+  sample.rssi = -61;
+  sample.wifiReconnects = 0;
+  sample.wsClients = HOST_CLIENTS;
+  sample.uptimeUs = (uint64_t)millis() * 1000;
+}
+
+// SPI clock of the last device selected
+uint32_t busClock = 0;
+
+void halBusClock(uint8_t device)
+{
+  if (device == SPI_DEVICE_MUSES)
+  {
+    busClock = SPI_MUSES_FREQUENCY;
+  }
+}
+
+// The stall alarm goes off inside hostAdvance(), on the control thread
+// where virtual time ran past it. The host's own return addresses, low 32
+// bits, without the alarm's and hostAdvance()'s frames.
+static void stallAlarm()
+{
+  void *frames[STALL_FRAMES + 2];
+  int depth = backtrace(frames, STALL_FRAMES + 2);
+  uint32_t pc[STALL_FRAMES];
+  uint8_t count = 0;
+  for (int f = 2; f < depth; f++)
+    pc[count++] = (uint32_t)(uintptr_t)frames[f];
+  stallOverrun(pc, count);
+}
+
+void halStallAlarm(uint32_t us)
+{
+  hostAlarm(us, stallAlarm);
+}
+
+// A fragmented heap, while set
+bool hostDmaFails = false;
+
+void *halDmaMalloc(size_t size)
+{
+  return hostDmaFails ? NULL : malloc(size);
+}
+
+// The flash file system, in memory
+std::map<std::string, std::vector<uint8_t>> files;
+uint32_t fileWrites = 0;
+
+size_t halReadFile(const char *path, uint8_t *data, size_t size)
+{
+  auto file = files.find(path);
+  if (file == files.end() || file->second.size() > size)
+    return 0;
+  memcpy(data, file->second.data(), file->second.size());
+  return file->second.size();
+}
+
+bool halWriteFile(const char *path, const uint8_t *data, size_t len)
+{
+  files[path].assign(data, data + len);
+  fileWrites++;
+  return true;
+}
+
+PathTimer renderPath = {"renderUpdate"};
+PathTimer broadcastPath = {"broadcastUpdate"};
+PathTimer persistPath = {"settingsUpdate"};
+
+// What the render and persistence tasks do after a state change
+void settle()
+{
+  timed(renderPath, renderUpdate);
+  timed(broadcastPath, []()
+        { broadcastUpdate(); });
+  timed(persistPath, []()
+        { settingsUpdate(); });
+}
+
+// Let time pass with the control loop's ramp engine running every millisecond
+void idle(unsigned long us)
+{
+  while (us)
+  {
+    unsigned long step = us < 1000 ? us : 1000;
+    hostAdvance(step);
+    hostLoops++;
+    stallPassBegin();
+    rampUpdate();
+    switchUpdate();
+    standbyUpdate();
+    stallPassEnd();
+    us -= step;
+  }
+}
+
+// Let a source switch run to the end of its level restore
+void waitSwitch()
+{
+  while (switchActive())
+    idle(1000);
+  settle();
+}
+
+// Turn the knob one detent at a time, `gapMs` apart
+void knob(PathTimer &t, int detents, unsigned long gapMs)
+{
+  for (int i = 0; i < abs(detents); i++)
+  {
+    encoderTurned(detents > 0 ? 1 : -1);
+    timed(t, commandUpdate);
+    settle();
+    idle(gapMs * 1000);
+  }
+}
+
+// Frame repeat periods of a held key
+static const unsigned long irPeriodUs[IR_PROTOCOLS] = {RC5_PERIOD_US, 106667, 108000, 45000};
+
+// Drive the receiver pin: low for a mark (carrier on), high for a space.
+// Edges wander by up to +-80us; irGlitch adds a stray pulse to the next one.
+static bool irLevel = HIGH;
+static bool irGlitch = false;
+
+static void irPulse(bool mark, unsigned long us)
+{
+  static uint32_t noise = 1;
+  bool next = mark ? LOW : HIGH;
+  if (next != irLevel)
+  {
+    noise = noise * 1103515245 + 12345;
+    irEdge(micros() + (noise >> 16) % 161 - 80, next);
+    irLevel = next;
+  }
+  if (irGlitch)
+  {
+    irEdge(micros() + 300, !irLevel);
+    irEdge(micros() + 400, irLevel);
+    irGlitch = false;
+  }
+  idle(us);
+}
+
+// Bi-phase bits, most significant first; `wide` gives one bit double length halves
+static void irBiphase(uint32_t bits, int count, unsigned long half, bool oneMarkFirst, int wide = -1)
+{
+  for (int i = 0; i < count; i++)
+  {
+    bool one = (bits >> (count - 1 - i)) & 1;
+    unsigned long us = i == wide ? 2 * half : half;
+    irPulse(one == oneMarkFirst, us);
+    irPulse(one != oneMarkFirst, us);
+  }
+}
+
+// Transmit one frame into the edge ring, as the receiver pin sees it.
+// NEC frames with toggle set are sent as the repeat code; glitch adds a
+// stray pulse in the middle of an RC5 frame.
+void irSend(uint8_t protocol, unsigned char toggle, uint16_t address, unsigned char command, bool glitch)
+{
+  switch (protocol)
+  {
+  case IR_RC5:
+  {
+    uint16_t bits = 1 << 13 | (command & 0x40 ? 0 : 1) << 12 | (toggle & 1) << 11 | (address & 0x1F) << 6 | (command & 0x3F);
+    irBiphase(bits >> 7, 7, IR_RC5_HALF_US, false);
+    irGlitch = glitch;
+    irBiphase(bits & 0x7F, 7, IR_RC5_HALF_US, false);
+    break;
+  }
+  case IR_RC6:
+    irPulse(true, 2666);
+    irPulse(false, 889);
+    irBiphase(1 << 4 | (toggle & 1), 5, 444, true, 4);
+    irBiphase((address & 0xFF) << 8 | command, 16, 444, true);
+    break;
+  case IR_NEC:
+    irPulse(true, 9000);
+    irPulse(false, toggle ? 2250 : 4500);
+    for (int i = 0; i < (toggle ? 0 : 32); i++)
+    {
+      uint32_t bits = (address & 0xFF) | (uint32_t)(~address & 0xFF) << 8 | (uint32_t)command << 16 | (uint32_t)(~command & 0xFF) << 24;
+      irPulse(true, 560);
+      irPulse(false, (bits >> i) & 1 ? 1690 : 560);
+    }
+    irPulse(true, 560);
+    break;
+  case IR_SIRC:
+    irPulse(true, 2400);
+    for (int i = 0; i < 12; i++)
+    {
+      irPulse(false, 600);
+      irPulse(true, (((uint32_t)address << 7 | (command & 0x7F)) >> i) & 1 ? 1200 : 600);
+    }
+    break;
+  }
+  irPulse(false, 0);
+}
+
+// One frame from a held or pressed key: decoded once the gap after it has
+// passed, then the rest of the key's repeat period
+void remote(PathTimer &t, uint8_t protocol, unsigned char toggle, uint16_t address, unsigned char command)
+{
+  unsigned long start = micros();
+  irSend(protocol, toggle, address, command);
+  idle(IR_GAP_US + 1000);
+  timed(t, commandUpdate);
+  settle();
+  unsigned long spent = micros() - start;
+  if (spent < irPeriodUs[protocol])
+    idle(irPeriodUs[protocol] - spent);
+}
+
+void webSocket(PathTimer &t, const char *message)
+{
+  timed(t, [&]()
+        {
+          commandQueue(COMMAND_WS_TEXT, 1, message, strlen(message), micros());
+          commandUpdate(); });
+  settle();
+  idle(20000);
+  waitSwitch();
+}
+
+void binaryCommand(PathTimer &t, uint8_t command, uint8_t input)
+{
+  BinaryFrame frame = {BINARY_MAGIC, BINARY_PROTOCOL_VERSION, BINARY_COMMAND, 0, 0, 0, input, command};
+  timed(t, [&]()
+        {
+          commandQueue(COMMAND_WS_BINARY, HOST_CLIENTS, &frame, sizeof(frame), micros());
+          commandUpdate(); });
+  settle();
+  idle(20000);
+  waitSwitch();
+}
+
+// The project directory, so that data/ is found whatever directory the
+// session or a test is run from. platformio.ini passes it; otherwise it is
+// taken from this file's path, which the compiler may give relative.
+static std::string projectPath(const char *path)
+{
+#ifdef HOST_PROJECT_DIR
+  std::string dir = HOST_PROJECT_DIR;
+#else
+  std::string dir = __FILE__;
+  const char *self = "src/native/host.cpp";
+  size_t at = dir.rfind(self);
+  dir = at != std::string::npos && at + strlen(self) == dir.size() ? dir.substr(0, at) : "";
+#endif
+  if (!dir.empty() && dir.back() != '/')
+    dir += '/';
+  return dir + path;
+}
+
+// A file of the project's own, path relative to the project directory,
+// empty if it is not there
+std::vector<uint8_t> hostFile(const char *path)
+{
+  std::vector<uint8_t> data;
+  FILE *file = fopen(projectPath(path).c_str(), "rb");
+  if (!file)
+    return data;
+  uint8_t chunk[4096];
+  size_t len;
+  while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    data.insert(data.end(), chunk, chunk + len);
+  fclose(file);
+  return data;
+}
+
+// Load a font from data/, as the firmware does from LittleFS
+bool loadFont(uint8_t font, const char *path)
+{
+  std::vector<uint8_t> data = hostFile(path);
+  return !data.empty() && displayLoadFont(font, data.data(), data.size());
+}
+
+// Boot as setup() does, with HOST_CLIENTS WebSocket clients connected;
+// false if the smooth fonts could not be loaded
+bool hostBoot()
+{
+  for (uint32_t id = 1; id <= HOST_CLIENTS; id++)
+    broadcastClientConnected(id, id == HOST_CLIENTS);
+  displayBegin();
+  bool fontsLoaded = loadFont(DISPLAY_FONT_READOUT, "data/NotoSansBold36.vlw") &&
+                     loadFont(DISPLAY_FONT_CLOCK, "data/NotoSansMonoSCB20.vlw");
+  stallBegin();
+  controllerBegin();
+  settle();
+  return fontsLoaded;
+}
@@ -0,0 +1,73 @@
+/* Native host fixture
+*********************
+
+The fake hardware and HAL of [env:native], and input helpers that drive
+the controller on virtual time as the firmware's tasks would: a knob turn,
+a remote key, a WebSocket message, then the render and persistence work
+that follows it. Shared by the scripted session (host_main.cpp) and the
+Unity tests under test/.
+
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "controller.h"
+#include "broadcast.h"
+#include "binary_protocol.h"
+#include "ir.h"
+
+#define HOST_CLIENTS 2 // WebSocket clients connected for the session; the last one speaks binary
+
+#define RC5_FRAME_US (28 * IR_RC5_HALF_US)
+#define RC5_PERIOD_US 113778 // frame repeat period of a held key
+
+// Wall-clock timing of one control path
+struct PathTimer
+{
+  const char *name;
+  uint32_t calls = 0;
+  double totalUs = 0;
+  double maxUs = 0;
+};
+
+template <typename Fn>
+void timed(PathTimer &t, Fn fn)
+{
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  t.calls++;
+  t.totalUs += us;
+  if (us > t.maxUs)
+    t.maxUs = us;
+}
+
+extern uint32_t wsFrames;                    // JSON frames sent
+extern char lastFrame[BROADCAST_FRAME_SIZE]; // the last of them
+extern uint32_t binaryFrames;                // binary frames sent
+extern uint32_t binaryGaps;                  // binary sequence numbers skipped
+extern BinaryFrame lastBinary;
+extern uint32_t hostLoops;
+extern bool hostDmaFails;                                 // halDmaMalloc() returns NULL
+extern uint32_t busClock;                                 // SPI clock of the last device selected
+extern std::map<std::string, std::vector<uint8_t>> files; // the flash file system
+extern uint32_t fileWrites;
+extern PathTimer renderPath, broadcastPath, persistPath;
+
+bool hostBoot(void);                                     // setup(); false if the smooth fonts are missing
+void settle(void);                                       // the render and persistence tasks' work
+void idle(unsigned long us);                             // the control loop, every millisecond
+void waitSwitch(void);                                   // a source switch, to its level restore
+void knob(PathTimer &t, int detents, unsigned long gapMs = 5);
+void irSend(uint8_t protocol, unsigned char toggle, uint16_t address, unsigned char command, bool glitch = false);
+void remote(PathTimer &t, uint8_t protocol, unsigned char toggle, uint16_t address, unsigned char command);
+void webSocket(PathTimer &t, const char *message);
+void binaryCommand(PathTimer &t, uint8_t command, uint8_t input = 0);
+std::vector<uint8_t> hostFile(const char *path);
+bool loadFont(uint8_t font, const char *path);
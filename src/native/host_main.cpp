@@ -0,0 +1,564 @@
+/* Native host run of the pre-amp controller
+*********************
+
+Builds the controller logic against the fakes in this directory and replays
+a scripted session (knob sweep, source changes, IR remote and WebSocket commands),
+printing the wall-clock cost of each control path and the hardware traffic
+it generated. The render and persistence work the firmware runs in separate
+tasks is run and timed after every input.
+
+  pio run -e native && .pio/build/native/program
+
+The fixture it runs on (host.h) is shared with the assertions under test/:
+
+  pio test -e native
+
+*/
+
+#include "host.h"
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include "hal.h"
+#include "controller.h"
+#include "settings.h"
+#include "broadcast.h"
+#include "binary_protocol.h"
+#include "ramp.h"
+#include "display.h"
+#include "ir.h"
+#include "keymap.h"
+#include "taper.h"
+#include "spibus.h"
+#include "command.h"
+#include "metrics.h"
+#include "profile.h"
+#include "trace.h"
+#include "stall.h"
+#include "assets.h"
+
+// The tests under test/ bring their own main()
+#ifndef PIO_UNIT_TESTING
+
+// A control loop pass held up for `ms`, inside a command's setVolume or
+// after its setIO
+__attribute__((noinline)) static void stalledPass(unsigned long ms, bool inScope)
+{
+  stallPassBegin();
+  {
+    PROFILE_SCOPE(PROFILE_WS_COMMAND);
+    PROFILE_SCOPE(inScope ? PROFILE_SET_VOLUME : PROFILE_SET_IO);
+    if (inScope)
+      delay(ms);
+  }
+  if (!inScope)
+    delay(ms);
+  stallPassEnd();
+}
+
+
+// Producer threads racing to queue numbered commands while this thread
+// takes them: true if every command arrived once and in its producer's order
+#define QUEUE_PRODUCERS 3
+#define QUEUE_COMMANDS 20000
+
+static bool queueStress(uint32_t &refusals)
+{
+  uint32_t refusedBefore = commandStats().refused.load();
+  std::thread producers[QUEUE_PRODUCERS];
+  for (uint32_t p = 0; p < QUEUE_PRODUCERS; p++)
+  {
+    producers[p] = std::thread([p]()
+                               {
+      for (uint32_t n = 0; n < QUEUE_COMMANDS; n++)
+      {
+        while (!commandQueue(COMMAND_BUTTON, p, &n, sizeof(n), 0))
+          std::this_thread::yield();
+      } });
+  }
+  uint32_t next[QUEUE_PRODUCERS] = {};
+  uint32_t taken = 0;
+  bool ordered = true;
+  Command command;
+  while (taken < QUEUE_PRODUCERS * QUEUE_COMMANDS)
+  {
+    if (!commandTake(command))
+      continue;
+    uint32_t n;
+    memcpy(&n, command.data, sizeof(n));
+    ordered = ordered && command.client < QUEUE_PRODUCERS && n == next[command.client]++;
+    taken++;
+  }
+  for (std::thread &producer : producers)
+    producer.join();
+  refusals = commandStats().refused.load() - refusedBefore;
+  return ordered && !commandTake(command);
+}
+
+static void report(const PathTimer &t)
+{
+  Serial.printf("  %-16s calls %5u  mean %8.2fus  max %8.2fus\n",
+                t.name, t.calls, t.calls ? t.totalUs / t.calls : 0.0, t.maxUs);
+}
+
+int main()
+{
+  PathTimer knobPath = {"knob"};
+  PathTimer irPath = {"IR remote"};
+  PathTimer wsPath = {"WebSocket"};
+  PathTimer binaryPath = {"WebSocket bin"};
+
+  preferences.putInt("VOLUME", -200);
+  preferences.putUInt("SOURCE", 2);
+  preferences.writes = 0;
+  MCP.latch = 0x06; // relays left by the previous run, two closed
+
+  bool fontsLoaded = hostBoot();
+  uint8_t bootLatch = MCP.latch;
+
+  // Sweep the knob up and down, then select a source with the encoder
+  idle(SETTINGS_IDLE_MS * 1000UL);
+  settle();
+  uint32_t sweepWrites = preferences.writes;
+  int16_t sweepStart = volume;
+  knob(knobPath, 100, 20); // 50 detents per second
+  int16_t fastSpin = volume - sweepStart;
+  idle(1000000);
+  knob(knobPath, -60, 250); // slow turn, single steps
+  int16_t slowTurn = volume - sweepStart - fastSpin;
+  uint32_t sweepDuring = preferences.writes - sweepWrites;
+  idle(SETTINGS_IDLE_MS * 1000UL);
+  settle();
+  uint32_t sweepAfter = preferences.writes - sweepWrites;
+  encoderPressed();
+  commandUpdate();
+  bool buttonSelects = state == STATE_IO;
+  uint32_t spinWrites = switchStats().relayWrites;
+  knob(knobPath, 3);
+  waitSwitch();
+  spinWrites = switchStats().relayWrites - spinWrites;
+  idle((TIME_EXITSELECT + 1) * 1000000UL);
+  knob(knobPath, 1);
+
+  // Remote: source keys, mute toggle, held volume up
+  remote(irPath, IR_RC5, 0, 0x10, 1);
+  remote(irPath, IR_RC5, 1, 0x10, 13);
+  remote(irPath, IR_RC5, 0, 0x10, 13);
+  int16_t holdStart = volume;
+  for (int i = 0; i < 20; i++)
+    remote(irPath, IR_RC5, 1, 0x10, 16);
+  int16_t heldKey = volume - holdStart;
+
+  // Held key repeats while loop() is stalled, decoded afterwards from the
+  // buffered edge times, then a frame with a glitch in it
+  int16_t stallStart = volume;
+  for (int i = 0; i < 3; i++)
+  {
+    irSend(IR_RC5, 1, 0x10, 17);
+    idle(RC5_PERIOD_US - RC5_FRAME_US);
+  }
+  for (int i = 0; i < 3; i++)
+    timed(irPath, commandUpdate);
+  settle();
+  int16_t stalledKey = volume - stallStart;
+  irSend(IR_RC5, 0, 0x10, 16, true);
+  idle(RC5_PERIOD_US - RC5_FRAME_US);
+  timed(irPath, commandUpdate);
+  settle();
+
+  // Web UI buttons
+  webSocket(wsPath, "{\"CD\":\"toggle\"}");
+  webSocket(wsPath, "{\"Mute\":\"toggle\"}");
+  for (int i = 0; i < 20; i++)
+    webSocket(wsPath, "{\"Voldown\":\"toggle\"}");
+
+  // Soft mute and unmute
+  uint32_t rampWrites = Muses.transfers;
+  mute();
+  unsigned long rampStart = millis();
+  while (rampActive())
+    idle(1000);
+  unsigned long muteMs = millis() - rampStart;
+  unMute();
+  rampStart = millis();
+  while (rampActive())
+    idle(1000);
+  unsigned long unmuteMs = millis() - rampStart;
+  rampWrites = Muses.transfers - rampWrites;
+  settle();
+
+  // Absolute level and batched commands: one hardware update each
+  uint32_t batchMuses = Muses.transfers;
+  uint32_t batchMcp = MCP.transfers;
+  uint32_t batchRequests = broadcastStats().requested;
+  webSocket(wsPath, "{\"VolumeDb\":-40}");
+  webSocket(wsPath, "{\"Source\":\"Tuner\",\"Volume\":-100,\"Mute\":false}");
+  webSocket(wsPath, "[{\"Source\":1},{\"Volup\":\"toggle\"},{\"Volume\":-90},{\"Mute\":\"toggle\"},{\"Mute\":\"toggle\"}]");
+  batchMuses = Muses.transfers - batchMuses;
+  batchMcp = MCP.transfers - batchMcp;
+  batchRequests = broadcastStats().requested - batchRequests;
+
+  // Automation client on the binary protocol
+  binaryCommand(binaryPath, BINARY_CMD_SOURCE, 2);
+  for (int i = 0; i < 20; i++)
+    binaryCommand(binaryPath, BINARY_CMD_VOLUME_UP);
+  binaryCommand(binaryPath, BINARY_CMD_MUTE_TOGGLE);
+  binaryCommand(binaryPath, BINARY_CMD_MUTE_TOGGLE);
+
+  // Let the last coalesced frame go out
+  idle(BROADCAST_MIN_INTERVAL_MS * 1000UL);
+  settle();
+
+  // Standby from the remote, then woken by the knob, a remote key and a WebSocket command
+  while (rampActive())
+    idle(1000);
+  int16_t levelBefore = Muses.left;
+  uint8_t sourceBefore = source;
+  int standbyChecks = 0, standbyPassed = 0;
+  for (int wake = 0; wake < 3; wake++)
+  {
+    if (wake < 2)
+      remote(irPath, IR_RC5, wake, 0x10, 12);
+    else
+      webSocket(wsPath, "{\"Standby\":true}");
+    idle(RAMP_MUTE_MS * 1000UL);
+    settle();
+    standbyChecks++;
+    standbyPassed += Muses.muted && tft.sleeping && !backlight && standbyUpdate();
+    if (wake == 0)
+      knob(knobPath, 1);
+    else if (wake == 1)
+      remote(irPath, IR_RC5, 0, 0x10, 16); // only wakes, the level is not stepped
+    else
+      webSocket(wsPath, "{\"Mute\":false}");
+    while (rampActive())
+      idle(1000);
+    idle(DISPLAY_FRAME_MS * 1000UL);
+    settle();
+    standbyChecks++;
+    standbyPassed += !inStandby() && !Muses.muted && Muses.left == levelBefore && source == sourceBefore && !tft.sleeping;
+  }
+
+  // Teach the pre-amp keys of an NEC, an RC6 and a Sony remote from the web
+  // page, then use them: a held NEC key sends repeat codes, a held SIRC key
+  // resends its frame
+  struct Learn
+  {
+    const char *action;
+    uint8_t protocol;
+    uint16_t address;
+    uint8_t command;
+  } learns[] = {{"VolumeUp", IR_NEC, 0x04, 0x02}, {"VolumeDown", IR_NEC, 0x04, 0x03}, {"Mute", IR_RC6, 0x00, 0x0D}, {"Tuner", IR_SIRC, 0x01, 0x12}};
+  int learnChecks = 0, learnPassed = 0;
+  uint32_t learnFileWrites = fileWrites;
+  for (auto &l : learns)
+  {
+    char message[48];
+    snprintf(message, sizeof(message), "{\"Learn\":\"%s\"}", l.action);
+    webSocket(wsPath, message);
+    ControlTarget before = currentTarget();
+    remote(irPath, l.protocol, 0, l.address, l.command);
+    IrFrame frame = {l.protocol, 0, l.address, l.command, 0};
+    learnChecks++;
+    learnPassed += learning() == KEY_NONE && keymapLookup(frame) == keymapAction(l.action) && volume == before.volume && source == before.source && isMuted == before.muted;
+  }
+  idle(SETTINGS_IDLE_MS * 1000UL);
+  settle();
+  learnFileWrites = fileWrites - learnFileWrites;
+  int16_t necStart = volume;
+  remote(irPath, IR_NEC, 0, 0x04, 0x02);
+  for (int i = 0; i < 5; i++)
+    remote(irPath, IR_NEC, 1, 0x04, 0x02); // repeat codes
+  int16_t necHeld = volume - necStart;
+  remote(irPath, IR_RC6, 1, 0x00, 0x0D);
+  learnChecks++;
+  learnPassed += isMuted;
+  remote(irPath, IR_RC6, 0, 0x00, 0x0D);
+  learnChecks++;
+  learnPassed += !isMuted;
+  uint32_t sircMcp = MCP.transfers;
+  for (int i = 0; i < 3; i++)
+    remote(irPath, IR_SIRC, 0, 0x01, 0x12); // one press, sent three times
+  sircMcp = MCP.transfers - sircMcp;
+  learnChecks++;
+  learnPassed += source == 4;
+
+  // The cost of a lookup with the map full, against the codes mapped so
+  // far; then the saved map comes back as on a restart, without the filler
+  size_t mapped = keymapCount();
+  IrFrame probeFrame = {IR_NEC, 0, 0x04, 0x03, 0};
+  auto lookupNs = [&]()
+  {
+    volatile uint8_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < 1000000; i++)
+    {
+      probeFrame.command = 0x02 + (i & 1);
+      sink = sink + keymapLookup(probeFrame);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / 1000000;
+  };
+  double lookupFew = lookupNs();
+  for (uint32_t i = 0; keymapCount() < KEYMAP_MAX; i++)
+  {
+    IrFrame extra = {(uint8_t)(i % IR_PROTOCOLS), 0, (uint16_t)(0x100 + i / 8), (uint8_t)(i % 8), 0};
+    keymapLearn(extra, KEY_DISPLAY);
+  }
+  double lookupFull = lookupNs();
+  keymapBegin();
+  learnChecks++;
+  learnPassed += keymapCount() == mapped;
+
+  // Clock ticks, then check the partial pushes left the panel as a full redraw would
+  uint32_t clockPixels = 0;
+  char clock[16];
+  for (int sec = 55; sec < 65; sec++)
+  {
+    snprintf(clock, sizeof(clock), "12:%02d:%02d", 34 + sec / 60, sec % 60);
+    displaySetClock(clock);
+    clockPixels += displayUpdate();
+  }
+  std::vector<uint16_t> panel = tft.frame;
+  displayClear();
+  displayUpdate();
+  bool panelMatches = panel == tft.frame;
+
+  // One source switch, then the relays left closed
+  uint32_t switchMcp = MCP.transfers;
+  selectSource(source % 4 + 1);
+  waitSwitch();
+  switchMcp = MCP.transfers - switchMcp;
+  bool oneRelay = MCP.latch == 1 << (source - 1);
+
+  // Restart: pending settings are flushed by the shutdown handler
+  settingsFlush();
+
+  Serial.printf("Control path timing\n");
+  report(knobPath);
+  report(irPath);
+  report(wsPath);
+  report(binaryPath);
+  report(renderPath);
+  report(broadcastPath);
+  report(persistPath);
+  const IrStats &irs = irStats();
+  Serial.printf("IR receiver\n");
+  Serial.printf("  edges %u, frames %u, errors %u, ring overflows %u\n", irs.edges.load(), irs.frames.load(), irs.errors.load(), irs.overflows.load());
+  Serial.printf("  3 repeats decoded after a stalled loop: %d steps\n", stalledKey);
+  Serial.printf("  frames by protocol: RC5 %u, RC6 %u, NEC %u, SIRC %u; NEC repeat codes %u\n", irs.protocol[IR_RC5].load(), irs.protocol[IR_RC6].load(),
+                irs.protocol[IR_NEC].load(), irs.protocol[IR_SIRC].load(), irs.repeats.load());
+  Serial.printf("Learned keys\n");
+  Serial.printf("  checks passed %d/%d, %u key map file writes, %u codes mapped\n", learnPassed, learnChecks, learnFileWrites, (unsigned)mapped);
+  Serial.printf("  NEC key held for 5 repeats: %d steps, SIRC key sent 3 times: %u MCP transactions\n", necHeld, sircMcp);
+  Serial.printf("  lookup %.1fns with %u codes, %.1fns with %u (host)\n", lookupFew, (unsigned)mapped, lookupFull, KEYMAP_MAX);
+  Serial.printf("Volume taper\n");
+  Serial.printf("  %u positions over %d chip steps; -30dB up one: %s, down one: %s\n", taperPositions(), VOLUME_MAX - VOLUME_MIN + 1,
+                taperLabel(taperStep(-120, 1)), taperLabel(taperStep(-120, -1)));
+  Serial.printf("Acceleration\n");
+  Serial.printf("  100 detents at 50/s: %d steps, 60 detents at 4/s: %d steps, 20 RC5 repeats: %d steps\n", fastSpin, slowTurn, heldKey);
+  Serial.printf("Volume ramps\n");
+  Serial.printf("  soft mute %lums, soft unmute %lums, %u chip writes\n", muteMs, unmuteMs, rampWrites);
+  const SwitchStats &sws = switchStats();
+  Serial.printf("Source switches (fade %ums, settle %ums, restore %ums)\n", SWITCH_FADE_MS, SWITCH_SETTLE_MS, SWITCH_RESTORE_MS);
+  Serial.printf("  requests %u, relay writes %u; 3 detents in source mode: %u write; request to level restored last %.1fms worst %.1fms\n",
+                sws.requests, sws.relayWrites, spinWrites, sws.lastUs / 1000.0, sws.worstUs / 1000.0);
+  Serial.printf("Batched commands (3 messages)\n");
+  Serial.printf("  Muses writes %u (incl. ramp steps), MCP transactions %u, notifications %u\n", batchMuses, batchMcp, batchRequests);
+  Serial.printf("Hardware traffic\n");
+  Serial.printf("  Muses writes %u, MCP transactions %u, NVS writes %u\n", Muses.transfers, MCP.transfers, preferences.writes);
+  Serial.printf("  source relays: stale latch 0x06 corrected to 0x%02X at boot, %u MCP transaction per switch, one closed at the end: %s\n",
+                bootLatch, switchMcp, oneRelay ? "yes" : "NO");
+  Serial.printf("  NVS writes for a 160 detent knob sweep: %u during, %u after %ums idle\n", sweepDuring, sweepAfter, SETTINGS_IDLE_MS);
+  Serial.printf("  TFT strings %u, TFT fills %u, WebSocket text frames %u\n", tft.strings, tft.fills, wsFrames);
+  const BroadcastStats &bs = broadcastStats();
+  const DisplayStats &ds = displayStats();
+  Serial.printf("Display (%s fonts)\n", fontsLoaded ? "smooth" : "built-in");
+  Serial.printf("  %u updates, %u windows, %u pixels (%.1f%% of a full screen per update)\n",
+                ds.updates, ds.pushes, ds.pixels, ds.updates ? 100.0 * ds.pixels / ds.updates / (HOST_TFT_WIDTH * HOST_TFT_HEIGHT) : 0.0);
+  Serial.printf("  10 clock ticks: %u pixels, panel matches a full redraw: %s\n", clockPixels, panelMatches ? "yes" : "NO");
+  Serial.printf("  %u frames at most every %ums, %u state changes merged, %u DMA strips\n", ds.frames, DISPLAY_FRAME_MS, ds.merged, tft.dmaPushes);
+  Serial.printf("  frame time mean %.1fus, max %uus (host)\n", ds.frames ? (double)ds.frameUsTotal / ds.frames : 0.0, ds.frameUsMax);
+  const SpiBusStats &sb = spiBusStats();
+  Serial.printf("SPI bus\n");
+  for (uint8_t device = 0; device < SPI_DEVICES; device++)
+  {
+    Serial.printf("  %-10s %5u transactions, bus time %.1fms, longest hold %uus, worst wait %uus\n", spiDeviceName[device],
+                  sb.transactions[device].load(), sb.busyUs[device].load() / 1000.0, sb.holdUsMax[device].load(), sb.waitUsMax[device].load());
+  }
+  Serial.printf("  transfers made without the device's bus transaction open: %u\n", hostBusFaults);
+  Serial.printf("  a volume write waits at most one display strip: %uus against a %uus frame; %u yields, Muses clock %.1fMHz, MCP %.1fMHz\n",
+                sb.chunkUsMax.load(), ds.frameUsMax, sb.yields.load(), busClock / 1e6, MCP.SPIspeed / 1e6);
+  const StandbyStats &ss = standbyStats();
+  Serial.printf("Standby\n");
+  Serial.printf("  entered %u, resumed %u, resume last %.1fms worst %.1fms (bound %ums), checks passed %d/%d\n",
+                ss.entered, ss.resumed, ss.lastResumeUs / 1000.0, ss.worstResumeUs / 1000.0, STANDBY_RESUME_BOUND_MS, standbyPassed, standbyChecks);
+  Serial.printf("WebSocket broadcasts (%u clients)\n", HOST_CLIENTS);
+  Serial.printf("  requested %u, frames built %u, unchanged %u, sent %u, rate limited %u, queue full %u\n",
+                bs.requested.load(), bs.composed.load(), bs.unchanged.load(), bs.sent.load(), bs.rateLimited.load(), bs.queueFull.load());
+  Serial.printf("  frames saved against one per request per client: %u\n", bs.requested * HOST_CLIENTS - bs.sent);
+  Serial.printf("  binary client: %u frames, last sequence %u, %u sequence gaps\n", binaryFrames, lastBinary.sequence, binaryGaps);
+  // What a scrape of /metrics returns now, samples only
+  static char metrics[METRICS_TEXT_MAX];
+  size_t metricsLen = metricsText(metrics, sizeof(metrics));
+  uint32_t samples = 0;
+  Serial.printf("/metrics (%u bytes)\n", (unsigned)metricsLen);
+  for (char *line = strtok(metrics, "\n"); line; line = strtok(NULL, "\n"))
+  {
+    if (line[0] != '#')
+    {
+      Serial.printf("  %s\n", line);
+      samples++;
+    }
+  }
+  PathTimer scrape = {"metrics"};
+  for (int i = 0; i < 100; i++)
+    timed(scrape, [&]()
+          { metricsText(metrics, sizeof(metrics)); });
+  Serial.printf("  %u samples, scrape mean %.1fus (host)\n", samples, scrape.totalUs / scrape.calls);
+  // /trace, read in the odd sized pieces a TCP window allows
+  static TraceExport trace;
+  traceExportBegin(trace);
+  std::string traceJson;
+  uint8_t piece[61];
+  size_t got;
+  while ((got = traceExportRead(trace, piece, 1 + traceJson.size() % sizeof(piece))) > 0)
+    traceJson.append((const char *)piece, got);
+  int depth = 0, deepest = 0;
+  bool quoted = false;
+  for (char c : traceJson)
+  {
+    if (c == '"')
+      quoted = !quoted;
+    else if (!quoted && (c == '{' || c == '['))
+      deepest = std::max(deepest, ++depth);
+    else if (!quoted && (c == '}' || c == ']'))
+      depth--;
+  }
+  size_t spans = 0, applied = 0;
+  for (size_t at = 0; (at = traceJson.find("\"ph\":\"X\"", at)) != std::string::npos; at++)
+    spans++;
+  for (size_t at = 0; (at = traceJson.find("\"command applied\"", at)) != std::string::npos; at++)
+    applied++;
+  Serial.printf("Event trace (%u event ring)\n", TRACE_EVENTS);
+  Serial.printf("  /trace: %u bytes, %u events (%u spans, %u commands applied), brackets balanced: %s\n", (unsigned)traceJson.size(),
+                (unsigned)trace.count, (unsigned)spans, (unsigned)applied, depth == 0 && !quoted && deepest == 4 ? "yes" : "NO");
+#if STALL_WATCHDOG
+  // Loop stalls: the session's own passes, then three made up ones at two
+  // sites, the report written, and read back as after a reset
+  uint32_t sessionStalls = stallStats().stalls.load();
+  uint32_t sessionPassMax = stallStats().passUsMax.load();
+  for (volatile int i = 0; i < 2; i++) // one call site, so one stall site
+    stalledPass(i ? 40 : 25, true);
+  stalledPass(15, false);
+  static char stalls[STALL_TEXT_MAX];
+  Serial.printf("Loop stalls (budget %uus)\n", STALL_BUDGET_US);
+  Serial.printf("  session: %u stalls, longest pass %uus\n  ", sessionStalls, sessionPassMax);
+  stallUpdate();
+  size_t stallsLen = stallText(stalls, sizeof(stalls));
+  std::string before(stalls, stallsLen);
+  stallClear();
+  stallBegin();
+  stallsLen = stallText(stalls, sizeof(stalls));
+  bool stallsKept = before == std::string(stalls, stallsLen);
+  for (char *line = strtok(stalls, "\n"); line; line = strtok(NULL, "\n"))
+    Serial.printf("  %s\n", line);
+  Serial.printf("  report kept across a reset: %s\n", stallsKept ? "yes" : "NO");
+#endif
+  // Static assets: a phone opening the page ten times, sending back the
+  // ETags it was given after the first. The plain files stand in for the
+  // gzipped ones the build step makes, so the icon (15KB, 1KB gzipped)
+  // is too big to cache here.
+  files[ASSET_PAGE] = hostFile("data/index.html");
+  for (const Asset &asset : assets)
+    if (asset.gzip)
+      files[std::string(asset.path) + ".gz"] = hostFile((std::string("data") + asset.path).c_str());
+  std::map<std::string, std::string> etags;
+  uint32_t assetBytes = 0, assetFull = 0;
+  for (int load = 0; load < 10; load++)
+  {
+    Asset *page = assetFind(ASSET_PAGE);
+    if (page)
+      assetBytes += page->len;
+    for (const Asset &listed : assets)
+    {
+      if (!listed.gzip)
+        continue;
+      Asset *asset = assetFind(listed.path);
+      if (!asset)
+        continue;
+      auto known = etags.find(asset->path);
+      if (known == etags.end() || !assetFresh(*asset, known->second.c_str()))
+      {
+        assetBytes += asset->len;
+        assetFull++;
+        etags[asset->path] = asset->etag;
+      }
+    }
+  }
+  const AssetStats &as = assetStats();
+  Serial.printf("Static assets (version %s)\n", assetVersion());
+  Serial.printf("  10 page loads: %u requests, %u flash reads, %u sent in full, %u not modified, %u bytes\n", as.requests,
+                as.flashReads, assetFull, as.notModified, assetBytes);
+  for (const Asset &asset : assets)
+    if (!asset.data)
+      Serial.printf("  %s: plain file from flash\n", asset.path);
+#if PROFILE_SCOPES
+  static char profile[PROFILE_TEXT_MAX];
+  profileText(profile, sizeof(profile));
+  Serial.printf("Scope profile (host)\n%s", profile);
+  // /profile and /profile?reset from the web server while another task
+  // records: samples are all 5us, so a read that is not torn shows a mean
+  // of 5.0 and p50 and p99 of the same bucket
+  std::atomic<bool> recording(true);
+  std::atomic<uint32_t> recorded(0);
+  std::thread owner([&]()
+                    {
+                      while (recording.load())
+                      {
+                        profileRecord(PROFILE_WS_MESSAGE, 5 * PROFILE_CYCLES_PER_US);
+                        recorded++;
+                      } });
+  while (!recorded.load())
+    ;
+  uint32_t profileReads = 0, profileTorn = 0;
+  for (int i = 0; i < 20000; i++)
+  {
+    profileText(profile, sizeof(profile));
+    const char *row = strstr(profile, profileScopeName[PROFILE_WS_MESSAGE]);
+    unsigned count, p50, p99;
+    double mean, maxUs;
+    if (row && sscanf(row + strlen(profileScopeName[PROFILE_WS_MESSAGE]), "%u %lf %u %u %lf", &count, &mean, &p50, &p99, &maxUs) == 5)
+    {
+      profileReads++;
+      if (mean != 5.0 || p50 != 6 || p99 != 6 || maxUs != 5.0)
+        profileTorn++;
+    }
+    if (i % 50 == 49)
+      profileReset();
+  }
+  recording.store(false);
+  owner.join();
+  Serial.printf("  reset and read while recording: %u reads, all whole: %s\n", profileReads,
+                profileReads && !profileTorn ? "yes" : "NO");
+#endif
+  const CommandStats &cs = commandStats();
+  Serial.printf("Command queue (%u slots)\n", COMMAND_QUEUE_SIZE);
+  for (uint8_t s = 0; s < COMMAND_SOURCES; s++)
+  {
+    char queued[16] = "edge ring,";
+    if (s != COMMAND_IR)
+      snprintf(queued, sizeof(queued), "queued %4u,", cs.queued[s].load());
+    Serial.printf("  %-13s %-12s applied %4u, input to applied mean %.1fms, worst %.1fms\n", commandSourceName[s], queued,
+                  cs.applied[s], cs.applied[s] ? cs.totalUs[s] / 1000.0 / cs.applied[s] : 0.0, cs.worstUs[s] / 1000.0);
+  }
+  Serial.printf("  button enters source select: %s; most waiting %u, refused %u\n", buttonSelects ? "yes" : "NO", cs.depthMax, cs.refused.load());
+  uint32_t refusals;
+  bool stressPassed = queueStress(refusals);
+  Serial.printf("  %u threads x %u commands: all taken once, in order: %s (%u pushes found it full)\n", QUEUE_PRODUCERS, QUEUE_COMMANDS,
+                stressPassed ? "yes" : "NO", refusals);
+  Serial.printf("Final state: volume %d, source %u, muted %d\n", volume, source, isMuted);
+  Serial.printf("Last frame: %s\n", lastFrame);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/* Host fake of the Muses72323 volume controller library
+*********************/
+
+#pragma once
+
+#include <Arduino.h>
+#include <stdint.h>
+#include "spibus.h"
+
+class Muses72323
+{
+public:
+  typedef int16_t volume_t;
+
+  Muses72323(uint8_t /*address*/, int /*slaveSelectPin*/) {}
+
+  void begin() {}
+  void setExternalClock(bool /*enabled*/) {}
+  void setZeroCrossingOn(bool enabled) { zeroCrossing = enabled; }
+  void setVolume(volume_t lch, volume_t rch)
+  {
+    left = lch;
+    right = rch;
+    muted = false;
+    transfers++;
+    hostBusAccess(SPI_DEVICE_MUSES);
+    hostAdvance(32); // two 16-bit words at 1MHz
+  }
+  void mute()
+  {
+    muted = true;
+    transfers++;
+    hostBusAccess(SPI_DEVICE_MUSES);
+    hostAdvance(16);
+  }
+
+  volume_t left = 0;
+  volume_t right = 0;
+  bool muted = true;
+  bool zeroCrossing = false;
+  uint32_t transfers = 0; // number of SPI writes to the chip
+};
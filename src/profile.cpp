@@ -0,0 +1,159 @@
+/* Scoped latency profiler
+*********************/
+
+#include "profile.h"
+
+const char *profileScopeName[PROFILE_SCOPE_COUNT] = {
+    "setVolume", "setIO", "notifyClients", "handleWebSocketMessage", "handleCommandMessage",
+    "remoteKey", "displayUpdate", "tft strip", "tft fillScreen"};
+
+#if PROFILE_SCOPES
+
+#include <stdarg.h>
+#include <atomic>
+
+struct Histogram
+{
+  uint32_t count;
+  uint32_t bucket[PROFILE_BUCKETS];
+  uint64_t totalCycles;
+  uint32_t maxCycles;
+};
+
+// Each histogram is only written by the task that owns its scope. Other
+// tasks read the copy it publishes behind a sequence lock: the count is odd
+// while the words are written, and a reader that saw it odd or changed
+// reads again.
+#define HISTOGRAM_WORDS (sizeof(Histogram) / sizeof(uint32_t))
+static_assert(sizeof(Histogram) % sizeof(uint32_t) == 0, "Histogram must be whole words");
+
+static Histogram histograms[PROFILE_SCOPE_COUNT];
+static std::atomic<uint32_t> publishedCount[PROFILE_SCOPE_COUNT];
+static std::atomic<uint32_t> publishedWords[PROFILE_SCOPE_COUNT][HISTOGRAM_WORDS];
+static std::atomic<bool> resetDue[PROFILE_SCOPE_COUNT]; // profileReset() asked, the owner empties it
+
+static void publish(uint8_t scope)
+{
+  uint32_t words[HISTOGRAM_WORDS];
+  memcpy(words, &histograms[scope], sizeof(Histogram));
+  uint32_t count = publishedCount[scope].load(std::memory_order_relaxed);
+  publishedCount[scope].store(count + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < HISTOGRAM_WORDS; i++)
+  {
+    publishedWords[scope][i].store(words[i], std::memory_order_relaxed);
+  }
+  publishedCount[scope].store(count + 2, std::memory_order_release);
+}
+
+// A scope's histogram as last published, empty if a reset is pending
+static Histogram published(uint8_t scope)
+{
+  Histogram h;
+  uint32_t words[HISTOGRAM_WORDS];
+  uint32_t before, after;
+  do
+  {
+    before = publishedCount[scope].load(std::memory_order_acquire);
+    for (size_t i = 0; i < HISTOGRAM_WORDS; i++)
+    {
+      words[i] = publishedWords[scope][i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = publishedCount[scope].load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  memcpy(&h, words, sizeof(h));
+  if (resetDue[scope].load())
+  {
+    memset(&h, 0, sizeof(h));
+  }
+  return h;
+}
+
+void profileRecord(uint8_t scope, uint32_t cycles)
+{
+  Histogram &h = histograms[scope];
+  if (resetDue[scope].exchange(false))
+  {
+    memset(&h, 0, sizeof(h));
+  }
+  uint32_t us = cycles / PROFILE_CYCLES_PER_US;
+  uint8_t b = 0;
+  while (us > 1 && b < PROFILE_BUCKETS - 1)
+  {
+    us >>= 1;
+    b++;
+  }
+  h.bucket[b]++;
+  h.count++;
+  h.totalCycles += cycles;
+  if (cycles > h.maxCycles)
+  {
+    h.maxCycles = cycles;
+  }
+  publish(scope);
+}
+
+// Upper edge in us of the bucket holding the given fraction of the samples,
+// the maximum for the last bucket
+static uint32_t percentile(const Histogram &h, uint32_t perMille)
+{
+  uint32_t rank = ((uint64_t)h.count * perMille + 999) / 1000;
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < PROFILE_BUCKETS - 1; b++)
+  {
+    seen += h.bucket[b];
+    if (seen >= rank)
+    {
+      uint32_t edge = 2UL << b;
+      uint32_t maxUs = h.maxCycles / PROFILE_CYCLES_PER_US + 1;
+      return edge < maxUs ? edge : maxUs;
+    }
+  }
+  return h.maxCycles / PROFILE_CYCLES_PER_US + 1;
+}
+
+static size_t append(char *buffer, size_t size, size_t len, const char *format, ...)
+{
+  if (len >= size)
+  {
+    return len;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer + len, size - len, format, args);
+  va_end(args);
+  return n < 0 ? len : (len + n < size ? len + n : size - 1);
+}
+
+size_t profileText(char *buffer, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  buffer[0] = 0;
+  size_t len = append(buffer, size, 0, "%-24s %8s %10s %8s %8s %10s\n", "scope", "count", "mean us", "p50 <us", "p99 <us", "max us");
+  for (uint8_t s = 0; s < PROFILE_SCOPE_COUNT; s++)
+  {
+    Histogram h = published(s);
+    if (!h.count)
+    {
+      continue;
+    }
+    len = append(buffer, size, len, "%-24s %8u %10.1f %8u %8u %10.1f\n", profileScopeName[s], h.count,
+                 (double)h.totalCycles / h.count / PROFILE_CYCLES_PER_US, percentile(h, 500), percentile(h, 990),
+                 (double)h.maxCycles / PROFILE_CYCLES_PER_US);
+  }
+  return len;
+}
+
+void profileReset()
+{
+  for (std::atomic<bool> &due : resetDue)
+  {
+    due.store(true);
+  }
+}
+
+#endif
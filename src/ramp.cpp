@@ -0,0 +1,142 @@
+/* Volume ramp engine
+*********************/
+
+#include "ramp.h"
+#include "controller.h"
+#include "hal.h"
+#include "spibus.h"
+
+#define RAMP_ONE 1024 // fixed point 1.0 for ramp progress
+
+static int16_t level;         // level last written to the chip
+static bool muted = true;     // chip is muted
+static bool active = false;   // transition in progress
+static bool muteAtEnd;        // mute the chip when the transition finishes
+static int16_t startLevel;
+static int16_t targetLevel;
+static unsigned long milOnStart;
+static unsigned long milOnTick;
+static unsigned long duration;
+
+static void writeLevel(int16_t newLevel)
+{
+  if (muted || newLevel != level)
+  {
+    level = newLevel;
+    muted = false;
+    spiAcquire(SPI_DEVICE_MUSES);
+    Muses.setVolume(level, level);
+    spiRelease(SPI_DEVICE_MUSES);
+  }
+}
+
+// Progress 0..RAMP_ONE shaped by RAMP_CURVE
+static uint32_t shape(uint32_t t)
+{
+#if RAMP_CURVE == RAMP_EASE
+  return (t * t * (3 * RAMP_ONE - 2 * t)) / (RAMP_ONE * RAMP_ONE);
+#else
+  return t;
+#endif
+}
+
+void rampBegin()
+{
+  muted = true;
+  active = false;
+  level = VOLUME_MIN;
+}
+
+void rampTo(int16_t newLevel, unsigned long durationMs)
+{
+  muteAtEnd = false;
+  if (muted)
+  {
+    // start from the bottom of the range
+    level = VOLUME_MIN;
+  }
+  if (durationMs == 0 || newLevel == level)
+  {
+    active = false;
+    writeLevel(newLevel);
+    return;
+  }
+  if (muted)
+  {
+    writeLevel(VOLUME_MIN);
+  }
+  startLevel = level;
+  targetLevel = newLevel;
+  duration = durationMs;
+  milOnStart = millis();
+  milOnTick = milOnStart;
+  active = true;
+}
+
+void rampMute(unsigned long durationMs)
+{
+  if (muted)
+  {
+    active = false;
+    return;
+  }
+  rampTo(VOLUME_MIN, durationMs);
+  muteAtEnd = true;
+  if (!active)
+  {
+    spiAcquire(SPI_DEVICE_MUSES);
+    Muses.mute();
+    spiRelease(SPI_DEVICE_MUSES);
+    muted = true;
+  }
+}
+
+void rampVolume(int16_t newLevel)
+{
+  if (muted || (active && muteAtEnd))
+  {
+    rampTo(newLevel, RAMP_UNMUTE_MS);
+    return;
+  }
+  int16_t jump = newLevel > level ? newLevel - level : level - newLevel;
+  rampTo(newLevel, jump > RAMP_JUMP_STEPS ? RAMP_JUMP_MS : 0);
+}
+
+void rampUpdate()
+{
+  if (!active)
+  {
+    return;
+  }
+  unsigned long now = millis();
+  if (now - milOnTick < RAMP_TICK_MS)
+  {
+    return;
+  }
+  milOnTick = now;
+  unsigned long elapsed = now - milOnStart;
+  uint32_t t = elapsed >= duration ? RAMP_ONE : elapsed * RAMP_ONE / duration;
+  int32_t span = targetLevel - startLevel;
+  writeLevel(startLevel + (int32_t)(span * (int32_t)shape(t)) / RAMP_ONE);
+  if (t >= RAMP_ONE)
+  {
+    active = false;
+    if (muteAtEnd)
+    {
+      spiAcquire(SPI_DEVICE_MUSES);
+      Muses.mute();
+      spiRelease(SPI_DEVICE_MUSES);
+      muted = true;
+    }
+  }
+}
+
+bool rampActive()
+{
+  return active;
+}
+
+bool rampMuted()
+{
+  return muted && !active;
+}
@@ -0,0 +1,108 @@
+/* Write-behind settings cache
+*********************/
+
+#include "settings.h"
+#include "controller.h"
+#include "hal.h"
+#include "keymap.h"
+#include "trace.h"
+#include <atomic>
+
+// Preference modes
+#define RW_MODE false
+#define RO_MODE true
+
+static std::atomic<uint32_t> dirty(0);           // CHANGED_VOLUME / CHANGED_SOURCE / CHANGED_KEYMAP not yet written
+static std::atomic<unsigned long> milOnChange(0); // time of the last change
+static int16_t savedVolume;                      // values currently held in flash
+static uint8_t savedSource;
+static SettingsStats stats;
+
+void settingsBegin()
+{
+  // Load saved settings (volume, balance, source)
+  preferences.begin("settings", RW_MODE);
+  source = preferences.getUInt("SOURCE", 1);
+  volume = preferences.getInt("VOLUME", VOLUME_MIN);
+  // A corrupt or foreign namespace must not index past the taper tables
+  if (source < 1 || source > 4)
+  {
+    source = 1;
+  }
+  if (volume < VOLUME_MIN)
+  {
+    volume = VOLUME_MIN;
+  }
+  if (volume > VOLUME_MAX)
+  {
+    volume = VOLUME_MAX;
+  }
+  savedSource = source;
+  savedVolume = volume;
+}
+
+void settingsChanged(uint32_t changed)
+{
+  changed &= CHANGED_VOLUME | CHANGED_SOURCE | CHANGED_KEYMAP;
+  if (changed)
+  {
+    milOnChange = millis();
+    dirty.fetch_or(changed);
+  }
+}
+
+unsigned long settingsUpdate()
+{
+  if (!dirty)
+  {
+    return SETTINGS_IDLE_NONE;
+  }
+  unsigned long idle = millis() - milOnChange;
+  if (idle < SETTINGS_IDLE_MS)
+  {
+    return SETTINGS_IDLE_MS - idle;
+  }
+  settingsFlush();
+  return SETTINGS_IDLE_NONE;
+}
+
+void settingsFlush()
+{
+  uint32_t changed = dirty.exchange(0);
+  ControlSnapshot snapshot = controlSnapshot();
+  if ((changed & CHANGED_VOLUME) && snapshot.volume != savedVolume)
+  {
+    unsigned long start = micros();
+    savedVolume = snapshot.volume;
+    preferences.putInt("VOLUME", savedVolume);
+    traceSpan(TRACE_NVS, start, CHANGED_VOLUME);
+    stats.nvsWrites.fetch_add(1, std::memory_order_relaxed);
+  }
+  if ((changed & CHANGED_SOURCE) && snapshot.source != savedSource)
+  {
+    unsigned long start = micros();
+    savedSource = snapshot.source;
+    preferences.putUInt("SOURCE", savedSource);
+    traceSpan(TRACE_NVS, start, CHANGED_SOURCE);
+    stats.nvsWrites.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (changed & CHANGED_KEYMAP)
+  {
+    unsigned long start = micros();
+    bool saved = keymapSave();
+    traceSpan(TRACE_NVS, start, CHANGED_KEYMAP);
+    if (saved)
+    {
+      stats.fileWrites.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+      Serial.println(F("Key map could not be saved"));
+    }
+  }
+}
+
+const SettingsStats &settingsStats()
+{
+  return stats;
+}
@@ -0,0 +1,92 @@
+/* Shared SPI bus arbiter
+*********************/
+
+#include "spibus.h"
+#include "hal.h"
+#include "trace.h"
+#include <atomic>
+#include <mutex>
+
+static std::mutex bus;
+static std::atomic<uint8_t> priorityWaiting(0); // volume and relay writes waiting for the bus
+static std::atomic<uint8_t> owner(SPI_NO_DEVICE);
+static SpiBusStats stats;
+static unsigned long usOnAcquire;
+static unsigned long usOnChunk;
+
+const char *spiDeviceName[SPI_DEVICES] = {"TFT", "Muses72323", "MCP23S08"};
+
+// Only the bus holder updates a maximum, so a plain load and store will do
+static void raise(std::atomic<uint32_t> &max, uint32_t value)
+{
+  if (value > max.load(std::memory_order_relaxed))
+  {
+    max.store(value, std::memory_order_relaxed);
+  }
+}
+
+void spiAcquire(uint8_t device)
+{
+  unsigned long start = micros();
+  if (device == SPI_DEVICE_TFT)
+  {
+    // The mutex is not fair: without this the display could take the bus
+    // straight back from under a waiting volume write
+    while (priorityWaiting.load())
+    {
+      yield();
+    }
+    bus.lock();
+  }
+  else
+  {
+    priorityWaiting++;
+    bus.lock();
+    priorityWaiting--;
+  }
+  unsigned long now = micros();
+  raise(stats.waitUsMax[device], now - start);
+  stats.transactions[device].fetch_add(1, std::memory_order_relaxed);
+  usOnAcquire = now;
+  usOnChunk = now;
+  owner.store(device);
+  halBusClock(device);
+}
+
+void spiRelease(uint8_t device)
+{
+  unsigned long now = micros();
+  uint32_t held = now - usOnAcquire;
+  stats.busyUs[device].fetch_add(held, std::memory_order_relaxed);
+  raise(stats.holdUsMax[device], held);
+  if (device == SPI_DEVICE_TFT)
+  {
+    raise(stats.chunkUsMax, now - usOnChunk);
+  }
+  traceSpan(TRACE_SPI + device, usOnAcquire);
+  owner.store(SPI_NO_DEVICE);
+  bus.unlock();
+}
+
+bool spiYieldWanted()
+{
+  unsigned long now = micros();
+  raise(stats.chunkUsMax, now - usOnChunk);
+  usOnChunk = now;
+  if (priorityWaiting.load())
+  {
+    stats.yields.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+bool spiHeld(uint8_t device)
+{
+  return owner.load() == device;
+}
+
+const SpiBusStats &spiBusStats()
+{
+  return stats;
+}
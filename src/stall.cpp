@@ -0,0 +1,288 @@
+/* Loop stall watchdog
+*********************/
+
+#include "stall.h"
+
+#if STALL_WATCHDOG
+
+#include "hal.h"
+#include "profile.h"
+#include <mutex>
+#include <stdarg.h>
+#include <algorithm>
+
+#define STALL_FILE_MAGIC 0x314C5453 // "STL1"
+
+struct StallReport
+{
+  uint32_t magic;
+  uint32_t budgetUs; // sites from another budget are not comparable
+  StallRecord worst[STALL_WORST];
+};
+
+// The control task's place in its pass. Thread local, so the scopes other
+// tasks enter leave it alone; the alarm, which interrupts the control task,
+// reaches it through `control`.
+struct PassState
+{
+  volatile bool running;
+  std::atomic<bool> overran; // the alarm went off, `stall` holds where
+  volatile uint8_t scope;    // innermost scope running
+  volatile uint8_t last;     // last scope entered
+  uint32_t startUs;
+  StallRecord stall;
+};
+
+static thread_local PassState pass;
+static PassState *volatile control = nullptr;
+
+static StallStats stats;
+static std::mutex lock; // report, latest
+static StallReport report;
+static StallRecord latest;
+static std::atomic<bool> dirty(false);
+static bool saved = false;
+static unsigned long milOnSave = 0;
+
+static void empty(StallReport &r)
+{
+  memset(&r, 0, sizeof(r));
+  r.magic = STALL_FILE_MAGIC;
+  r.budgetUs = STALL_BUDGET_US;
+}
+
+void stallBegin()
+{
+  StallReport loaded;
+  if (halReadFile(STALL_FILE, (uint8_t *)&loaded, sizeof(loaded)) != sizeof(loaded) || loaded.magic != STALL_FILE_MAGIC ||
+      loaded.budgetUs != STALL_BUDGET_US)
+  {
+    empty(loaded);
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  report = loaded;
+}
+
+void stallPassBegin()
+{
+  control = &pass;
+  pass.overran.store(false);
+  pass.scope = STALL_NO_SCOPE;
+  pass.last = STALL_NO_SCOPE;
+  pass.running = true;
+  pass.startUs = micros();
+  halStallAlarm(STALL_BUDGET_US);
+}
+
+StallMark stallScopeEnter(uint8_t scope)
+{
+  StallMark mark = {pass.scope};
+  if (pass.running)
+  {
+    pass.scope = scope;
+    pass.last = scope;
+  }
+  return mark;
+}
+
+void stallScopeExit(const StallMark &mark)
+{
+  if (pass.running)
+  {
+    pass.scope = mark.scope;
+  }
+}
+
+void IRAM_ATTR stallOverrun(const uint32_t *pc, uint8_t frames)
+{
+  PassState *state = control;
+  if (!state || !state->running || state->overran.load())
+  {
+    return;
+  }
+  StallRecord &stall = state->stall;
+  stall.inScope = state->scope != STALL_NO_SCOPE;
+  stall.scope = stall.inScope ? state->scope : state->last;
+  stall.frames = frames < STALL_FRAMES ? frames : STALL_FRAMES;
+  for (uint8_t f = 0; f < stall.frames; f++)
+  {
+    stall.pc[f] = pc[f];
+  }
+  state->overran.store(true);
+}
+
+// The first frame is wherever the alarm caught the task, which differs from
+// one stall to the next; the calls that led there tell the sites apart
+static bool sameSite(const StallRecord &a, const StallRecord &b)
+{
+  return a.count && a.scope == b.scope && a.inScope == b.inScope && a.frames == b.frames &&
+         (a.frames == 0 || std::equal(a.pc + 1, a.pc + a.frames, b.pc + 1));
+}
+
+void stallPassEnd()
+{
+  halStallAlarm(0);
+  uint32_t us = micros() - pass.startUs;
+  pass.running = false;
+  if (us > stats.passUsMax.load(std::memory_order_relaxed))
+  {
+    stats.passUsMax.store(us, std::memory_order_relaxed);
+  }
+  if (us <= STALL_BUDGET_US)
+  {
+    return;
+  }
+  stats.stalls.fetch_add(1, std::memory_order_relaxed);
+
+  StallRecord &stall = pass.stall;
+  if (!pass.overran.load())
+  {
+    // Over budget by less than the alarm's latency
+    stall.inScope = false;
+    stall.scope = pass.last;
+    stall.frames = 0;
+  }
+  stall.reserved = 0;
+  std::fill(stall.pc + stall.frames, stall.pc + STALL_FRAMES, 0);
+  stall.us = us;
+  stall.count = 1;
+  stall.uptimeS = millis() / 1000;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    latest = stall;
+    // The same site again, else an empty slot, else the shortest one if this is longer
+    StallRecord *slot = std::find_if(report.worst, report.worst + STALL_WORST, [&](const StallRecord &r)
+                                     { return sameSite(r, stall); });
+    if (slot != report.worst + STALL_WORST)
+    {
+      slot->count++;
+      if (us > slot->us)
+      {
+        slot->us = us;
+        slot->uptimeS = stall.uptimeS;
+      }
+    }
+    else
+    {
+      slot = std::min_element(report.worst, report.worst + STALL_WORST, [](const StallRecord &a, const StallRecord &b)
+                              { return (a.count ? a.us : 0) < (b.count ? b.us : 0); });
+      if (!slot->count || us > slot->us)
+      {
+        *slot = stall;
+      }
+    }
+  }
+  dirty.store(true);
+  halStateChanged();
+}
+
+static size_t append(char *buffer, size_t size, size_t len, const char *format, ...)
+{
+  if (len >= size)
+  {
+    return len;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer + len, size - len, format, args);
+  va_end(args);
+  return n < 0 ? len : (len + n < size ? len + n : size - 1);
+}
+
+static size_t site(char *buffer, size_t size, size_t len, const StallRecord &r)
+{
+  if (r.scope < PROFILE_SCOPE_COUNT)
+  {
+    len = append(buffer, size, len, "%s %s", r.inScope ? "in" : "after", profileScopeName[r.scope]);
+  }
+  else
+  {
+    len = append(buffer, size, len, "outside any scope");
+  }
+  if (r.frames)
+  {
+    len = append(buffer, size, len, ", backtrace");
+  }
+  for (uint8_t f = 0; f < r.frames; f++)
+  {
+    len = append(buffer, size, len, " 0x%08lx", (unsigned long)r.pc[f]);
+  }
+  return append(buffer, size, len, "\n");
+}
+
+unsigned long stallUpdate()
+{
+  if (!dirty.load())
+  {
+    return STALL_SAVE_NONE;
+  }
+  unsigned long since = millis() - milOnSave;
+  if (saved && since < STALL_SAVE_MS)
+  {
+    return STALL_SAVE_MS - since;
+  }
+  dirty.store(false);
+  StallReport copy;
+  StallRecord stall;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    copy = report;
+    stall = latest;
+  }
+  halWriteFile(STALL_FILE, (const uint8_t *)&copy, sizeof(copy));
+  saved = true;
+  milOnSave = millis();
+  if (stall.count)
+  {
+    char line[160];
+    int len = snprintf(line, sizeof(line), "Loop stall %.1fms ", stall.us / 1000.0);
+    site(line, sizeof(line), len > 0 ? len : 0, stall);
+    Serial.printf("%s", line);
+  }
+  return STALL_SAVE_NONE;
+}
+
+size_t stallText(char *buffer, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  buffer[0] = 0;
+  StallReport copy;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    copy = report;
+  }
+  std::sort(copy.worst, copy.worst + STALL_WORST, [](const StallRecord &a, const StallRecord &b)
+            { return (a.count ? a.us : 0) > (b.count ? b.us : 0); });
+  size_t len = append(buffer, size, 0, "Control loop passes over %luus: %lu since boot, longest pass %luus\n", (unsigned long)STALL_BUDGET_US,
+                      (unsigned long)stats.stalls.load(), (unsigned long)stats.passUsMax.load());
+  len = append(buffer, size, len, "%10s %8s %10s  %s\n", "worst ms", "count", "uptime s", "where");
+  for (const StallRecord &r : copy.worst)
+  {
+    if (r.count)
+    {
+      len = append(buffer, size, len, "%10.1f %8lu %10lu  ", r.us / 1000.0, (unsigned long)r.count, (unsigned long)r.uptimeS);
+      len = site(buffer, size, len, r);
+    }
+  }
+  return len;
+}
+
+void stallClear()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    empty(report);
+    latest.count = 0;
+  }
+  dirty.store(true);
+}
+
+const StallStats &stallStats()
+{
+  return stats;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/* Volume taper
+*********************/
+
+#include "taper.h"
+#include "controller.h"
+
+#define TAPER_LEVELS (VOLUME_MAX - VOLUME_MIN + 1)
+
+struct TaperSegment
+{
+  int16_t floor;
+  uint8_t step;
+};
+
+static constexpr TaperSegment segments[] = VOLUME_TAPER;
+
+// The next position down from `level`, VOLUME_MIN - 1 past the bottom
+static constexpr int16_t nextLevel(int16_t level)
+{
+  for (const TaperSegment &segment : segments)
+  {
+    if (level > segment.floor)
+    {
+      int16_t next = level - segment.step;
+      return next < segment.floor ? segment.floor : next;
+    }
+  }
+  return VOLUME_MIN - 1;
+}
+
+static constexpr uint16_t countPositions()
+{
+  uint16_t count = 0;
+  for (int16_t level = VOLUME_MAX; level >= VOLUME_MIN; level = nextLevel(level))
+  {
+    count++;
+  }
+  return count;
+}
+
+static constexpr uint16_t positions = countPositions();
+
+// "-30.25dB"
+static constexpr void formatLabel(char *label, int16_t level)
+{
+  uint16_t hundredths = (level < 0 ? -level : level) * 25;
+  uint16_t whole = hundredths / 100;
+  uint8_t i = 0;
+  if (level < 0)
+  {
+    label[i++] = '-';
+  }
+  if (whole >= 100)
+  {
+    label[i++] = '0' + whole / 100;
+  }
+  if (whole >= 10)
+  {
+    label[i++] = '0' + whole / 10 % 10;
+  }
+  label[i++] = '0' + whole % 10;
+  label[i++] = '.';
+  label[i++] = '0' + hundredths / 10 % 10;
+  label[i++] = '0' + hundredths % 10;
+  label[i++] = 'd';
+  label[i++] = 'B';
+  label[i] = 0;
+}
+
+struct TaperTables
+{
+  int16_t level[positions];                  // chip step of each position, lowest first
+  uint16_t position[TAPER_LEVELS];           // position at or below each chip step
+  char label[TAPER_LEVELS][TAPER_LABEL_SIZE]; // indexed by chip step - VOLUME_MIN
+};
+
+static constexpr TaperTables buildTables()
+{
+  TaperTables tables = {};
+  int16_t level = VOLUME_MAX;
+  for (uint16_t p = positions; p-- > 0; level = nextLevel(level))
+  {
+    tables.level[p] = level;
+  }
+  uint16_t p = 0;
+  for (level = VOLUME_MIN; level <= VOLUME_MAX; level++)
+  {
+    if (p + 1 < positions && tables.level[p + 1] <= level)
+    {
+      p++;
+    }
+    tables.position[level - VOLUME_MIN] = p;
+    formatLabel(tables.label[level - VOLUME_MIN], level);
+  }
+  return tables;
+}
+
+static constexpr TaperTables tables = buildTables();
+
+static constexpr bool sameText(const char *a, const char *b)
+{
+  while (*a && *a == *b)
+  {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+static_assert(tables.level[0] == VOLUME_MIN && tables.level[positions - 1] == VOLUME_MAX, "taper must span the volume range");
+static_assert(sameText(tables.label[0], "-111.75dB") && sameText(tables.label[TAPER_LEVELS - 1], "0.00dB"), "dB labels");
+
+// Tables are indexed by chip step; anything outside the range is held at its end
+static int16_t inRange(int16_t level)
+{
+  return level < VOLUME_MIN ? VOLUME_MIN : (level > VOLUME_MAX ? VOLUME_MAX : level);
+}
+
+int16_t taperStep(int16_t level, int32_t steps)
+{
+  level = inRange(level);
+  int32_t p = tables.position[level - VOLUME_MIN];
+  if (steps < 0 && tables.level[p] < level)
+  {
+    steps++; // between two positions: the first step down lands on the lower one
+  }
+  p += steps;
+  if (p < 0)
+  {
+    p = 0;
+  }
+  if (p >= positions)
+  {
+    p = positions - 1;
+  }
+  return tables.level[p];
+}
+
+const char *taperLabel(int16_t level)
+{
+  return tables.label[inRange(level) - VOLUME_MIN];
+}
+
+uint16_t taperPositions()
+{
+  return positions;
+}
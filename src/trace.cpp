@@ -0,0 +1,150 @@
+/* Event trace
+*********************/
+
+#include "trace.h"
+#include "hal.h"
+
+static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0, "TRACE_EVENTS must be a power of two");
+
+// Rows of the trace, by task
+#define TRACK_ISR 0
+#define TRACK_CONTROL 1
+#define TRACK_ASYNC_TCP 2
+#define TRACK_RENDER 3
+#define TRACK_PERSIST 4
+#define TRACKS 5
+
+static const char *trackName[TRACKS] = {"interrupts", "control (loop)", "AsyncTCP", "render", "persist"};
+
+static const struct
+{
+  const char *name;
+  const char *category;
+  uint8_t track;
+} eventInfo[TRACE_TYPES] = {
+    {"knob", "input", TRACK_ISR},
+    {"button", "input", TRACK_ISR},
+    {"IR frame", "input", TRACK_CONTROL},
+    {"WebSocket message", "input", TRACK_ASYNC_TCP},
+    {"command applied", "control", TRACK_CONTROL},
+    {"SPI TFT", "spi", TRACK_RENDER},
+    {"SPI Muses72323", "spi", TRACK_CONTROL},
+    {"SPI MCP23S08", "spi", TRACK_CONTROL},
+    {"NVS write", "flash", TRACK_PERSIST},
+    {"frame drawn", "display", TRACK_RENDER},
+    {"client notified", "websocket", TRACK_RENDER},
+};
+
+static TraceEvent ring[TRACE_EVENTS];
+static std::atomic<uint32_t> head(0);
+
+static void IRAM_ATTR record(uint8_t type, uint32_t us, uint32_t dur, uint16_t arg)
+{
+  uint32_t position = head.fetch_add(1, std::memory_order_relaxed);
+  TraceEvent &event = ring[position & (TRACE_EVENTS - 1)];
+  event.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  event.us = us;
+  event.dur = dur;
+  event.type = type;
+  event.arg = arg;
+  event.sequence.store(position + 1, std::memory_order_release);
+}
+
+void IRAM_ATTR traceInstant(uint8_t type, uint16_t arg)
+{
+  record(type, micros(), 0, arg);
+}
+
+void traceSpan(uint8_t type, uint32_t startUs, uint16_t arg)
+{
+  uint32_t dur = micros() - startUs;
+  record(type, startUs, dur ? dur : 1, arg);
+}
+
+void traceExportBegin(TraceExport &trace)
+{
+  uint32_t end = head.load(std::memory_order_acquire);
+  uint32_t position = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+  trace.count = 0;
+  for (; position != end; position++)
+  {
+    TraceEvent &event = ring[position & (TRACE_EVENTS - 1)];
+    if (event.sequence.load(std::memory_order_acquire) != position + 1)
+    {
+      continue; // being written, or already overwritten
+    }
+    auto &copy = trace.events[trace.count];
+    copy.us = event.us;
+    copy.dur = event.dur;
+    copy.type = event.type;
+    copy.arg = event.arg;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (event.sequence.load(std::memory_order_relaxed) == position + 1 && copy.type < TRACE_TYPES)
+    {
+      trace.count++;
+    }
+  }
+  trace.next = 0;
+  trace.pieceLen = 0;
+  trace.piecePos = 0;
+}
+
+// Format item `next` into the piece buffer, false after the last one
+static bool formatPiece(TraceExport &trace)
+{
+  size_t item = trace.next++;
+  int len;
+  if (item < TRACKS)
+  {
+    len = snprintf(trace.piece, sizeof(trace.piece), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                   item == 0 ? "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" : ",", (unsigned)item, trackName[item]);
+  }
+  else if (item < TRACKS + trace.count)
+  {
+    const auto &event = trace.events[item - TRACKS];
+    if (event.dur)
+    {
+      len = snprintf(trace.piece, sizeof(trace.piece), ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":1,\"tid\":%u,\"args\":{\"arg\":%u}}",
+                     eventInfo[event.type].name, eventInfo[event.type].category, (unsigned long)event.us, (unsigned long)event.dur,
+                     eventInfo[event.type].track, event.arg);
+    }
+    else
+    {
+      len = snprintf(trace.piece, sizeof(trace.piece), ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":1,\"tid\":%u,\"args\":{\"arg\":%u}}",
+                     eventInfo[event.type].name, eventInfo[event.type].category, (unsigned long)event.us, eventInfo[event.type].track, event.arg);
+    }
+  }
+  else if (item == TRACKS + trace.count)
+  {
+    len = snprintf(trace.piece, sizeof(trace.piece), "]}");
+  }
+  else
+  {
+    return false;
+  }
+  trace.pieceLen = len > 0 && (size_t)len < sizeof(trace.piece) ? len : 0;
+  trace.piecePos = 0;
+  return true;
+}
+
+size_t traceExportRead(TraceExport &trace, uint8_t *buffer, size_t size)
+{
+  size_t len = 0;
+  while (len < size)
+  {
+    if (trace.piecePos == trace.pieceLen && !formatPiece(trace))
+    {
+      break;
+    }
+    size_t n = trace.pieceLen - trace.piecePos;
+    if (n > size - len)
+    {
+      n = size - len;
+    }
+    memcpy(buffer + len, trace.piece + trace.piecePos, n);
+    trace.piecePos += n;
+    len += n;
+  }
+  return len;
+}
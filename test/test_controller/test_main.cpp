@@ -0,0 +1,234 @@
+/* Controller regression
+*********************/
+
+#include <unity.h>
+#include "host.h"
+#include "command.h"
+#include "ramp.h"
+#include "taper.h"
+#include "accel.h"
+#include "keymap.h"
+#include "ir.h"
+
+static PathTimer knobPath = {"knob"};
+static PathTimer irPath = {"IR remote"};
+static PathTimer wsPath = {"WebSocket"};
+static PathTimer binaryPath = {"WebSocket bin"};
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Run the control loop until any volume ramp has finished
+static void rampDone()
+{
+  while (rampActive())
+    idle(1000);
+  settle();
+}
+
+void test_boot_restores_saved_volume_and_source()
+{
+  rampDone();
+  TEST_ASSERT_EQUAL_INT16(-200, volume);
+  TEST_ASSERT_EQUAL_UINT8(2, source);
+  TEST_ASSERT_EQUAL_HEX8(1 << 1, MCP.latch); // the stale second relay opened
+  TEST_ASSERT_TRUE(Muses.zeroCrossing);
+}
+
+void test_knob_steps_volume_through_the_taper()
+{
+  int16_t start = volume;
+  knob(knobPath, 1, 250);
+  TEST_ASSERT_EQUAL_INT16(taperStep(start, 1), volume);
+  knob(knobPath, -1, 250);
+  TEST_ASSERT_EQUAL_INT16(start, volume);
+  rampDone();
+  TEST_ASSERT_EQUAL_INT16(volume, Muses.left);
+  TEST_ASSERT_EQUAL_INT16(volume, Muses.right);
+}
+
+void test_button_and_knob_select_a_source()
+{
+  uint8_t start = source;
+  encoderPressed();
+  commandUpdate();
+  TEST_ASSERT_EQUAL(STATE_IO, state);
+  knob(knobPath, 1);
+  waitSwitch();
+  TEST_ASSERT_EQUAL_UINT8(start % 4 + 1, source);
+  TEST_ASSERT_EQUAL_HEX8(1 << (source - 1), MCP.latch);
+  idle((TIME_EXITSELECT + 1) * 1000000UL);
+  commandUpdate();
+  TEST_ASSERT_EQUAL(STATE_RUN, state);
+  uint8_t selected = source;
+  knob(knobPath, 1); // back to volume
+  TEST_ASSERT_EQUAL_UINT8(selected, source);
+}
+
+void test_remote_keys_select_mute_and_step()
+{
+  remote(irPath, IR_RC5, 0, 0x10, 3); // Tuner
+  waitSwitch();
+  TEST_ASSERT_EQUAL_UINT8(4, source);
+  bool muted = isMuted;
+  remote(irPath, IR_RC5, 1, 0x10, 13);
+  TEST_ASSERT_TRUE(isMuted != muted);
+  remote(irPath, IR_RC5, 0, 0x10, 13);
+  TEST_ASSERT_EQUAL(muted, isMuted);
+  int16_t start = volume;
+  for (int i = 0; i < 5; i++)
+    remote(irPath, IR_RC5, 1, 0x10, 16); // held volume up
+  TEST_ASSERT_GREATER_THAN(start, volume);
+}
+
+// Volume moved by a volume up key held for ms, from the same level each time
+static int16_t holdVolumeUp(uint8_t protocol, uint16_t address, unsigned char command, unsigned long ms)
+{
+  webSocket(wsPath, "{\"Volume\":-300}");
+  rampDone();
+  idle(ACCEL_RESET_MS * 1000UL);
+  unsigned long start = millis();
+  while (millis() - start < ms)
+    remote(irPath, protocol, 1, address, command);
+  return volume + 300;
+}
+
+void test_held_keys_step_alike_on_every_protocol()
+{
+  learnStart(KEY_VOLUME_UP);
+  remote(irPath, IR_SIRC, 0, 1, 18);
+  int16_t rc5 = holdVolumeUp(IR_RC5, 0x10, 16, 700);
+  int16_t sirc = holdVolumeUp(IR_SIRC, 1, 18, 700);
+  TEST_ASSERT_GREATER_THAN(0, rc5);
+  TEST_ASSERT_GREATER_OR_EQUAL(rc5 / 2, sirc);
+  TEST_ASSERT_LESS_OR_EQUAL(rc5 * 2, sirc);
+}
+
+void test_websocket_commands()
+{
+  webSocket(wsPath, "{\"CD\":\"toggle\"}");
+  TEST_ASSERT_EQUAL_UINT8(3, source);
+  webSocket(wsPath, "{\"VolumeDb\":-40}");
+  TEST_ASSERT_EQUAL_INT16(-160, volume);
+  int16_t start = volume;
+  webSocket(wsPath, "{\"Voldown\":\"toggle\"}");
+  TEST_ASSERT_EQUAL_INT16(taperStep(start, -1), volume);
+  webSocket(wsPath, "{\"Source\":\"Tuner\",\"Volume\":-100,\"Mute\":false}");
+  TEST_ASSERT_EQUAL_UINT8(4, source);
+  TEST_ASSERT_EQUAL_INT16(-100, volume);
+  TEST_ASSERT_FALSE(isMuted);
+  webSocket(wsPath, "[{\"Source\":1},{\"Volume\":-90},{\"Mute\":\"toggle\"}]");
+  TEST_ASSERT_EQUAL_UINT8(1, source);
+  TEST_ASSERT_EQUAL_INT16(-90, volume);
+  TEST_ASSERT_TRUE(isMuted);
+  webSocket(wsPath, "{\"Mute\":false}");
+  rampDone();
+  TEST_ASSERT_FALSE(Muses.muted);
+  TEST_ASSERT_EQUAL_INT16(-90, Muses.left);
+}
+
+void test_other_tasks_see_the_published_state()
+{
+  webSocket(wsPath, "{\"Source\":3,\"Volume\":-150,\"Mute\":true}");
+  ControlSnapshot snapshot = controlSnapshot();
+  TEST_ASSERT_EQUAL_UINT8(3, snapshot.source);
+  TEST_ASSERT_EQUAL_INT16(-150, snapshot.volume);
+  TEST_ASSERT_TRUE(snapshot.muted);
+  TEST_ASSERT_FALSE(snapshot.standby);
+  webSocket(wsPath, "{\"Mute\":false}");
+  TEST_ASSERT_FALSE(controlSnapshot().muted);
+}
+
+void test_long_batches_share_the_long_buffers()
+{
+  std::string batch = "[";
+  for (int16_t level = -200; level <= -100; level += 10)
+    batch += "{\"Volume\":" + std::to_string(level) + "},";
+  batch += "{\"Source\":2}]";
+  TEST_ASSERT_TRUE(batch.size() > COMMAND_DATA_MAX);
+  webSocket(wsPath, batch.c_str());
+  TEST_ASSERT_EQUAL_UINT8(2, source);
+  TEST_ASSERT_EQUAL_INT16(-100, volume);
+
+  // Every long buffer taken, then freed as the batches are applied
+  std::string padded = "{\"Volume\":-120}" + std::string(COMMAND_DATA_MAX, ' ');
+  for (int i = 0; i < COMMAND_LONG_BUFFERS; i++)
+    TEST_ASSERT_TRUE(commandQueue(COMMAND_WS_TEXT, 1, padded.data(), padded.size(), micros()));
+  TEST_ASSERT_FALSE(commandQueue(COMMAND_WS_TEXT, 1, padded.data(), padded.size(), micros()));
+  commandUpdate();
+  TEST_ASSERT_EQUAL_INT16(-120, volume);
+  std::string tooLong(COMMAND_LONG_MAX + 1, ' ');
+  TEST_ASSERT_FALSE(commandQueue(COMMAND_WS_TEXT, 1, tooLong.data(), tooLong.size(), micros()));
+  webSocket(wsPath, padded.c_str());
+  settle();
+  rampDone();
+}
+
+void test_standby_then_knob_wakes_to_the_same_level()
+{
+  rampDone();
+  int16_t level = Muses.left;
+  uint8_t before = source;
+  remote(irPath, IR_RC5, 0, 0x10, 12);
+  idle(RAMP_MUTE_MS * 1000UL);
+  settle();
+  TEST_ASSERT_TRUE(inStandby());
+  TEST_ASSERT_TRUE(Muses.muted);
+  TEST_ASSERT_TRUE(tft.sleeping);
+  knob(knobPath, 1); // only wakes, the level is not stepped
+  rampDone();
+  TEST_ASSERT_FALSE(inStandby());
+  TEST_ASSERT_FALSE(Muses.muted);
+  TEST_ASSERT_EQUAL_INT16(level, Muses.left);
+  TEST_ASSERT_EQUAL_UINT8(before, source);
+  TEST_ASSERT_FALSE(tft.sleeping);
+}
+
+void test_only_a_valid_binary_command_leaves_standby()
+{
+  rampDone();
+  remote(irPath, IR_RC5, 1, 0x10, 12);
+  idle(RAMP_MUTE_MS * 1000UL);
+  settle();
+  TEST_ASSERT_TRUE(inStandby());
+  binaryCommand(binaryPath, BINARY_CMD_SOURCE, 9);
+  binaryCommand(binaryPath, 99);
+  TEST_ASSERT_TRUE(inStandby());
+  TEST_ASSERT_TRUE(Muses.muted);
+  binaryCommand(binaryPath, BINARY_CMD_SOURCE, 2);
+  rampDone();
+  TEST_ASSERT_FALSE(inStandby());
+  TEST_ASSERT_EQUAL_UINT8(2, source);
+}
+
+void test_every_transfer_held_the_bus()
+{
+  TEST_ASSERT_EQUAL_UINT32(0, hostBusFaults);
+}
+
+int main()
+{
+  preferences.putInt("VOLUME", -200);
+  preferences.putUInt("SOURCE", 2);
+  MCP.latch = 0x06; // relays left by the previous run, two closed
+  hostBoot();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_boot_restores_saved_volume_and_source);
+  RUN_TEST(test_knob_steps_volume_through_the_taper);
+  RUN_TEST(test_button_and_knob_select_a_source);
+  RUN_TEST(test_remote_keys_select_mute_and_step);
+  RUN_TEST(test_held_keys_step_alike_on_every_protocol);
+  RUN_TEST(test_websocket_commands);
+  RUN_TEST(test_other_tasks_see_the_published_state);
+  RUN_TEST(test_long_batches_share_the_long_buffers);
+  RUN_TEST(test_standby_then_knob_wakes_to_the_same_level);
+  RUN_TEST(test_only_a_valid_binary_command_leaves_standby);
+  RUN_TEST(test_every_transfer_held_the_bus);
+  return UNITY_END();
+}
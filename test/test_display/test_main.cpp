@@ -0,0 +1,193 @@
+/* TFT scene compositor
+*********************/
+
+#include <unity.h>
+#include "host.h"
+#include "display.h"
+
+#define SCREEN_PIXELS (HOST_TFT_WIDTH * HOST_TFT_HEIGHT)
+
+static bool smoothFonts; // the fonts in data/ were loaded at boot
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// The panel as it is, against the panel redrawn from scratch
+static bool matchesFullRedraw()
+{
+  std::vector<uint16_t> panel = tft.frame;
+  displayClear();
+  displayUpdate();
+  return panel == tft.frame;
+}
+
+void test_unchanged_text_pushes_nothing()
+{
+  displaySetLevel(-120, false);
+  displaySetSource("CD");
+  displayUpdate();
+  displaySetLevel(-120, false);
+  displaySetSource("CD");
+  TEST_ASSERT_EQUAL_UINT32(0, displayUpdate());
+}
+
+void test_level_steps_push_part_of_the_screen_without_fills()
+{
+  uint32_t fills = tft.fills;
+  for (int16_t level = -121; level > -140; level--)
+  {
+    displaySetLevel(level, false);
+    uint32_t pixels = displayUpdate();
+    TEST_ASSERT_GREATER_THAN(0, pixels);
+    TEST_ASSERT_LESS_THAN(SCREEN_PIXELS / 4, pixels);
+  }
+  TEST_ASSERT_EQUAL_UINT32(fills, tft.fills);
+  TEST_ASSERT_TRUE(matchesFullRedraw());
+}
+
+// Ten clock ticks after the first time is drawn, each pushing at most limit pixels
+static void clockTicks(uint32_t limit)
+{
+  char clock[16];
+  displaySetClock("12:34:54");
+  displayUpdate();
+  for (int sec = 55; sec < 65; sec++)
+  {
+    snprintf(clock, sizeof(clock), "12:%02d:%02d", 34 + sec / 60, sec % 60);
+    displaySetClock(clock);
+    uint32_t pixels = displayUpdate();
+    TEST_ASSERT_GREATER_THAN(0, pixels);
+    TEST_ASSERT_LESS_THAN(limit, pixels);
+  }
+}
+
+void test_clock_ticks_leave_the_panel_as_a_full_redraw()
+{
+  // A smooth tick pushes only the changed digits' ink rows
+  clockTicks(smoothFonts ? SCREEN_PIXELS / 50 : SCREEN_PIXELS / 10);
+  TEST_ASSERT_TRUE(matchesFullRedraw());
+}
+
+void test_mute_and_back_restores_the_same_pixels()
+{
+  displaySetLevel(-90, false);
+  displayUpdate();
+  std::vector<uint16_t> before = tft.frame;
+  displaySetLevel(-90, true);
+  displayUpdate();
+  TEST_ASSERT_TRUE(before != tft.frame);
+  displaySetLevel(-90, false);
+  displayUpdate();
+  TEST_ASSERT_TRUE(before == tft.frame);
+}
+
+void test_source_names_leave_the_panel_as_a_full_redraw()
+{
+  const char *names[] = {"Phono", "Media", "CD", "Tuner", "Phono"};
+  for (const char *name : names)
+  {
+    displaySetSource(name);
+    displayUpdate();
+  }
+  TEST_ASSERT_TRUE(matchesFullRedraw());
+}
+
+// Without DMA-capable memory the rows are pushed blocking, to the same pixels
+void test_without_dma_buffers_rows_draw_the_same_panel()
+{
+  displaySetLevel(-75, false);
+  displaySetSource("Media");
+  displayUpdate();
+  displayClear();
+  displayUpdate();
+  std::vector<uint16_t> withDma = tft.frame;
+  hostDmaFails = true;
+  displayBegin();
+  hostDmaFails = false;
+  uint32_t dmaPushes = tft.dmaPushes;
+  displayClear();
+  TEST_ASSERT_GREATER_THAN(0, displayUpdate());
+  TEST_ASSERT_EQUAL_UINT32(dmaPushes, tft.dmaPushes);
+  TEST_ASSERT_TRUE(withDma == tft.frame);
+  displaySetLevel(-76, false);
+  displayUpdate();
+  TEST_ASSERT_TRUE(matchesFullRedraw());
+  displayBegin();
+  displayClear();
+  displayUpdate();
+}
+
+// With neither smooth font loaded everything is drawn in the built-in
+// fonts, which still push only what changed
+void test_builtin_fonts_push_part_of_the_screen()
+{
+  TEST_ASSERT_FALSE(displayLoadFont(DISPLAY_FONT_READOUT, nullptr, 0));
+  TEST_ASSERT_FALSE(displayLoadFont(DISPLAY_FONT_CLOCK, nullptr, 0));
+  displayUpdate();
+  clockTicks(SCREEN_PIXELS / 10);
+  for (int16_t level = -41; level > -50; level--)
+  {
+    displaySetLevel(level, false);
+    TEST_ASSERT_LESS_THAN(SCREEN_PIXELS / 4, displayUpdate());
+  }
+  displaySetSource("Tuner");
+  displayUpdate();
+  displaySetSource("Phono");
+  TEST_ASSERT_LESS_THAN(SCREEN_PIXELS / 4, displayUpdate());
+  TEST_ASSERT_TRUE(matchesFullRedraw());
+  bool loaded = loadFont(DISPLAY_FONT_READOUT, "data/NotoSansBold36.vlw") &&
+                loadFont(DISPLAY_FONT_CLOCK, "data/NotoSansMonoSCB20.vlw");
+  displayUpdate();
+  if (!loaded)
+    TEST_IGNORE_MESSAGE("smooth fonts not found in data/");
+}
+
+static void putInt(std::vector<uint8_t> &vlw, size_t at, int32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    vlw[at + i] = (uint32_t)value >> (24 - 8 * i);
+}
+
+// Damaged fonts are refused whole and the level is drawn in the built-in font
+void test_damaged_font_falls_back_to_the_builtin_font()
+{
+  std::vector<uint8_t> good = hostFile("data/NotoSansBold36.vlw");
+  if (good.empty())
+    TEST_IGNORE_MESSAGE("data/NotoSansBold36.vlw not found");
+  std::vector<std::vector<uint8_t>> damaged(5, good);
+  damaged[0].resize(good.size() / 2);     // bitmaps cut off
+  putInt(damaged[1], 0, 0x7FFFFFFF);      // glyph count past the end of the file
+  putInt(damaged[2], 16, -5);             // ascent
+  putInt(damaged[3], 24 + 8, 1000);       // first glyph's width
+  putInt(damaged[4], 24 + 28 + 20, 300);  // second glyph's dx
+  for (std::vector<uint8_t> &vlw : damaged)
+  {
+    TEST_ASSERT_FALSE(displayLoadFont(DISPLAY_FONT_READOUT, vlw.data(), vlw.size()));
+    displaySetLevel(-60, false);
+    TEST_ASSERT_GREATER_THAN(0, displayUpdate());
+    TEST_ASSERT_TRUE(matchesFullRedraw());
+  }
+  TEST_ASSERT_TRUE(displayLoadFont(DISPLAY_FONT_READOUT, good.data(), good.size()));
+}
+
+int main()
+{
+  smoothFonts = hostBoot();
+  displayUpdate();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_unchanged_text_pushes_nothing);
+  RUN_TEST(test_level_steps_push_part_of_the_screen_without_fills);
+  RUN_TEST(test_clock_ticks_leave_the_panel_as_a_full_redraw);
+  RUN_TEST(test_mute_and_back_restores_the_same_pixels);
+  RUN_TEST(test_source_names_leave_the_panel_as_a_full_redraw);
+  RUN_TEST(test_without_dma_buffers_rows_draw_the_same_panel);
+  RUN_TEST(test_builtin_fonts_push_part_of_the_screen);
+  RUN_TEST(test_damaged_font_falls_back_to_the_builtin_font);
+  return UNITY_END();
+}
@@ -0,0 +1,107 @@
+/* Write-behind settings cache
+*********************/
+
+#include <unity.h>
+#include "host.h"
+#include "settings.h"
+#include "taper.h"
+
+static PathTimer knobPath = {"knob"};
+static PathTimer wsPath = {"WebSocket"};
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Let anything still pending go out, then count NVS writes from there
+static uint32_t writesAfterIdle()
+{
+  idle(SETTINGS_IDLE_MS * 1000UL);
+  settle();
+  return preferences.writes;
+}
+
+void test_knob_sweep_writes_volume_once()
+{
+  uint32_t start = writesAfterIdle();
+  int16_t before = volume;
+  knob(knobPath, 100, 20); // 50 detents per second
+  knob(knobPath, -60, 250); // slow turn, single steps
+  TEST_ASSERT_TRUE(volume != before);
+  TEST_ASSERT_EQUAL_UINT32(0, preferences.writes - start);
+  TEST_ASSERT_EQUAL_UINT32(1, writesAfterIdle() - start);
+  TEST_ASSERT_EQUAL_INT16(volume, preferences.getInt("VOLUME", 0));
+}
+
+void test_back_to_saved_volume_writes_nothing()
+{
+  uint32_t start = writesAfterIdle();
+  knob(knobPath, 5, 250);
+  knob(knobPath, -5, 250);
+  TEST_ASSERT_EQUAL_UINT32(0, writesAfterIdle() - start);
+}
+
+void test_volume_and_source_write_once_each()
+{
+  uint32_t start = writesAfterIdle();
+  knob(knobPath, 3, 250);
+  webSocket(wsPath, source == 3 ? "{\"Source\":1}" : "{\"Source\":3}");
+  TEST_ASSERT_EQUAL_UINT32(0, preferences.writes - start);
+  TEST_ASSERT_EQUAL_UINT32(2, writesAfterIdle() - start);
+  TEST_ASSERT_EQUAL_UINT32(source, preferences.getUInt("SOURCE", 0));
+}
+
+void test_flush_writes_pending_change_at_once()
+{
+  uint32_t start = writesAfterIdle();
+  knob(knobPath, -2, 250);
+  settingsFlush();
+  TEST_ASSERT_EQUAL_UINT32(1, preferences.writes - start);
+  TEST_ASSERT_EQUAL_UINT32(1, writesAfterIdle() - start);
+}
+
+void test_out_of_range_values_load_clamped()
+{
+  int16_t keptVolume = volume;
+  uint8_t keptSource = source;
+  preferences.putInt("VOLUME", VOLUME_MIN - 1000);
+  preferences.putUInt("SOURCE", 9);
+  settingsBegin();
+  TEST_ASSERT_EQUAL_INT16(VOLUME_MIN, volume);
+  TEST_ASSERT_EQUAL_UINT8(1, source);
+  preferences.putInt("VOLUME", VOLUME_MAX + 40);
+  settingsBegin();
+  TEST_ASSERT_EQUAL_INT16(VOLUME_MAX, volume);
+  preferences.putInt("VOLUME", keptVolume);
+  preferences.putUInt("SOURCE", keptSource);
+  settingsBegin();
+}
+
+void test_taper_holds_out_of_range_levels_at_the_ends()
+{
+  TEST_ASSERT_EQUAL_INT16(VOLUME_MIN, taperStep(VOLUME_MIN - 100, 0));
+  TEST_ASSERT_EQUAL_INT16(VOLUME_MAX, taperStep(VOLUME_MAX + 100, 1));
+  TEST_ASSERT_EQUAL_STRING("-111.75dB", taperLabel(-1000));
+  TEST_ASSERT_EQUAL_STRING("0.00dB", taperLabel(VOLUME_MAX + 1));
+}
+
+int main()
+{
+  preferences.putInt("VOLUME", -200);
+  preferences.putUInt("SOURCE", 2);
+  preferences.writes = 0;
+  hostBoot();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_knob_sweep_writes_volume_once);
+  RUN_TEST(test_back_to_saved_volume_writes_nothing);
+  RUN_TEST(test_volume_and_source_write_once_each);
+  RUN_TEST(test_flush_writes_pending_change_at_once);
+  RUN_TEST(test_out_of_range_values_load_clamped);
+  RUN_TEST(test_taper_holds_out_of_range_levels_at_the_ends);
+  return UNITY_END();
+}